@@ -0,0 +1,57 @@
+#pragma once
+
+#include <vector.h>
+
+#include <limits>
+
+template <class T>
+class BasicBoundingBox {
+public:
+    BasicBoundingBox()
+        : min_({kInfinity, kInfinity, kInfinity}), max_({-kInfinity, -kInfinity, -kInfinity}) {
+    }
+    BasicBoundingBox(BasicVector<T> min, BasicVector<T> max) : min_(min), max_(max) {
+    }
+
+    void Extend(const BasicVector<T>& point) {
+        for (int i = 0; i < 3; ++i) {
+            min_[i] = std::min(min_[i], point[i]);
+            max_[i] = std::max(max_[i], point[i]);
+        }
+    }
+    void Extend(const BasicBoundingBox& box) {
+        for (int i = 0; i < 3; ++i) {
+            min_[i] = std::min(min_[i], box.min_[i]);
+            max_[i] = std::max(max_[i], box.max_[i]);
+        }
+    }
+
+    bool Empty() const {
+        return min_[0] > max_[0] || min_[1] > max_[1] || min_[2] > max_[2];
+    }
+    T SurfaceArea() const {
+        if (Empty()) {
+            return 0;
+        }
+        BasicVector<T> size = max_ - min_;
+        return 2 * (size[0] * size[1] + size[1] * size[2] + size[2] * size[0]);
+    }
+    BasicVector<T> GetCenter() const {
+        return 0.5 * (min_ + max_);
+    }
+
+    const BasicVector<T>& GetMin() const {
+        return min_;
+    }
+    const BasicVector<T>& GetMax() const {
+        return max_;
+    }
+
+private:
+    static constexpr double kInfinity = std::numeric_limits<double>::infinity();
+
+    BasicVector<T> min_;
+    BasicVector<T> max_;
+};
+
+using BoundingBox = BasicBoundingBox<Scalar>;
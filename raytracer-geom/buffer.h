@@ -0,0 +1,53 @@
+#pragma once
+
+#include <cstddef>
+#include <memory>
+#include <vector>
+
+// Immutable array that either owns its elements or views memory kept alive by another object,
+// e.g. a memory-mapped cache file. Copies share the elements.
+template <class T>
+class Buffer {
+public:
+    Buffer() {
+    }
+
+    Buffer(std::vector<T> values) {
+        auto owner = std::make_shared<const std::vector<T>>(std::move(values));
+        data_ = owner->data();
+        size_ = owner->size();
+        owner_ = std::move(owner);
+    }
+
+    // size elements at data, valid for as long as owner is alive
+    Buffer(std::shared_ptr<const void> owner, const T* data, size_t size)
+        : owner_(std::move(owner)), data_(data), size_(size) {
+    }
+
+    const T& operator[](size_t index) const {
+        return data_[index];
+    }
+    const T* data() const {
+        return data_;
+    }
+    size_t size() const {
+        return size_;
+    }
+    bool empty() const {
+        return size_ == 0;
+    }
+    const T* begin() const {
+        return data_;
+    }
+    const T* end() const {
+        return data_ + size_;
+    }
+    const T& back() const {
+        return data_[size_ - 1];
+    }
+
+private:
+    std::shared_ptr<const void> owner_;
+    const T* data_ = nullptr;
+    size_t size_ = 0;
+};
@@ -0,0 +1,424 @@
+#pragma once
+
+#include <vector.h>
+#include <ray.h>
+#include <bounding_box.h>
+#include <ray_packet.h>
+#include <buffer.h>
+
+#include <vector>
+#include <array>
+#include <cmath>
+#include <iterator>
+#include <cstdint>
+#include <numeric>
+#include <limits>
+#include <algorithm>
+#include <type_traits>
+
+template <class T>
+struct BasicBvhNode {
+    BasicBoundingBox<T> box;
+    // first primitive for leaves, index of the right child for inner nodes
+    // (the left child always follows its parent)
+    uint32_t offset = 0;
+    uint32_t count = 0;  // 0 for inner nodes
+
+    bool IsLeaf() const {
+        return count != 0;
+    }
+};
+
+using BvhNode = BasicBvhNode<Scalar>;
+
+// Binned SAH build of BasicBvh, fills the nodes and the primitive order.
+template <class T>
+class BvhBuilder {
+public:
+    static constexpr size_t kMaxDepth = 64;
+
+    BvhBuilder(std::vector<BasicBvhNode<T>>* nodes, std::vector<uint32_t>* primitives,
+               size_t leaf_block_width)
+        : nodes_(*nodes), primitives_(*primitives), leaf_block_width_(leaf_block_width) {
+    }
+
+    void Build(const std::vector<BasicBoundingBox<T>>& boxes) {
+        if (boxes.empty()) {
+            return;
+        }
+        primitives_.resize(boxes.size());
+        std::iota(primitives_.begin(), primitives_.end(), 0);
+
+        std::vector<BasicVector<T>> centers(boxes.size());
+        for (size_t i = 0; i < boxes.size(); ++i) {
+            centers[i] = boxes[i].GetCenter();
+        }
+        nodes_.reserve(2 * boxes.size());
+        nodes_.emplace_back();
+        Build(boxes, centers, 0, 0, primitives_.size());
+    }
+
+private:
+    static constexpr size_t kBins = 16;
+    static constexpr size_t kMaxLeafSize = 8;
+    // cost of visiting an inner node relative to one primitive test
+    static constexpr double kTraversalCost = 1.;
+
+    void Build(const std::vector<BasicBoundingBox<T>>& boxes,
+               const std::vector<BasicVector<T>>& centers, uint32_t node_index, size_t begin,
+               size_t end, size_t depth = 0) {
+        BasicBoundingBox<T> box;
+        BasicBoundingBox<T> center_box;
+        for (size_t i = begin; i < end; ++i) {
+            box.Extend(boxes[primitives_[i]]);
+            center_box.Extend(centers[primitives_[i]]);
+        }
+        nodes_[node_index].box = box;
+
+        size_t count = end - begin;
+        size_t middle = count <= 1 ? end : Split(boxes, centers, box, center_box, begin, end);
+        if (middle == end && count > std::max(kMaxLeafSize, leaf_block_width_) &&
+            depth + 1 < kMaxDepth) {
+            // coincident centers or no profitable split, but the leaf would be too large
+            middle = begin + count / 2;
+        }
+        if (middle == end || depth + 1 >= kMaxDepth) {
+            nodes_[node_index].offset = begin;
+            nodes_[node_index].count = count;
+            return;
+        }
+
+        uint32_t left = nodes_.size();
+        nodes_.emplace_back();
+        Build(boxes, centers, left, begin, middle, depth + 1);
+        uint32_t right = nodes_.size();
+        nodes_.emplace_back();
+        nodes_[node_index].offset = right;
+        Build(boxes, centers, right, middle, end, depth + 1);
+    }
+
+    // Partitions [begin, end) by the cheapest binned SAH plane, returns the partition point or
+    // end if keeping the primitives in one leaf is cheaper.
+    size_t Split(const std::vector<BasicBoundingBox<T>>& boxes,
+                 const std::vector<BasicVector<T>>& centers, const BasicBoundingBox<T>& box,
+                 const BasicBoundingBox<T>& center_box, size_t begin,
+                 size_t end) {
+        double best_cost = LeafCost(end - begin);
+        int best_axis = -1;
+        size_t best_bin = 0;
+
+        for (int axis = 0; axis < 3; ++axis) {
+            double low = center_box.GetMin()[axis];
+            double extent = center_box.GetMax()[axis] - low;
+            if (extent <= 0) {
+                continue;
+            }
+            std::array<BasicBoundingBox<T>, kBins> bin_boxes;
+            std::array<size_t, kBins> bin_counts{};
+            for (size_t i = begin; i < end; ++i) {
+                size_t bin = GetBin(centers[primitives_[i]][axis], low, extent);
+                bin_boxes[bin].Extend(boxes[primitives_[i]]);
+                ++bin_counts[bin];
+            }
+
+            // right_areas[k] and right_counts[k] describe bins k..kBins-1
+            std::array<double, kBins> right_areas;
+            std::array<size_t, kBins> right_counts;
+            BasicBoundingBox<T> right;
+            size_t right_count = 0;
+            for (size_t k = kBins; k-- > 0;) {
+                right.Extend(bin_boxes[k]);
+                right_count += bin_counts[k];
+                right_areas[k] = right.SurfaceArea();
+                right_counts[k] = right_count;
+            }
+
+            BasicBoundingBox<T> left;
+            size_t left_count = 0;
+            for (size_t k = 0; k + 1 < kBins; ++k) {
+                left.Extend(bin_boxes[k]);
+                left_count += bin_counts[k];
+                if (left_count == 0 || right_counts[k + 1] == 0) {
+                    continue;
+                }
+                double left_cost = left.SurfaceArea() * LeafCost(left_count);
+                double right_cost = right_areas[k + 1] * LeafCost(right_counts[k + 1]);
+                double cost = kTraversalCost + (left_cost + right_cost) / box.SurfaceArea();
+                if (cost < best_cost) {
+                    best_cost = cost;
+                    best_axis = axis;
+                    best_bin = k;
+                }
+            }
+        }
+
+        if (best_axis == -1) {
+            return end;
+        }
+        double low = center_box.GetMin()[best_axis];
+        double extent = center_box.GetMax()[best_axis] - low;
+        auto middle = std::partition(
+            primitives_.begin() + begin, primitives_.begin() + end, [&](uint32_t primitive) {
+                return GetBin(centers[primitive][best_axis], low, extent) <= best_bin;
+            });
+        return middle - primitives_.begin();
+    }
+
+    double LeafCost(size_t count) const {
+        return static_cast<double>((count + leaf_block_width_ - 1) / leaf_block_width_);
+    }
+
+    static size_t GetBin(double center, double low, double extent) {
+        auto bin = static_cast<size_t>(kBins * (center - low) / extent);
+        return std::min(bin, kBins - 1);
+    }
+
+    std::vector<BasicBvhNode<T>>& nodes_;
+    std::vector<uint32_t>& primitives_;
+    size_t leaf_block_width_;
+};
+
+// Bounding volume hierarchy over abstract primitives, split by the binned surface area
+// heuristic. Primitives are identified by their index in the boxes passed to the constructor.
+// leaf_block_width is the number of primitives a leaf tests at once (the SIMD block width), the
+// heuristic then charges a leaf per started block instead of per primitive.
+template <class T>
+class BasicBvh {
+public:
+    BasicBvh() {
+    }
+
+    explicit BasicBvh(const std::vector<BasicBoundingBox<T>>& boxes, size_t leaf_block_width = 1) {
+        std::vector<BasicBvhNode<T>> nodes;
+        std::vector<uint32_t> primitives;
+        BvhBuilder<T>(&nodes, &primitives, std::max<size_t>(leaf_block_width, 1)).Build(boxes);
+        nodes_ = std::move(nodes);
+        primitives_ = std::move(primitives);
+    }
+
+    // Hierarchy built earlier, e.g. mapped from a cache file.
+    BasicBvh(Buffer<BasicBvhNode<T>> nodes, Buffer<uint32_t> primitives)
+        : nodes_(std::move(nodes)), primitives_(std::move(primitives)) {
+    }
+
+    const Buffer<BasicBvhNode<T>>& GetNodes() const {
+        return nodes_;
+    }
+    const Buffer<uint32_t>& GetPrimitives() const {
+        return primitives_;
+    }
+
+    // Calls visit(primitive) for every primitive whose leaf box the ray enters closer than
+    // max_distance, nearer children first. max_distance is re-read after every visit, so the
+    // callback may shrink it to prune the rest of the traversal; returning true stops it.
+    template <class Visit>
+    void Traverse(const BasicRay<T>& ray, const T& max_distance, Visit&& visit) const {
+        TraverseLeaves(ray, max_distance, [&](uint32_t, const BasicBvhNode<T>& leaf) {
+            for (uint32_t i = leaf.offset; i < leaf.offset + leaf.count; ++i) {
+                if (visit(primitives_[i])) {
+                    return true;
+                }
+            }
+            return false;
+        });
+    }
+
+    // Same as Traverse, but calls visit_leaf(node_index, node) once per leaf.
+    template <class VisitLeaf>
+    void TraverseLeaves(const BasicRay<T>& ray, const T& max_distance,
+                        VisitLeaf&& visit_leaf) const {
+        if (nodes_.empty()) {
+            return;
+        }
+        const BasicVector<T>& origin = ray.GetOrigin();
+        BasicVector<T> inverse_direction = BasicVector<T>{1, 1, 1} / ray.GetDirection();
+
+        std::array<uint32_t, BvhBuilder<T>::kMaxDepth> stack;
+        size_t stack_size = 0;
+        uint32_t node_index = 0;
+        if (!IsReached(EnterDistance(nodes_[0].box, origin, inverse_direction), max_distance)) {
+            return;
+        }
+
+        while (true) {
+            const BasicBvhNode<T>& node = nodes_[node_index];
+            if (node.IsLeaf()) {
+                if (visit_leaf(node_index, node)) {
+                    return;
+                }
+            } else {
+                uint32_t near = node_index + 1;
+                uint32_t far = node.offset;
+                T near_distance = EnterDistance(nodes_[near].box, origin, inverse_direction);
+                T far_distance = EnterDistance(nodes_[far].box, origin, inverse_direction);
+                if (far_distance < near_distance) {
+                    std::swap(near, far);
+                    std::swap(near_distance, far_distance);
+                }
+                if (IsReached(near_distance, max_distance)) {
+                    if (IsReached(far_distance, max_distance)) {
+                        stack[stack_size++] = far;
+                    }
+                    node_index = near;
+                    continue;
+                }
+            }
+
+            // pop the next subtree that may still contain something closer
+            bool found = false;
+            while (stack_size != 0 && !found) {
+                node_index = stack[--stack_size];
+                found = IsReached(EnterDistance(nodes_[node_index].box, origin, inverse_direction),
+                                  max_distance);
+            }
+            if (!found) {
+                return;
+            }
+        }
+    }
+
+    // Calls visit_leaf(node_index, node, masks) for every leaf that some ray of the packet enters
+    // no farther than its max distance, masks marking those rays. The packet descends as a whole:
+    // each node is tested once against all of its rays, and inner nodes send it to the child
+    // lying first along the mean direction of the rays. Max distances are re-read at every node,
+    // so the callback may shrink them; returning true stops the traversal.
+    template <class VisitLeaf>
+    void TraversePacketLeaves(const BasicRayPacket<T>& packet, VisitLeaf&& visit_leaf) const {
+        if (nodes_.empty() || packet.Size() == 0) {
+            return;
+        }
+        std::array<uint32_t, BvhBuilder<T>::kMaxDepth> stack;
+        size_t stack_size = 0;
+        uint32_t node_index = 0;
+        typename BasicRayPacket<T>::Masks masks;
+
+        while (true) {
+            const BasicBvhNode<T>& node = nodes_[node_index];
+            if (GetEnteringRays(node.box, packet, &masks)) {
+                if (node.IsLeaf()) {
+                    if (visit_leaf(node_index, node, masks)) {
+                        return;
+                    }
+                } else {
+                    uint32_t near = node_index + 1;
+                    uint32_t far = node.offset;
+                    BasicVector<T> offset = nodes_[far].box.GetCenter() -
+                                            nodes_[near].box.GetCenter();
+                    if (DotProduct(offset, packet.GetDirectionSum()) < 0) {
+                        std::swap(near, far);
+                    }
+                    stack[stack_size++] = far;
+                    node_index = near;
+                    continue;
+                }
+            }
+            if (stack_size == 0) {
+                return;
+            }
+            node_index = stack[--stack_size];
+        }
+    }
+
+private:
+    using Lanes = typename BasicRayPacket<T>::Lanes;
+
+    // relative and absolute slack of the box test, a few rounding errors of T
+    static constexpr T kSlack = std::is_same_v<T, float> ? 1e-5 : 1e-9;
+
+    // Missed boxes are infinitely far, out of reach even of rays without a max distance.
+    static bool IsReached(T enter_distance, T max_distance) {
+        return enter_distance <= max_distance &&
+               enter_distance != std::numeric_limits<T>::infinity();
+    }
+
+    static T EnterDistance(const BasicBoundingBox<T>& box, const BasicVector<T>& origin,
+                           const BasicVector<T>& inverse_direction) {
+        T enter = 0;
+        T leave = std::numeric_limits<T>::infinity();
+        for (int i = 0; i < 3; ++i) {
+            T t1 = (box.GetMin()[i] - origin[i]) * inverse_direction[i];
+            T t2 = (box.GetMax()[i] - origin[i]) * inverse_direction[i];
+            enter = std::max(enter, std::min(t1, t2));
+            leave = std::min(leave, std::max(t1, t2));
+        }
+        // slack keeps hits lying exactly on a box face from being culled by rounding
+        if (enter > leave * (1 + kSlack) + kSlack) {
+            return std::numeric_limits<T>::infinity();
+        }
+        return enter * (1 - kSlack) - kSlack;
+    }
+
+    // Range of the products of two ranges.
+    static void Multiply(T a_low, T a_high, T b_low, T b_high, T* low, T* high) {
+        T products[] = {a_low * b_low, a_low * b_high, a_high * b_low, a_high * b_high};
+        *low = *std::min_element(std::begin(products), std::end(products));
+        *high = *std::max_element(std::begin(products), std::end(products));
+    }
+
+    // False if no ray of the packet can enter the box no farther than its max distance. Rounded
+    // products are monotonic, so the ranges of the origins and inverse directions bound the slab
+    // distances of every ray exactly; axes where the directions of the rays differ in sign or
+    // are parallel to the slabs bound nothing and are skipped.
+    static bool MayEnter(const BasicBoundingBox<T>& box, const BasicRayPacket<T>& packet) {
+        T enter = 0;
+        T leave = std::numeric_limits<T>::infinity();
+        for (int i = 0; i < 3; ++i) {
+            T inverse_low = packet.GetInverseMin()[i];
+            T inverse_high = packet.GetInverseMax()[i];
+            if (!(inverse_low > 0 || inverse_high < 0) || !std::isfinite(inverse_low) ||
+                !std::isfinite(inverse_high)) {
+                continue;
+            }
+            T low1, high1, low2, high2;
+            Multiply(box.GetMin()[i] - packet.GetOriginMax()[i],
+                     box.GetMin()[i] - packet.GetOriginMin()[i], inverse_low, inverse_high, &low1,
+                     &high1);
+            Multiply(box.GetMax()[i] - packet.GetOriginMax()[i],
+                     box.GetMax()[i] - packet.GetOriginMin()[i], inverse_low, inverse_high, &low2,
+                     &high2);
+            enter = std::max(enter, std::min(low1, low2));
+            leave = std::min(leave, std::max(high1, high2));
+        }
+        return enter <= leave * (1 + kSlack) + kSlack;
+    }
+
+    // Marks the rays for which EnterDistance is within reach, false if there are none. The packet
+    // is culled as a whole first.
+    static bool GetEnteringRays(const BasicBoundingBox<T>& box, const BasicRayPacket<T>& packet,
+                                typename BasicRayPacket<T>::Masks* masks) {
+        if (!MayEnter(box, packet)) {
+            return false;
+        }
+        bool any = false;
+        for (size_t group = 0; group < BasicRayPacket<T>::kGroups; ++group) {
+            auto& mask = (*masks)[group];
+            if (group >= packet.GetGroupCount()) {
+                mask = typename BasicRayPacket<T>::Mask{};
+                continue;
+            }
+            const auto& origins = packet.GetOrigins(group);
+            const auto& inverse_directions = packet.GetInverseDirections(group);
+            Lanes enter = Lanes{};
+            Lanes leave = Lanes{} + std::numeric_limits<T>::infinity();
+            for (int i = 0; i < 3; ++i) {
+                Lanes t1 = (box.GetMin()[i] - origins[i]) * inverse_directions[i];
+                Lanes t2 = (box.GetMax()[i] - origins[i]) * inverse_directions[i];
+                // std::min and std::max lane by lane
+                Lanes near = t2 < t1 ? t2 : t1;
+                Lanes far = t1 < t2 ? t2 : t1;
+                enter = enter < near ? near : enter;
+                leave = far < leave ? far : leave;
+            }
+            Lanes distance = enter * (1 - kSlack) - kSlack;
+            mask = (enter <= leave * (1 + kSlack) + kSlack) &
+                   (distance <= packet.GetMaxDistances(group));
+            any = any || BasicRayPacket<T>::Any(mask);
+        }
+        return any;
+    }
+
+    Buffer<BasicBvhNode<T>> nodes_;
+    Buffer<uint32_t> primitives_;
+};
+
+using Bvh = BasicBvh<Scalar>;
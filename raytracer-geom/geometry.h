@@ -1,104 +1,152 @@
+#pragma once
+
 #include <vector.h>
 #include <ray.h>
 #include <sphere.h>
 #include <intersection.h>
 #include <triangle.h>
+#include <triangle_record.h>
+#include <bounding_box.h>
 
 #include <optional>
 
-std::optional<Intersection> GetIntersection(const Ray& ray, const Sphere& sphere) {
+template <class T>
+std::optional<BasicHitRecord<T>> FindHit(const BasicRay<T>& ray, const BasicSphere<T>& sphere) {
     // solve for tc
-    Vector l = sphere.GetCenter() - ray.GetOrigin();
-    double tc = DotProduct(l, ray.GetDirection());
-    // double tc = (DotProduct(ray.GetDirection(), sphere.GetCenter()) -
-    //              DotProduct(ray.GetDirection(), ray.GetOrigin())) /
-    //             DotProduct(ray.GetDirection(), ray.GetDirection());
+    BasicVector<T> l = sphere.GetCenter() - ray.GetOrigin();
+    T tc = DotProduct(l, ray.GetDirection());
+    // T tc = (DotProduct(ray.GetDirection(), sphere.GetCenter()) -
+    //         DotProduct(ray.GetDirection(), ray.GetOrigin())) /
+    //        DotProduct(ray.GetDirection(), ray.GetDirection());
     if (tc < 0) {
         return std::nullopt;
     }
-    double l2 = DotProduct(l, l);
-    double d2 = l2 - (tc * tc);
+    T d2 = DotProduct(l, l) - (tc * tc);
 
-    double radius2 = sphere.GetRadius() * sphere.GetRadius();
+    T radius2 = sphere.GetRadius() * sphere.GetRadius();
     if (d2 > radius2) {
         return std::nullopt;
     }
 
     // solve for t1c
-    float t1c = sqrt(radius2 - d2);
-
-    // solve for intersection points
-    double t1 = tc - t1c;
-    double t2 = tc + t1c;
+    T t1c = std::sqrt(radius2 - d2);
 
-    if (t1 < 0) {
-        std::swap(t1, t2);
-    }
-    if (t1 < 0) {
-        throw "wtf (both t1 and t2 i guess can't be < 0)";
-    }
-    Vector p1(ray.GetOrigin() + t1 * ray.GetDirection());
-    Vector n1(p1 - sphere.GetCenter());
-    if (l2 < radius2) {
-        // case ray origin is inside the sphere
-        n1 = -1 * n1;
-    }
-
-    return std::optional<Intersection>({p1, n1, Length(ray.GetOrigin() - p1)});
+    // solve for intersection points, t2 >= tc >= 0
+    T t1 = tc - t1c;
+    T t2 = tc + t1c;
+    return BasicHitRecord<T>{t1 < 0 ? t2 : t1};
 }
 
-const double kEps = 1e-9;
+const Scalar kEps = Epsilons<Scalar>::kEps;
 
-std::optional<Intersection> GetIntersection(const Ray& ray, const Triangle& triangle) {
-    Vector vertex0 = triangle.GetVertex(0);
-    Vector vertex1 = triangle.GetVertex(1);
-    Vector vertex2 = triangle.GetVertex(2);
-    Vector edge1 = vertex1 - vertex0;
-    Vector edge2 = vertex2 - vertex0;
+template <class T>
+std::optional<BasicHitRecord<T>> FindHit(const BasicRay<T>& ray,
+                                         const BasicTriangleRecord<T>& triangle) {
+    BasicVector<T> h = CrossProduct(ray.GetDirection(), triangle.edge2);
+    T a = DotProduct(triangle.edge1, h);
 
-    Vector h = CrossProduct(ray.GetDirection(), edge2);
-    double a = DotProduct(edge1, h);
-
-    if (a > -kEps && a < kEps) {
+    if (a > -Epsilons<T>::kEps && a < Epsilons<T>::kEps) {
         return std::nullopt;  // This ray is parallel to this triangle.
     }
 
-    double f = 1 / a;
-    Vector s = ray.GetOrigin() - vertex0;
-    double u = f * DotProduct(s, h);
+    T f = 1 / a;
+    BasicVector<T> s = ray.GetOrigin() - triangle.vertex0;
+    T u = f * DotProduct(s, h);
     if (u < 0 || u > 1) {
         return std::nullopt;
     }
 
-    Vector q = CrossProduct(s, edge1);
-    double v = f * DotProduct(ray.GetDirection(), q);
+    BasicVector<T> q = CrossProduct(s, triangle.edge1);
+    T v = f * DotProduct(ray.GetDirection(), q);
     if (v < 0 || u + v > 1) {
         return std::nullopt;
     }
     // At this stage we can compute t to find out where the intersection point is on the line.
-    float t = f * DotProduct(edge2, q);
+    T t = f * DotProduct(triangle.edge2, q);
     if (t < 0) {
         // This means that there is a line intersection but not a ray intersection.
         return std::nullopt;
     }
-    // ray intersection
-    auto position = ray.GetOrigin() + t * ray.GetDirection();
-    Vector normal1 = CrossProduct(edge1, edge2);
-    Vector normal2 = -1 * normal1;
-    // normal1.Normalize();
-    // normal2.Normalize();
-
-    if (Length(position + normal1 - ray.GetOrigin()) <
-        Length(position + normal2 - ray.GetOrigin())) {
-        return Intersection(position, normal1, Length(ray.GetOrigin() - position));
+    return BasicHitRecord<T>{t, u, v};
+}
+
+// Full intersections, reconstructed from a hit found by FindHit.
+template <class T>
+BasicIntersection<T> GetIntersection(const BasicRay<T>& ray, const BasicSphere<T>& sphere,
+                                     const BasicHitRecord<T>& hit) {
+    BasicVector<T> position = ray.GetOrigin() + hit.distance * ray.GetDirection();
+    BasicVector<T> normal = position - sphere.GetCenter();
+    BasicVector<T> l = sphere.GetCenter() - ray.GetOrigin();
+    if (DotProduct(l, l) < sphere.GetRadius() * sphere.GetRadius()) {
+        // case ray origin is inside the sphere
+        normal = -1 * normal;
+    }
+    return {position, normal, hit.distance};
+}
+
+// The normal is turned to face the ray origin.
+template <class T>
+BasicIntersection<T> GetIntersection(const BasicRay<T>& ray,
+                                     const BasicTriangleRecord<T>& triangle,
+                                     const BasicHitRecord<T>& hit) {
+    BasicVector<T> position = ray.GetOrigin() + hit.distance * ray.GetDirection();
+    if (DotProduct(triangle.normal, ray.GetDirection()) < 0) {
+        return {position, triangle.normal, hit.distance};
+    }
+    return {position, -1 * triangle.normal, hit.distance};
+}
+
+template <class T>
+std::optional<BasicIntersection<T>> GetIntersection(const BasicRay<T>& ray,
+                                                    const BasicSphere<T>& sphere) {
+    if (auto hit = FindHit(ray, sphere)) {
+        return GetIntersection(ray, sphere, *hit);
     }
-    return Intersection(position, normal2, Length(ray.GetOrigin() - position));
+    return std::nullopt;
 }
 
-std::optional<Vector> Refract(const Vector& ray, const Vector& normal, double eta) {
-    double cosine = DotProduct(-1 * normal, ray);
-    Vector refract =
-        eta * ray + (eta * cosine - sqrt(1 - eta * eta * (1 - cosine * cosine))) * normal;
+template <class T>
+std::optional<BasicIntersection<T>> GetIntersection(const BasicRay<T>& ray,
+                                                    const BasicTriangleRecord<T>& triangle) {
+    if (auto hit = FindHit(ray, triangle)) {
+        return GetIntersection(ray, triangle, *hit);
+    }
+    return std::nullopt;
+}
+
+template <class T>
+std::optional<BasicIntersection<T>> GetIntersection(const BasicRay<T>& ray,
+                                                    const BasicTriangle<T>& triangle) {
+    return GetIntersection(ray, BasicTriangleRecord<T>(triangle, false));
+}
+
+// Occlusion-only tests: whether the hit is closer than max_distance.
+template <class T>
+bool Occludes(const BasicRay<T>& ray, const BasicSphere<T>& sphere,
+              std::type_identity_t<T> max_distance) {
+    auto hit = FindHit(ray, sphere);
+    return hit && hit->distance < max_distance;
+}
+
+template <class T>
+bool Occludes(const BasicRay<T>& ray, const BasicTriangleRecord<T>& triangle,
+              std::type_identity_t<T> max_distance) {
+    auto hit = FindHit(ray, triangle);
+    return hit && hit->distance < max_distance;
+}
+
+template <class T>
+bool Occludes(const BasicRay<T>& ray, const BasicTriangle<T>& triangle,
+              std::type_identity_t<T> max_distance) {
+    return Occludes(ray, BasicTriangleRecord<T>(triangle, false), max_distance);
+}
+
+template <class T>
+std::optional<BasicVector<T>> Refract(const BasicVector<T>& ray, const BasicVector<T>& normal,
+                                      std::type_identity_t<T> eta) {
+    T cosine = DotProduct(-1 * normal, ray);
+    BasicVector<T> refract =
+        eta * ray + (eta * cosine - std::sqrt(1 - eta * eta * (1 - cosine * cosine))) * normal;
     if (DotProduct(normal, refract) > 0) {
         // refract back to self (not through).
         // I guess we stop in this case
@@ -106,17 +154,42 @@ std::optional<Vector> Refract(const Vector& ray, const Vector& normal, double et
     }
     return refract;
 }
-Vector Reflect(const Vector& ray, const Vector& normal) {
-    double cosine = DotProduct(-1 * normal, ray);
+template <class T>
+BasicVector<T> Reflect(const BasicVector<T>& ray, const BasicVector<T>& normal) {
+    T cosine = DotProduct(-1 * normal, ray);
     return ray + 2 * cosine * normal;
 }
-Vector GetBarycentricCoords(const Triangle& triangle, const Vector& point) {
-    double bcx = Triangle({triangle.GetVertex(1), triangle.GetVertex(2), point}).Area();
-    double cax = Triangle({triangle.GetVertex(2), triangle.GetVertex(0), point}).Area();
-    double abx = Triangle({triangle.GetVertex(0), triangle.GetVertex(1), point}).Area();
-    double sum = bcx + cax + abx;
+template <class T>
+BasicVector<T> GetBarycentricCoords(const BasicTriangle<T>& triangle,
+                                    const BasicVector<T>& point) {
+    T bcx = BasicTriangle<T>({triangle.GetVertex(1), triangle.GetVertex(2), point}).Area();
+    T cax = BasicTriangle<T>({triangle.GetVertex(2), triangle.GetVertex(0), point}).Area();
+    T abx = BasicTriangle<T>({triangle.GetVertex(0), triangle.GetVertex(1), point}).Area();
+    T sum = bcx + cax + abx;
     bcx /= sum;
     cax /= sum;
     abx /= sum;
     return {bcx, cax, abx};
 }
+
+template <class T>
+BasicBoundingBox<T> GetBoundingBox(const BasicSphere<T>& sphere) {
+    BasicVector<T> radius{sphere.GetRadius(), sphere.GetRadius(), sphere.GetRadius()};
+    return {sphere.GetCenter() - radius, sphere.GetCenter() + radius};
+}
+template <class T>
+BasicBoundingBox<T> GetBoundingBox(const BasicTriangle<T>& triangle) {
+    BasicBoundingBox<T> box;
+    for (size_t i = 0; i < 3; ++i) {
+        box.Extend(triangle.GetVertex(i));
+    }
+    return box;
+}
+template <class T>
+BasicBoundingBox<T> GetBoundingBox(const BasicTriangleRecord<T>& triangle) {
+    BasicBoundingBox<T> box;
+    box.Extend(triangle.vertex0);
+    box.Extend(triangle.vertex0 + triangle.edge1);
+    box.Extend(triangle.vertex0 + triangle.edge2);
+    return box;
+}
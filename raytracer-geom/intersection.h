@@ -2,28 +2,43 @@
 
 #include <vector.h>
 
-class Intersection {
+template <class T>
+class BasicIntersection {
 public:
-    Intersection(Vector pos, Vector norm, double dist)
+    BasicIntersection(BasicVector<T> pos, BasicVector<T> norm, T dist)
         : position_(pos), normal_(norm), distance_(dist) {
         normal_.Normalize();
     }
 
-    Intersection() : position_({0, 0, 0}), normal_({0, 0, 0}), distance_(0) {
+    BasicIntersection() : position_({0, 0, 0}), normal_({0, 0, 0}), distance_(0) {
     }
 
-    const Vector& GetPosition() const {
+    const BasicVector<T>& GetPosition() const {
         return position_;
     }
-    const Vector& GetNormal() const {
+    const BasicVector<T>& GetNormal() const {
         return normal_;
     }
-    double GetDistance() const {
+    T GetDistance() const {
         return distance_;
     }
 
 private:
-    Vector position_;
-    Vector normal_;
-    double distance_;
+    BasicVector<T> position_;
+    BasicVector<T> normal_;
+    T distance_;
 };
+
+using Intersection = BasicIntersection<Scalar>;
+
+// What the intersection tests keep while searching for the closest hit: the distance along the
+// ray and, for triangles, the Moller-Trumbore coordinates of the hit point,
+// position = (1 - u - v) * vertex0 + u * vertex1 + v * vertex2.
+template <class T>
+struct BasicHitRecord {
+    T distance;
+    T u = 0;
+    T v = 0;
+};
+
+using HitRecord = BasicHitRecord<Scalar>;
@@ -0,0 +1,209 @@
+#pragma once
+
+#include <vector.h>
+#include <ray.h>
+#include <sphere.h>
+#include <triangle_record.h>
+#include <geometry.h>
+
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <type_traits>
+
+#if defined(__AVX512F__) || defined(__AVX__)
+#include <immintrin.h>
+#endif
+
+// One ray against a block of primitives stored as structure of arrays. The lane arithmetic is
+// written with GCC/Clang vector extensions, so a block is one zmm register with AVX-512, two ymm
+// registers with AVX2 and plain SSE2 otherwise: 8 lanes of double or 16 lanes of float.
+
+constexpr size_t kBlockWidth = 64 / sizeof(Scalar);
+constexpr uint32_t kNoPrimitive = std::numeric_limits<uint32_t>::max();
+
+// signed integer of the Scalar size, lane type of comparison results
+using BlockLane = std::conditional_t<sizeof(Scalar) == 8, int64_t, int32_t>;
+
+typedef Scalar BlockScalars __attribute__((vector_size(kBlockWidth * sizeof(Scalar))));
+typedef BlockLane BlockMask __attribute__((vector_size(kBlockWidth * sizeof(BlockLane))));
+
+// Unused lanes hold zero triangles, which are rejected as parallel to every ray.
+struct alignas(64) TriangleBlock {
+    std::array<BlockScalars, 3> vertex0 = {};
+    std::array<BlockScalars, 3> edge1 = {};
+    std::array<BlockScalars, 3> edge2 = {};
+    std::array<uint32_t, kBlockWidth> primitives;
+    uint32_t size = 0;
+
+    TriangleBlock() {
+        primitives.fill(kNoPrimitive);
+    }
+
+    void Add(const TriangleRecord& triangle, uint32_t primitive) {
+        for (int i = 0; i < 3; ++i) {
+            vertex0[i][size] = triangle.vertex0[i];
+            edge1[i][size] = triangle.edge1[i];
+            edge2[i][size] = triangle.edge2[i];
+        }
+        primitives[size++] = primitive;
+    }
+};
+
+// Unused lanes have a negative infinite squared radius and are never hit.
+struct alignas(64) SphereBlock {
+    std::array<BlockScalars, 3> center = {};
+    BlockScalars radius2;
+    std::array<uint32_t, kBlockWidth> primitives;
+    uint32_t size = 0;
+
+    SphereBlock() {
+        for (size_t i = 0; i < kBlockWidth; ++i) {
+            radius2[i] = -std::numeric_limits<Scalar>::infinity();
+        }
+        primitives.fill(kNoPrimitive);
+    }
+
+    void Add(const Sphere& sphere, uint32_t primitive) {
+        for (int i = 0; i < 3; ++i) {
+            center[i][size] = sphere.GetCenter()[i];
+        }
+        radius2[size] = sphere.GetRadius() * sphere.GetRadius();
+        primitives[size++] = primitive;
+    }
+};
+
+// Per-lane results of a block test, u and v stay zero for spheres.
+struct BlockLanes {
+    BlockScalars t;
+    BlockScalars u;
+    BlockScalars v;
+    BlockMask mask;
+};
+
+struct BlockHit {
+    HitRecord record = {std::numeric_limits<Scalar>::infinity()};
+    uint32_t primitive = kNoPrimitive;
+};
+
+inline void Sqrt(BlockScalars* value) {
+#if defined(__AVX512F__)
+    if constexpr (std::is_same_v<Scalar, float>) {
+        *value = (BlockScalars)_mm512_mask_sqrt_ps((__m512)*value, 0xFFFF, (__m512)*value);
+    } else {
+        *value = (BlockScalars)_mm512_mask_sqrt_pd((__m512d)*value, 0xFF, (__m512d)*value);
+    }
+#elif defined(__AVX__)
+    using Half = std::conditional_t<std::is_same_v<Scalar, float>, __m256, __m256d>;
+    Half low, high;
+    std::memcpy(&low, value, sizeof(low));
+    std::memcpy(&high, reinterpret_cast<char*>(value) + sizeof(low), sizeof(high));
+    if constexpr (std::is_same_v<Scalar, float>) {
+        low = _mm256_sqrt_ps(low);
+        high = _mm256_sqrt_ps(high);
+    } else {
+        low = _mm256_sqrt_pd(low);
+        high = _mm256_sqrt_pd(high);
+    }
+    std::memcpy(value, &low, sizeof(low));
+    std::memcpy(reinterpret_cast<char*>(value) + sizeof(low), &high, sizeof(high));
+#else
+    for (size_t i = 0; i < kBlockWidth; ++i) {
+        (*value)[i] = std::sqrt((*value)[i]);
+    }
+#endif
+}
+
+// Marks the lanes hit by the ray (same conditions as the scalar Moller-Trumbore test) and
+// stores their hit records.
+inline void IntersectLanes(const Ray& ray, const TriangleBlock& block, BlockLanes* lanes) {
+    const Vector& origin = ray.GetOrigin();
+    const Vector& direction = ray.GetDirection();
+    Scalar dx = direction[0];
+    Scalar dy = direction[1];
+    Scalar dz = direction[2];
+    const auto& e1 = block.edge1;
+    const auto& e2 = block.edge2;
+
+    BlockScalars hx = dy * e2[2] - dz * e2[1];
+    BlockScalars hy = dz * e2[0] - dx * e2[2];
+    BlockScalars hz = dx * e2[1] - dy * e2[0];
+    BlockScalars a = e1[0] * hx + e1[1] * hy + e1[2] * hz;
+    BlockMask& mask = lanes->mask;
+    mask = ~((a > -kEps) & (a < kEps));
+
+    BlockScalars f = 1 / a;
+    BlockScalars sx = origin[0] - block.vertex0[0];
+    BlockScalars sy = origin[1] - block.vertex0[1];
+    BlockScalars sz = origin[2] - block.vertex0[2];
+    BlockScalars& u = lanes->u;
+    u = f * (sx * hx + sy * hy + sz * hz);
+    mask &= ~((u < 0) | (u > 1));
+
+    BlockScalars qx = sy * e1[2] - sz * e1[1];
+    BlockScalars qy = sz * e1[0] - sx * e1[2];
+    BlockScalars qz = sx * e1[1] - sy * e1[0];
+    BlockScalars& v = lanes->v;
+    v = f * (dx * qx + dy * qy + dz * qz);
+    mask &= ~((v < 0) | (u + v > 1));
+
+    lanes->t = f * (e2[0] * qx + e2[1] * qy + e2[2] * qz);
+    mask &= ~(lanes->t < 0);
+}
+
+// Marks the lanes hit by the ray (same conditions as the scalar sphere test) and stores their
+// hit records.
+inline void IntersectLanes(const Ray& ray, const SphereBlock& block, BlockLanes* lanes) {
+    const Vector& origin = ray.GetOrigin();
+    const Vector& direction = ray.GetDirection();
+    BlockScalars lx = block.center[0] - origin[0];
+    BlockScalars ly = block.center[1] - origin[1];
+    BlockScalars lz = block.center[2] - origin[2];
+    BlockScalars tc = lx * direction[0] + ly * direction[1] + lz * direction[2];
+    BlockScalars d2 = lx * lx + ly * ly + lz * lz - tc * tc;
+    lanes->mask = ~((tc < 0) | (d2 > block.radius2));
+
+    // missed lanes may take the root of a negative number, the mask drops them anyway
+    BlockScalars t1c = block.radius2 - d2;
+    Sqrt(&t1c);
+    BlockScalars t1 = tc - t1c;
+    BlockScalars t2 = tc + t1c;
+    lanes->t = t1 < 0 ? t2 : t1;
+    lanes->u = BlockScalars{};
+    lanes->v = BlockScalars{};
+}
+
+// Moves hit to the nearest lane closer than hit->record.distance; on equal distances the
+// smaller primitive id wins, like a scan in id order.
+template <class Block>
+void IntersectBlock(const Ray& ray, const Block& block, BlockHit* hit) {
+    BlockLanes lanes;
+    IntersectLanes(ray, block, &lanes);
+    BlockMask mask = lanes.mask & (lanes.t <= hit->record.distance);
+    for (size_t i = 0; i < kBlockWidth; ++i) {
+        if (!mask[i]) {
+            continue;
+        }
+        if (lanes.t[i] < hit->record.distance ||
+            (lanes.t[i] == hit->record.distance && block.primitives[i] < hit->primitive)) {
+            hit->record = {lanes.t[i], lanes.u[i], lanes.v[i]};
+            hit->primitive = block.primitives[i];
+        }
+    }
+}
+
+// Returns the primitive of some lane hit closer than max_distance or kNoPrimitive.
+template <class Block>
+uint32_t FindOccluder(const Ray& ray, const Block& block, Scalar max_distance) {
+    BlockLanes lanes;
+    IntersectLanes(ray, block, &lanes);
+    BlockMask mask = lanes.mask & (lanes.t < max_distance);
+    for (size_t i = 0; i < kBlockWidth; ++i) {
+        if (mask[i]) {
+            return block.primitives[i];
+        }
+    }
+    return kNoPrimitive;
+}
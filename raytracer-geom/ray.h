@@ -2,19 +2,25 @@
 
 #include <vector.h>
 
-class Ray {
+template <class T>
+class BasicRay {
 public:
-    Ray(Vector origin, Vector direction) : origin_(origin), direction_(direction) {
+    BasicRay() {
+    }
+    BasicRay(BasicVector<T> origin, BasicVector<T> direction)
+        : origin_(origin), direction_(direction) {
         direction_.Normalize();
     }
-    const Vector& GetOrigin() const {
+    const BasicVector<T>& GetOrigin() const {
         return origin_;
     }
-    const Vector& GetDirection() const {
+    const BasicVector<T>& GetDirection() const {
         return direction_;
     }
 
 private:
-    Vector origin_;
-    Vector direction_;
-};
\ No newline at end of file
+    BasicVector<T> origin_;
+    BasicVector<T> direction_;
+};
+
+using Ray = BasicRay<Scalar>;
@@ -0,0 +1,156 @@
+#pragma once
+
+#include <vector.h>
+#include <ray.h>
+
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+// Coherent rays traced through the BVH together, e.g. the primary rays of an 8x8 block of pixels.
+// Origins, inverse directions and max distances are stored as structure of arrays in groups of
+// 64 bytes of lanes, like the primitive blocks, so one BVH node is tested against the whole
+// packet with a few vector instructions. The packet also keeps the per-axis ranges of its origins
+// and inverse directions, which bound the slab distances of all its rays at once.
+
+constexpr size_t kPacketSize = 64;
+
+// 64 bytes of lanes and the mask type of their comparisons. GCC drops vector attributes of
+// dependent typedefs used as template arguments, hence the explicit specializations.
+template <class T>
+struct PacketLanes;
+
+template <>
+struct PacketLanes<double> {
+    typedef double Lanes __attribute__((vector_size(64)));
+    typedef int64_t Mask __attribute__((vector_size(64)));
+};
+
+template <>
+struct PacketLanes<float> {
+    typedef float Lanes __attribute__((vector_size(64)));
+    typedef int32_t Mask __attribute__((vector_size(64)));
+};
+
+template <class T>
+class BasicRayPacket {
+public:
+    static constexpr size_t kLanes = 64 / sizeof(T);
+    static constexpr size_t kGroups = kPacketSize / kLanes;
+
+    using Lanes = typename PacketLanes<T>::Lanes;
+    using Mask = typename PacketLanes<T>::Mask;
+    using Masks = std::array<Mask, kGroups>;
+
+    BasicRayPacket() {
+        rays_.reserve(kPacketSize);
+        Clear();
+    }
+
+    // Unused lanes get a negative infinite max distance and are never active.
+    void Clear() {
+        rays_.clear();
+        for (size_t group = 0; group < kGroups; ++group) {
+            for (int axis = 0; axis < 3; ++axis) {
+                origins_[group][axis] = Lanes{};
+                inverse_directions_[group][axis] = Lanes{} + 1;
+            }
+            max_distances_[group] = Lanes{} - kInfinity;
+        }
+        for (int axis = 0; axis < 3; ++axis) {
+            origin_min_[axis] = inverse_min_[axis] = kInfinity;
+            origin_max_[axis] = inverse_max_[axis] = -kInfinity;
+        }
+        direction_sum_ = {0, 0, 0};
+    }
+
+    // Adds a ray looking for hits no farther than max_distance, at most kPacketSize per packet.
+    void Add(const BasicRay<T>& ray, T max_distance = kInfinity) {
+        size_t group = rays_.size() / kLanes;
+        size_t lane = rays_.size() % kLanes;
+        for (int axis = 0; axis < 3; ++axis) {
+            T origin = ray.GetOrigin()[axis];
+            T inverse = 1 / ray.GetDirection()[axis];
+            origins_[group][axis][lane] = origin;
+            inverse_directions_[group][axis][lane] = inverse;
+            origin_min_[axis] = std::min(origin_min_[axis], origin);
+            origin_max_[axis] = std::max(origin_max_[axis], origin);
+            inverse_min_[axis] = std::min(inverse_min_[axis], inverse);
+            inverse_max_[axis] = std::max(inverse_max_[axis], inverse);
+        }
+        max_distances_[group][lane] = max_distance;
+        direction_sum_ = direction_sum_ + ray.GetDirection();
+        rays_.push_back(ray);
+    }
+
+    size_t Size() const {
+        return rays_.size();
+    }
+    // groups holding at least one ray
+    size_t GetGroupCount() const {
+        return (rays_.size() + kLanes - 1) / kLanes;
+    }
+    const BasicRay<T>& GetRay(size_t index) const {
+        return rays_[index];
+    }
+
+    T GetMaxDistance(size_t index) const {
+        return max_distances_[index / kLanes][index % kLanes];
+    }
+    void SetMaxDistance(size_t index, T max_distance) {
+        max_distances_[index / kLanes][index % kLanes] = max_distance;
+    }
+
+    const std::array<Lanes, 3>& GetOrigins(size_t group) const {
+        return origins_[group];
+    }
+    const std::array<Lanes, 3>& GetInverseDirections(size_t group) const {
+        return inverse_directions_[group];
+    }
+    const Lanes& GetMaxDistances(size_t group) const {
+        return max_distances_[group];
+    }
+
+    const BasicVector<T>& GetOriginMin() const {
+        return origin_min_;
+    }
+    const BasicVector<T>& GetOriginMax() const {
+        return origin_max_;
+    }
+    const BasicVector<T>& GetInverseMin() const {
+        return inverse_min_;
+    }
+    const BasicVector<T>& GetInverseMax() const {
+        return inverse_max_;
+    }
+    // points where the rays of the packet mostly go, orders the children of BVH nodes
+    const BasicVector<T>& GetDirectionSum() const {
+        return direction_sum_;
+    }
+
+    static bool Any(const Mask& mask) {
+        for (size_t lane = 0; lane < kLanes; ++lane) {
+            if (mask[lane]) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+private:
+    static constexpr T kInfinity = std::numeric_limits<T>::infinity();
+
+    std::array<std::array<Lanes, 3>, kGroups> origins_;
+    std::array<std::array<Lanes, 3>, kGroups> inverse_directions_;
+    std::array<Lanes, kGroups> max_distances_;
+    BasicVector<T> origin_min_;
+    BasicVector<T> origin_max_;
+    BasicVector<T> inverse_min_;
+    BasicVector<T> inverse_max_;
+    BasicVector<T> direction_sum_;
+    std::vector<BasicRay<T>> rays_;
+};
+
+using RayPacket = BasicRayPacket<Scalar>;
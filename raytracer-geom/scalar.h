@@ -0,0 +1,33 @@
+#pragma once
+
+// Floating point type of the geometry and rendering pipeline, picked at compile time with the
+// RAYTRACER_FLOAT option. Geometry classes are templates over it, the unprefixed names (Vector,
+// Ray, ...) are their instantiations for Scalar.
+#ifdef RAYTRACER_FLOAT
+using Scalar = float;
+#else
+using Scalar = double;
+#endif
+
+template <class T>
+struct Epsilons;
+
+template <>
+struct Epsilons<double> {
+    // parallel ray test, zero normal test
+    static constexpr double kEps = 1e-9;
+    // shift of secondary ray origins along the normal
+    // WARNING: value of 1e-6 and less does shit on test deer in release
+    static constexpr double kEps2 = 1e-5;
+    // slack of the shadow ray distance to the light
+    static constexpr double kEps3 = 1e-5;
+};
+
+// The offsets stay at 1e-5, about a hundred float ulps at the scale of the test scenes: the box
+// scene has a light 1e-4 below its ceiling, and a 1e-4 offset already lets the ceiling shadow it.
+template <>
+struct Epsilons<float> {
+    static constexpr float kEps = 1e-7f;
+    static constexpr float kEps2 = 1e-5f;
+    static constexpr float kEps3 = 1e-5f;
+};
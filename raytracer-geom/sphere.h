@@ -2,18 +2,21 @@
 
 #include <vector.h>
 
-class Sphere {
+template <class T>
+class BasicSphere {
 public:
-    Sphere(Vector center, double radius) : center_(center), radius_(radius) {
+    BasicSphere(BasicVector<T> center, T radius) : center_(center), radius_(radius) {
     }
-    const Vector& GetCenter() const {
+    const BasicVector<T>& GetCenter() const {
         return center_;
     }
-    double GetRadius() const {
+    T GetRadius() const {
         return radius_;
     }
 
 private:
-    Vector center_;
-    double radius_;
-};
\ No newline at end of file
+    BasicVector<T> center_;
+    T radius_;
+};
+
+using Sphere = BasicSphere<Scalar>;
@@ -1,10 +1,15 @@
 #include <catch.hpp>
+#include <util.h>
 
 #include <cmath>
+#include <limits>
 #include <string>
 #include <optional>
 
 #include <geometry.h>
+#include <bvh.h>
+#include <ray_packet.h>
+#include <primitive_block.h>
 
 constexpr auto kX = 123.;
 constexpr auto kY = 456.;
@@ -149,6 +154,41 @@ TEST_CASE("Intersection", "[raytracer]") {
     REQUIRE(!intersection);
 }
 
+TEST_CASE("Occludes", "[raytracer]") {
+    Sphere sphere({0, 0, 0}, 2.);
+    REQUIRE(!Occludes({{5, 0, 2.2}, {-1, 0, 0}}, sphere, 100));
+    REQUIRE(Occludes({{5, 0, 0}, {-1, 0, 0}}, sphere, 3.5));
+    REQUIRE(!Occludes({{5, 0, 0}, {-1, 0, 0}}, sphere, 2.5));
+    REQUIRE(Occludes({{0, 0, 0}, {-1, 0, 0}}, sphere, 2.5));
+    REQUIRE(!Occludes({{5, 0, 0}, {1, 0, 0}}, sphere, 100));
+
+    Triangle triangle{{0, 0, 0}, {4, 0, 0}, {0, 4, 0}};
+    REQUIRE(Occludes({{2, 1, 1}, {0, 0, -1}}, triangle, 1.5));
+    REQUIRE(!Occludes({{2, 1, 1}, {0, 0, -1}}, triangle, 0.5));
+    REQUIRE(!Occludes({{2, 1, 1}, {0, 0, 1}}, triangle, 100));
+    REQUIRE(!Occludes({{3, 3, 1}, {0, 0, -1}}, triangle, 100));
+}
+
+TEST_CASE("Hit records", "[raytracer]") {
+    TriangleRecord triangle(Triangle{{0, 0, 0}, {4, 0, 0}, {0, 4, 0}}, false);
+    Ray ray{{1, 2, 1}, {0, 0, -1}};
+    auto hit = FindHit(ray, triangle);
+    REQUIRE(std::fabs(hit->distance - 1) < kErr);
+    REQUIRE(std::fabs(hit->u - 0.25) < kErr);
+    REQUIRE(std::fabs(hit->v - 0.5) < kErr);
+    auto intersection = GetIntersection(ray, triangle, *hit);
+    REQUIRE(std::fabs(intersection.GetPosition()[0] - 1) < kErr);
+    REQUIRE(std::fabs(intersection.GetPosition()[1] - 2) < kErr);
+    REQUIRE(std::fabs(intersection.GetNormal()[2] - 1) < kErr);
+
+    Sphere sphere({0, 0, 0}, 2.);
+    ray = {{0, 0, 0}, {0, 1, 0}};
+    hit = FindHit(ray, sphere);
+    REQUIRE(std::fabs(hit->distance - 2) < kErr);
+    intersection = GetIntersection(ray, sphere, *hit);
+    REQUIRE(std::fabs(intersection.GetNormal()[1] + 1) < kErr);
+}
+
 TEST_CASE("Refract, Reflect", "[raytracer]") {
     Vector normal{0, 1, 0};
     Vector ray{0.707107, -0.707107, 0};
@@ -174,3 +214,171 @@ TEST_CASE("Barycentric coords", "[raytracer]") {
     REQUIRE(std::fabs(inside[1] - 0.1) < kErr);
     REQUIRE(std::fabs(inside[2] - 0.1) < kErr);
 }
+
+TEST_CASE("Bvh", "[raytracer]") {
+    RandomGenerator rnd;
+    std::vector<Sphere> spheres;
+    std::vector<BoundingBox> boxes;
+    auto coords = rnd.GenRealVector(3 * 500, -10, 10);
+    auto radii = rnd.GenRealVector(500, 0.05, 0.5);
+    for (size_t i = 0; i < radii.size(); ++i) {
+        spheres.emplace_back(Vector{coords[3 * i], coords[3 * i + 1], coords[3 * i + 2]}, radii[i]);
+        boxes.push_back(GetBoundingBox(spheres.back()));
+    }
+    Bvh bvh(boxes);
+    REQUIRE(bvh.GetPrimitives().size() == spheres.size());
+
+    auto directions = rnd.GenRealVector(3 * 200, -1, 1);
+    for (size_t i = 0; i < 200; ++i) {
+        Ray ray{{0, 0, 0}, {directions[3 * i], directions[3 * i + 1], directions[3 * i + 2]}};
+
+        Scalar expected = 1e9;
+        for (const auto& sphere : spheres) {
+            if (auto intersection = GetIntersection(ray, sphere)) {
+                expected = std::min(expected, intersection->GetDistance());
+            }
+        }
+
+        Scalar actual = 1e9;
+        bvh.Traverse(ray, actual, [&](uint32_t primitive) {
+            if (auto intersection = GetIntersection(ray, spheres[primitive])) {
+                actual = std::min(actual, intersection->GetDistance());
+            }
+            return false;
+        });
+        REQUIRE(std::fabs(actual - expected) < kErr);
+    }
+
+    // boxes the ray misses are skipped before anything is hit, even without a max distance
+    size_t visited = 0;
+    Scalar max_distance = std::numeric_limits<Scalar>::infinity();
+    bvh.Traverse(Ray{{20, 0, 0}, {1, 0, 0}}, max_distance, [&](uint32_t) {
+        ++visited;
+        return false;
+    });
+    REQUIRE(visited == 0);
+}
+
+TEST_CASE("Ray packets", "[raytracer]") {
+    RandomGenerator rnd;
+    std::vector<Sphere> spheres;
+    std::vector<BoundingBox> boxes;
+    auto coords = rnd.GenRealVector(3 * 500, -10, 10);
+    auto radii = rnd.GenRealVector(500, 0.05, 0.5);
+    for (size_t i = 0; i < radii.size(); ++i) {
+        spheres.emplace_back(Vector{coords[3 * i], coords[3 * i + 1], coords[3 * i + 2]}, radii[i]);
+        boxes.push_back(GetBoundingBox(spheres.back()));
+    }
+    Bvh bvh(boxes, 4);
+
+    auto check_packet = [&](const std::vector<Ray>& rays) {
+        RayPacket packet;
+        for (const Ray& ray : rays) {
+            packet.Add(ray);
+        }
+        std::vector<Scalar> actual(rays.size(), std::numeric_limits<Scalar>::infinity());
+        bvh.TraversePacketLeaves(packet, [&](uint32_t, const BvhNode& leaf,
+                                             const RayPacket::Masks& masks) {
+            for (size_t k = 0; k < rays.size(); ++k) {
+                if (!masks[k / RayPacket::kLanes][k % RayPacket::kLanes]) {
+                    continue;
+                }
+                for (uint32_t i = leaf.offset; i < leaf.offset + leaf.count; ++i) {
+                    const Sphere& sphere = spheres[bvh.GetPrimitives()[i]];
+                    if (auto intersection = GetIntersection(rays[k], sphere)) {
+                        actual[k] = std::min<Scalar>(actual[k], intersection->GetDistance());
+                    }
+                }
+                packet.SetMaxDistance(k, actual[k]);
+            }
+            return false;
+        });
+
+        for (size_t k = 0; k < rays.size(); ++k) {
+            Scalar expected = std::numeric_limits<Scalar>::infinity();
+            for (const auto& sphere : spheres) {
+                if (auto intersection = GetIntersection(rays[k], sphere)) {
+                    expected = std::min<Scalar>(expected, intersection->GetDistance());
+                }
+            }
+            REQUIRE(actual[k] == expected);
+        }
+    };
+
+    // coherent rays from one point, like the primary rays of a block of pixels
+    for (int packet = 0; packet < 20; ++packet) {
+        auto center = rnd.GenRealVector(2, -1, 1);
+        auto offsets = rnd.GenRealVector(2 * kPacketSize, -0.05, 0.05);
+        std::vector<Ray> rays;
+        for (size_t k = 0; k < kPacketSize; ++k) {
+            rays.push_back(Ray{{0, 0, 0},
+                               {center[0] + offsets[2 * k], center[1] + offsets[2 * k + 1], -1}});
+        }
+        check_packet(rays);
+    }
+
+    // directions of every sign, several origins, incomplete packets
+    for (size_t size : {kPacketSize, size_t{37}, size_t{1}}) {
+        auto origins = rnd.GenRealVector(3 * size, -2, 2);
+        auto directions = rnd.GenRealVector(3 * size, -1, 1);
+        std::vector<Ray> rays;
+        for (size_t k = 0; k < size; ++k) {
+            const double* o = &origins[3 * k];
+            const double* d = &directions[3 * k];
+            rays.push_back(Ray{{o[0], o[1], o[2]}, {d[0], d[1], d[2]}});
+        }
+        check_packet(rays);
+    }
+    check_packet({Ray{{0, 0, 0}, {0, 0, -1}}, Ray{{0, 0, 0}, {0, 1, 0}}});
+}
+
+TEST_CASE("Primitive blocks", "[raytracer]") {
+    RandomGenerator rnd;
+    auto coords = rnd.GenRealVector(9 * kBlockWidth, -3, 3);
+    TriangleBlock triangles;
+    SphereBlock spheres;
+    std::vector<TriangleRecord> records;
+    std::vector<Sphere> sphere_list;
+    for (uint32_t i = 0; i + 1 < kBlockWidth; ++i) {
+        const double* c = &coords[9 * i];
+        records.emplace_back(Triangle{{c[0], c[1], c[2] - 5}, {c[3], c[4], c[5] - 5},
+                                      {c[6], c[7], c[8] - 5}},
+                             false);
+        triangles.Add(records.back(), i);
+        sphere_list.emplace_back(Vector{c[0], c[1], c[2] - 5}, std::fabs(c[3]) / 3);
+        spheres.Add(sphere_list.back(), i);
+    }
+
+    auto directions = rnd.GenRealVector(3 * 300, -0.5, 0.5);
+    for (size_t k = 0; k < 300; ++k) {
+        Ray ray{{0, 0, 0}, {directions[3 * k], directions[3 * k + 1], -1}};
+        BlockHit expected_triangle;
+        BlockHit expected_sphere;
+        for (uint32_t i = 0; i < records.size(); ++i) {
+            auto hit = FindHit(ray, records[i]);
+            if (hit && hit->distance < expected_triangle.record.distance) {
+                expected_triangle = {*hit, i};
+            }
+            hit = FindHit(ray, sphere_list[i]);
+            if (hit && hit->distance < expected_sphere.record.distance) {
+                expected_sphere = {*hit, i};
+            }
+        }
+
+        BlockHit triangle_hit;
+        IntersectBlock(ray, triangles, &triangle_hit);
+        REQUIRE(triangle_hit.primitive == expected_triangle.primitive);
+        if (triangle_hit.primitive != kNoPrimitive) {
+            REQUIRE(std::fabs(triangle_hit.record.u - expected_triangle.record.u) < 1e-5);
+            REQUIRE(std::fabs(triangle_hit.record.v - expected_triangle.record.v) < 1e-5);
+        }
+        BlockHit sphere_hit;
+        IntersectBlock(ray, spheres, &sphere_hit);
+        REQUIRE(sphere_hit.primitive == expected_sphere.primitive);
+        if (sphere_hit.primitive != kNoPrimitive) {
+            REQUIRE(std::fabs(sphere_hit.record.distance - expected_sphere.record.distance) < 1e-5);
+            REQUIRE(FindOccluder(ray, spheres, sphere_hit.record.distance + 1e-5) != kNoPrimitive);
+            REQUIRE(FindOccluder(ray, spheres, sphere_hit.record.distance - 1e-5) == kNoPrimitive);
+        }
+    }
+}
@@ -2,25 +2,29 @@
 
 #include <vector.h>
 
-class Triangle {
+template <class T>
+class BasicTriangle {
 public:
-    Triangle(std::initializer_list<Vector> list) {
+    BasicTriangle(std::initializer_list<BasicVector<T>> list) {
         int i = 0;
-        for (const Vector* pointer = list.begin(); i < 3 && pointer != list.end(); ++i, ++pointer) {
+        for (const BasicVector<T>* pointer = list.begin(); i < 3 && pointer != list.end();
+             ++i, ++pointer) {
             vertices_[i] = *pointer;
         }
         if (i < 3) {
             throw "bad initializer_list size";
         }
     }
-    double Area() const {
+    T Area() const {
         return Length(CrossProduct(vertices_[1] - vertices_[0], vertices_[2] - vertices_[0])) / 2;
     }
 
-    const Vector& GetVertex(size_t ind) const {
+    const BasicVector<T>& GetVertex(size_t ind) const {
         return vertices_[ind];
     }
 
 private:
-    std::array<Vector, 3> vertices_;
-};
\ No newline at end of file
+    std::array<BasicVector<T>, 3> vertices_;
+};
+
+using Triangle = BasicTriangle<Scalar>;
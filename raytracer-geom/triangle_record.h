@@ -0,0 +1,24 @@
+#pragma once
+
+#include <vector.h>
+#include <triangle.h>
+
+// Everything a ray-triangle test needs, precomputed once when the scene is loaded.
+template <class T>
+struct BasicTriangleRecord {
+    BasicTriangleRecord(const BasicTriangle<T>& triangle, bool has_vertex_normals)
+        : vertex0(triangle.GetVertex(0)),
+          edge1(triangle.GetVertex(1) - vertex0),
+          edge2(triangle.GetVertex(2) - vertex0),
+          normal(CrossProduct(edge1, edge2)),
+          has_vertex_normals(has_vertex_normals) {
+    }
+
+    BasicVector<T> vertex0;
+    BasicVector<T> edge1;
+    BasicVector<T> edge2;
+    BasicVector<T> normal;  // not normalized
+    bool has_vertex_normals;
+};
+
+using TriangleRecord = BasicTriangleRecord<Scalar>;
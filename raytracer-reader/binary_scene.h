@@ -0,0 +1,300 @@
+#pragma once
+
+#include <scene.h>
+#include <mapped_file.h>
+#include <buffer.h>
+
+#include <array>
+#include <bit>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+// Compiled scenes: what ReadScene makes of an OBJ file and its MTL libraries, stored as arrays
+// that are used right after mapping the file, with no text to parse. Files are little-endian and
+// hold Scalar values, so they are read by builds with the same Scalar only.
+
+static_assert(std::endian::native == std::endian::little,
+              "compiled scene files are little-endian");
+
+// Array of count elements (not bytes) at offset from the start of a file.
+struct FileSection {
+    uint64_t offset;
+    uint64_t count;
+};
+
+// Builds a file of arrays that follow a fixed-size header.
+class SectionWriter {
+public:
+    explicit SectionWriter(size_t header_size) : data_(header_size, '\0') {
+    }
+
+    template <class T>
+    FileSection Append(const T* values, size_t count) {
+        static_assert(std::is_trivially_copyable_v<T>);
+        // 64 bytes keeps every section aligned for its elements once mapped
+        data_.resize((data_.size() + 63) / 64 * 64, '\0');
+        FileSection section{data_.size(), count};
+        data_.append(reinterpret_cast<const char*>(values), count * sizeof(T));
+        return section;
+    }
+
+    // Same layout as Append, for structs with padding: only the listed fields are copied and the
+    // bytes between them stay zero, so the same values always make the same file rather than
+    // carrying whatever the memory held.
+    template <class T, class... Fields>
+    FileSection AppendFields(const T* values, size_t count, Fields T::*... fields) {
+        static_assert(std::is_trivially_copyable_v<T>);
+        data_.resize((data_.size() + 63) / 64 * 64, '\0');
+        FileSection section{data_.size(), count};
+        data_.resize(data_.size() + count * sizeof(T), '\0');
+        char* bytes = data_.data() + section.offset;
+        for (size_t i = 0; i < count; ++i, bytes += sizeof(T)) {
+            (CopyField(values[i], fields, bytes), ...);
+        }
+        return section;
+    }
+
+    template <class Header>
+    std::string Finish(const Header& header) {
+        static_assert(std::is_trivially_copyable_v<Header>);
+        std::memcpy(data_.data(), &header, sizeof(header));
+        return std::move(data_);
+    }
+
+private:
+    template <class T, class Field>
+    static void CopyField(const T& value, Field T::*field, char* bytes) {
+        const char* begin = reinterpret_cast<const char*>(&value);
+        const char* field_begin = reinterpret_cast<const char*>(&(value.*field));
+        std::memcpy(bytes + (field_begin - begin), field_begin, sizeof(Field));
+    }
+
+    std::string data_;
+};
+
+// Points buffer at a section of the mapped file, false if the section is out of its bounds.
+template <class T>
+bool GetSection(const std::shared_ptr<MappedFile>& file, const FileSection& section,
+                Buffer<T>* buffer) {
+    const auto& [offset, count] = section;
+    if (offset % alignof(T) != 0 || offset > file->GetSize() ||
+        count > (file->GetSize() - offset) / sizeof(T)) {
+        return false;
+    }
+    *buffer = Buffer<T>(file, reinterpret_cast<const T*>(file->GetData() + offset), count);
+    return true;
+}
+
+enum SceneSection {
+    kSceneMaterials,
+    kSceneMaterialNames,
+    kSceneLights,
+    kSceneSpheres,
+    kScenePositions,
+    kSceneTextureCoords,
+    kSceneNormals,
+    kSceneTriangles,
+    kSceneTriangleRecords,
+    kSceneSectionCount
+};
+
+using SceneSections = std::array<FileSection, kSceneSectionCount>;
+
+struct StoredMaterial {
+    Vector ambient_color;
+    Vector diffuse_color;
+    Vector specular_color;
+    Vector intensity;
+    double specular_exponent;
+    double refraction_index;
+    std::array<double, 3> albedo;
+    uint64_t name_offset;  // into the names section
+    uint64_t name_size;
+};
+
+// Appends the arrays of the scene, returns where they went.
+SceneSections AppendScene(SectionWriter* writer, const Scene& scene) {
+    SceneSections sections;
+    std::vector<StoredMaterial> materials;
+    std::string names;
+    for (const Material& material : scene.GetMaterials()) {
+        materials.push_back({material.ambient_color, material.diffuse_color,
+                             material.specular_color, material.intensity,
+                             material.specular_exponent, material.refraction_index,
+                             material.albedo, names.size(), material.name.size()});
+        names += material.name;
+    }
+    sections[kSceneMaterials] = writer->Append(materials.data(), materials.size());
+    sections[kSceneMaterialNames] = writer->Append(names.data(), names.size());
+    sections[kSceneLights] = writer->Append(scene.GetLights().data(), scene.GetLights().size());
+    const auto& spheres = scene.GetSphereObjects();
+    sections[kSceneSpheres] = writer->AppendFields(spheres.data(), spheres.size(),
+                                                   &SphereObject::material, &SphereObject::sphere);
+
+    const Mesh& mesh = scene.GetMesh();
+    sections[kScenePositions] = writer->Append(mesh.positions.data(), mesh.positions.size());
+    sections[kSceneTextureCoords] =
+        writer->Append(mesh.texture_coords.data(), mesh.texture_coords.size());
+    sections[kSceneNormals] = writer->Append(mesh.normals.data(), mesh.normals.size());
+    sections[kSceneTriangles] = writer->AppendFields(
+        mesh.triangles.data(), mesh.triangles.size(), &MeshTriangle::positions,
+        &MeshTriangle::texture_coords, &MeshTriangle::normals, &MeshTriangle::material);
+    const auto& records = scene.GetTriangleRecords();
+    sections[kSceneTriangleRecords] = writer->AppendFields(
+        records.data(), records.size(), &TriangleRecord::vertex0, &TriangleRecord::edge1,
+        &TriangleRecord::edge2, &TriangleRecord::normal, &TriangleRecord::has_vertex_normals);
+    return sections;
+}
+
+// Scene stored by AppendScene, nullopt if the sections are out of bounds or inconsistent. The
+// arrays are copied out of the mapping as they are, nothing is recomputed.
+std::optional<Scene> ReadSceneSections(const std::shared_ptr<MappedFile>& file,
+                                       const SceneSections& sections) {
+    Buffer<StoredMaterial> materials;
+    Buffer<char> names;
+    Buffer<Light> lights;
+    Buffer<SphereObject> spheres;
+    Buffer<Vector> positions;
+    Buffer<Vector> texture_coords;
+    Buffer<Vector> normals;
+    Buffer<MeshTriangle> triangles;
+    Buffer<TriangleRecord> triangle_records;
+    bool valid = GetSection(file, sections[kSceneMaterials], &materials) &&
+                 GetSection(file, sections[kSceneMaterialNames], &names) &&
+                 GetSection(file, sections[kSceneLights], &lights) &&
+                 GetSection(file, sections[kSceneSpheres], &spheres) &&
+                 GetSection(file, sections[kScenePositions], &positions) &&
+                 GetSection(file, sections[kSceneTextureCoords], &texture_coords) &&
+                 GetSection(file, sections[kSceneNormals], &normals) &&
+                 GetSection(file, sections[kSceneTriangles], &triangles) &&
+                 GetSection(file, sections[kSceneTriangleRecords], &triangle_records);
+    if (!valid || materials.size() >= kNoMaterial || triangle_records.size() != triangles.size() ||
+        positions.empty() || texture_coords.empty() || normals.empty()) {
+        return std::nullopt;
+    }
+    auto valid_material = [&](uint16_t id) {
+        return id == kNoMaterial || id < materials.size();
+    };
+
+    Scene scene;
+    for (const StoredMaterial& stored : materials) {
+        if (stored.name_offset > names.size() ||
+            stored.name_size > names.size() - stored.name_offset) {
+            return std::nullopt;
+        }
+        Material material;
+        material.name.assign(names.data() + stored.name_offset, stored.name_size);
+        material.ambient_color = stored.ambient_color;
+        material.diffuse_color = stored.diffuse_color;
+        material.specular_color = stored.specular_color;
+        material.intensity = stored.intensity;
+        material.specular_exponent = stored.specular_exponent;
+        material.refraction_index = stored.refraction_index;
+        material.albedo = stored.albedo;
+        scene.AddMaterial(std::move(material));
+    }
+    for (const Light& light : lights) {
+        scene.AddLight(light.position[0], light.position[1], light.position[2],
+                       light.intensity[0], light.intensity[1], light.intensity[2]);
+    }
+    for (const SphereObject& object : spheres) {
+        if (!valid_material(object.material)) {
+            return std::nullopt;
+        }
+        const Vector& center = object.sphere.GetCenter();
+        scene.AddSphereObject(center[0], center[1], center[2], object.sphere.GetRadius(),
+                              object.material);
+    }
+
+    for (const MeshTriangle& triangle : triangles) {
+        for (int i = 0; i < 3; ++i) {
+            if (triangle.positions[i] >= positions.size() ||
+                triangle.texture_coords[i] >= texture_coords.size() ||
+                triangle.normals[i] >= normals.size()) {
+                return std::nullopt;
+            }
+        }
+        if (!valid_material(triangle.material)) {
+            return std::nullopt;
+        }
+    }
+    Mesh mesh;
+    mesh.positions.assign(positions.begin(), positions.end());
+    mesh.texture_coords.assign(texture_coords.begin(), texture_coords.end());
+    mesh.normals.assign(normals.begin(), normals.end());
+    mesh.triangles.assign(triangles.begin(), triangles.end());
+    scene.SetMesh(std::move(mesh),
+                  std::vector<TriangleRecord>(triangle_records.begin(), triangle_records.end()));
+    return scene;
+}
+
+// Bumped whenever the layout of compiled scenes changes.
+constexpr uint32_t kBinarySceneVersion = 1;
+constexpr std::array<char, 8> kBinarySceneMagic = {'R', 'T', 'B', 'S', 'C', 'N', '\0', '\0'};
+
+struct BinarySceneHeader {
+    std::array<char, 8> magic;
+    uint32_t version;
+    uint32_t scalar_size;  // sizeof(Scalar) of the writer
+    SceneSections sections;
+};
+
+std::string SerializeScene(const Scene& scene) {
+    SectionWriter writer(sizeof(BinarySceneHeader));
+    SceneSections sections = AppendScene(&writer, scene);
+    return writer.Finish(
+        BinarySceneHeader{kBinarySceneMagic, kBinarySceneVersion, sizeof(Scalar), sections});
+}
+
+void WriteBinaryScene(const Scene& scene, const std::string& filename) {
+    std::string data = SerializeScene(scene);
+    std::ofstream out(filename, std::ios::binary);
+    out.write(data.data(), data.size());
+    if (!out) {
+        throw std::runtime_error("can't write " + filename);
+    }
+}
+
+// True for files that start like a compiled scene, whatever their version.
+bool IsBinaryScene(const std::string& filename) {
+    std::ifstream in(filename, std::ios::binary);
+    std::array<char, 8> magic{};
+    in.read(magic.data(), magic.size());
+    return in && magic == kBinarySceneMagic;
+}
+
+Scene ReadBinaryScene(const std::string& filename) {
+    auto file = std::make_shared<MappedFile>(filename);
+    BinarySceneHeader header;
+    if (file->GetSize() < sizeof(header)) {
+        throw std::runtime_error(filename + " is not a compiled scene");
+    }
+    std::memcpy(&header, file->GetData(), sizeof(header));
+    if (header.magic != kBinarySceneMagic) {
+        throw std::runtime_error(filename + " is not a compiled scene");
+    }
+    if (header.version != kBinarySceneVersion || header.scalar_size != sizeof(Scalar)) {
+        throw std::runtime_error(filename + " was compiled by another version, convert it again");
+    }
+    auto scene = ReadSceneSections(file, header.sections);
+    if (!scene) {
+        throw std::runtime_error(filename + " is corrupted");
+    }
+    return std::move(*scene);
+}
+
+// Scene of an OBJ file or of a compiled scene, told apart by their first bytes. OBJ files are
+// parsed on threads threads, 0 means one per hardware thread.
+Scene LoadScene(const std::string& filename, size_t threads = 0) {
+    if (IsBinaryScene(filename)) {
+        return ReadBinaryScene(filename);
+    }
+    return ReadScene(filename, threads);
+}
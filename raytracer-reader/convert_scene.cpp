@@ -0,0 +1,29 @@
+#include <binary_scene.h>
+
+#include <chrono>
+#include <exception>
+#include <iostream>
+#include <string>
+
+// Compiles an OBJ file and its MTL libraries into a scene file that Render loads without parsing.
+int main(int argc, char** argv) {
+    if (argc != 3) {
+        std::cerr << "usage: " << argv[0] << " <scene.obj> <scene.rtb>\n";
+        return 2;
+    }
+    try {
+        auto start = std::chrono::steady_clock::now();
+        Scene scene = ReadScene(argv[1], 0);
+        WriteBinaryScene(scene, argv[2]);
+        double seconds =
+            std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        std::cout << argv[1] << ": " << scene.GetObjects().size() << " triangles, "
+                  << scene.GetSphereObjects().size() << " spheres, " << scene.GetLights().size()
+                  << " lights, " << scene.GetMaterials().size() << " materials in " << seconds
+                  << " s\n";
+    } catch (const std::exception& error) {
+        std::cerr << error.what() << "\n";
+        return 1;
+    }
+    return 0;
+}
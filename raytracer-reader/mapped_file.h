@@ -0,0 +1,64 @@
+#pragma once
+
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Read-only memory mapping of a whole file.
+class MappedFile {
+public:
+    explicit MappedFile(const std::string& filename) {
+        int fd = open(filename.c_str(), O_RDONLY);
+        if (fd == -1) {
+            throw std::runtime_error("can't open " + filename + ": " + std::strerror(errno));
+        }
+        struct stat info;
+        if (fstat(fd, &info) == -1) {
+            // close may change errno
+            int error = errno;
+            close(fd);
+            throw std::runtime_error("can't stat " + filename + ": " + std::strerror(error));
+        }
+        size_ = info.st_size;
+        int error = 0;
+        if (size_ != 0) {
+            data_ = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+            error = errno;
+        }
+        close(fd);
+        if (data_ == MAP_FAILED) {
+            data_ = nullptr;
+            throw std::runtime_error("can't map " + filename + ": " + std::strerror(error));
+        }
+    }
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    ~MappedFile() {
+        if (data_ != nullptr) {
+            munmap(data_, size_);
+        }
+    }
+
+    const char* GetData() const {
+        return static_cast<const char*>(data_);
+    }
+    size_t GetSize() const {
+        return size_;
+    }
+    std::string_view GetContents() const {
+        return {GetData(), size_};
+    }
+
+private:
+    void* data_ = nullptr;
+    size_t size_ = 0;
+};
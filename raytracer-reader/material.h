@@ -1,6 +1,8 @@
 #pragma once
 
 #include <vector.h>
+
+#include <cstdint>
 #include <string>
 
 struct Material {
@@ -17,7 +19,10 @@ struct Material {
     Vector diffuse_color;
     Vector specular_color;
     Vector intensity;  // ?
-    double specular_exponent;
-    double refraction_index;
+    double specular_exponent = 0;
+    double refraction_index = 1;
     std::array<double, 3> albedo;
 };
+
+// Material id of primitives without a material.
+constexpr uint16_t kNoMaterial = UINT16_MAX;
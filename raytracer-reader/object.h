@@ -4,18 +4,51 @@
 #include <material.h>
 #include <sphere.h>
 
+#include <array>
+#include <cstdint>
+#include <vector>
+
+// Corners of one mesh triangle as indices into the attribute arrays of its Mesh.
+struct MeshTriangle {
+    std::array<uint32_t, 3> positions;
+    std::array<uint32_t, 3> texture_coords;
+    std::array<uint32_t, 3> normals;
+    uint16_t material;  // index into Scene::GetMaterials(), or kNoMaterial
+};
+
+// Triangles sharing position, texture coordinate and normal arrays. Every array starts with the
+// zero vector, which corners without that attribute refer to, so OBJ index i is element i.
+struct Mesh {
+    Mesh() : positions(1), texture_coords(1), normals(1) {
+    }
+
+    std::vector<Vector> positions;
+    std::vector<Vector> texture_coords;
+    std::vector<Vector> normals;
+    std::vector<MeshTriangle> triangles;
+};
+
+// One mesh triangle seen through its indices, cheap to copy.
 struct Object {
+    const Vector& GetVertex(size_t index) const {
+        return mesh->positions[triangle->positions[index]];
+    }
+    const Vector& GetTextureCoords(size_t index) const {
+        return mesh->texture_coords[triangle->texture_coords[index]];
+    }
     const Vector* GetNormal(size_t index) const {
-        return &normal.GetVertex(index);
+        return &mesh->normals[triangle->normals[index]];
+    }
+    Triangle GetPolygon() const {
+        return {GetVertex(0), GetVertex(1), GetVertex(2)};
     }
 
     const Material* material = nullptr;
-    Triangle polygon;
-    Triangle texture;
-    Triangle normal;
+    const Mesh* mesh = nullptr;
+    const MeshTriangle* triangle = nullptr;
 };
 
 struct SphereObject {
-    const Material* material = nullptr;
+    uint16_t material = kNoMaterial;
     Sphere sphere;
 };
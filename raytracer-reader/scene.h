@@ -1,23 +1,99 @@
 #pragma once
 
 #include <material.h>
+#include <mapped_file.h>
 #include <vector.h>
 #include <object.h>
 #include <light.h>
+#include <geometry.h>
+#include <triangle_record.h>
 
 #include <vector>
 #include <map>
 #include <string>
-
-#include <fstream>
+#include <string_view>
+#include <charconv>
+#include <stdexcept>
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <exception>
+#include <thread>
+
+// Faces without "vn" indices get all-zero vertex normals.
+bool NormalZeros(const Object& object) {
+    for (int i = 0; i < 3; ++i) {
+        for (int j = 0; j < 3; ++j) {
+            if (std::fabs((*object.GetNormal(i))[j]) > kEps) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
 
 class Scene {
 public:
+    // Triangles of the mesh as Object views, indexed like GetTriangleRecords().
+    class ObjectList {
+    public:
+        class Iterator {
+        public:
+            Iterator(const Scene* scene, size_t index) : scene_(scene), index_(index) {
+            }
+            Object operator*() const {
+                return scene_->GetObject(index_);
+            }
+            Iterator& operator++() {
+                ++index_;
+                return *this;
+            }
+            bool operator==(const Iterator& other) const {
+                return index_ == other.index_;
+            }
+
+        private:
+            const Scene* scene_;
+            size_t index_;
+        };
+
+        explicit ObjectList(const Scene* scene) : scene_(scene) {
+        }
+
+        size_t size() const {
+            return scene_->mesh_.triangles.size();
+        }
+        Object operator[](size_t index) const {
+            return scene_->GetObject(index);
+        }
+        Iterator begin() const {
+            return {scene_, 0};
+        }
+        Iterator end() const {
+            return {scene_, size()};
+        }
+
+    private:
+        const Scene* scene_;
+    };
+
     Scene() {
     }
 
-    const std::vector<Object>& GetObjects() const {
-        return objects_;
+    // Cold per-triangle data (material, texture and vertex normals), read for closest hits only.
+    ObjectList GetObjects() const {
+        return ObjectList(this);
+    }
+    Object GetObject(size_t index) const {
+        const MeshTriangle& triangle = mesh_.triangles[index];
+        return {GetMaterial(triangle.material), &mesh_, &triangle};
+    }
+    const Mesh& GetMesh() const {
+        return mesh_;
+    }
+    // Hot per-triangle intersection data, parallel to GetObjects().
+    const std::vector<TriangleRecord>& GetTriangleRecords() const {
+        return triangle_records_;
     }
     const std::vector<SphereObject>& GetSphereObjects() const {
         return sphere_objects_;
@@ -25,28 +101,77 @@ public:
     const std::vector<Light>& GetLights() const {
         return lights_;
     }
-    const std::map<std::string, Material>& GetMaterials() const {
+    // Indexed by material id, primitives store the id.
+    const std::vector<Material>& GetMaterials() const {
         return materials_;
     }
+    const Material* GetMaterial(uint16_t id) const {
+        return id == kNoMaterial ? nullptr : &materials_[id];
+    }
 
-    void AddObject(const Object& object) {
-        objects_.push_back(object);
+    // Replaces the triangles; the records are computed unless given, e.g. by other threads.
+    void SetMesh(Mesh mesh) {
+        std::vector<TriangleRecord> triangle_records;
+        triangle_records.reserve(mesh.triangles.size());
+        for (const MeshTriangle& triangle : mesh.triangles) {
+            triangle_records.push_back(GetTriangleRecord(mesh, triangle));
+        }
+        SetMesh(std::move(mesh), std::move(triangle_records));
     }
-    void AddSphereObject(double x, double y, double z, double r, const Material* mat) {
-        sphere_objects_.push_back({mat, Sphere({x, y, z}, r)});
+    void SetMesh(Mesh mesh, std::vector<TriangleRecord> triangle_records) {
+        mesh_ = std::move(mesh);
+        triangle_records_ = std::move(triangle_records);
+    }
+    void AddSphereObject(double x, double y, double z, double r, uint16_t material) {
+        sphere_objects_.push_back({material, Sphere({x, y, z}, r)});
     }
     void AddLight(double x, double y, double z, double r, double g, double b) {
         lights_.push_back(Light({x, y, z}, {r, g, b}));  // what about move() ?
     }
-    void SetMaterials(std::map<std::string, Material> materials) {
-        materials_ = std::move(materials);
+    // Returns the id of the new material.
+    uint16_t AddMaterial(Material material) {
+        if (materials_.size() >= kNoMaterial) {
+            throw std::runtime_error("too many materials");
+        }
+        materials_.push_back(std::move(material));
+        return materials_.size() - 1;
+    }
+
+    static TriangleRecord GetTriangleRecord(const Mesh& mesh, const MeshTriangle& triangle) {
+        Object object{nullptr, &mesh, &triangle};
+        return TriangleRecord(object.GetPolygon(), !NormalZeros(object));
     }
 
 private:
-    std::vector<Object> objects_;
+    Mesh mesh_;
+    std::vector<TriangleRecord> triangle_records_;
     std::vector<SphereObject> sphere_objects_;
     std::vector<Light> lights_;
-    std::map<std::string, Material> materials_;
+    std::vector<Material> materials_;
+};
+
+// Ids of the materials of the latest mtllib by name, only needed while parsing.
+class MaterialIds {
+public:
+    // Adds the materials to the scene, usemtl refers to them from now on.
+    void AddLibrary(Scene* scene, std::vector<Material> materials) {
+        ids_.clear();
+        for (Material& material : materials) {
+            std::string name = material.name;
+            ids_[std::move(name)] = scene->AddMaterial(std::move(material));
+        }
+    }
+
+    uint16_t Get(std::string_view name) const {
+        auto found = ids_.find(name);
+        if (found == ids_.end()) {
+            throw std::out_of_range("unknown material \"" + std::string(name) + "\"");
+        }
+        return found->second;
+    }
+
+private:
+    std::map<std::string, uint16_t, std::less<>> ids_;
 };
 
 std::vector<std::string> Tokenize(const std::string& string, const std::string delim = " \t\r") {
@@ -69,74 +194,150 @@ std::vector<std::string> TokenizeSlash(const std::string& string, const std::str
     return result;
 }
 
-Vector GetVectorByIndex(const std::vector<Vector>& vectors, int index) {
+// Element of an OBJ index in a Mesh attribute array after the first seen attributes were read;
+// relative indices count back from the last of them and 0 (no attribute) stays 0. Throws for
+// indices past the attributes read so far.
+inline uint32_t GetAttributeIndex(size_t seen, int index) {
     if (index == 0) {
-        return {0, 0, 0};
+        return 0;
     }
-    if (index > 0) {
-        return vectors.at(index - 1);
+    size_t distance = index > 0 ? index : -static_cast<int64_t>(index);
+    if (distance > seen) {
+        throw std::out_of_range("face index " + std::to_string(index) + " out of range");
     }
-    return vectors.at(vectors.size() + index);
+    return index > 0 ? index : seen + 1 - distance;
 }
 
-Triangle GetTriangleByIndex(const std::vector<Vector>& vectors, const std::vector<int>& indices,
-                            int index_0, int index_1, int index_2) {
-    return {
-        GetVectorByIndex(vectors, indices[index_0]),
-        GetVectorByIndex(vectors, indices[index_1]),
-        GetVectorByIndex(vectors, indices[index_2]),
-    };
-}
+// Walks mapped OBJ/MTL text line by line and splits lines into tokens that point into the text,
+// so scanning allocates nothing.
+class TextScanner {
+public:
+    explicit TextScanner(std::string_view text) : text_(text) {
+    }
+
+    // Moves to the next line, false once the text is over.
+    bool NextLine() {
+        if (text_.empty()) {
+            return false;
+        }
+        size_t end = text_.find('\n');
+        line_ = text_.substr(0, end);
+        text_.remove_prefix(end == std::string_view::npos ? text_.size() : end + 1);
+        return true;
+    }
 
-inline std::map<std::string, Material> ReadMaterials(std::string_view filename) {
-    std::map<std::string, Material> materials;
+    // Next token of the current line, empty at its end.
+    std::string_view NextToken() {
+        size_t begin = line_.find_first_not_of(" \t\r");
+        if (begin == std::string_view::npos) {
+            line_ = {};
+            return {};
+        }
+        size_t end = line_.find_first_of(" \t\r", begin);
+        std::string_view token = line_.substr(begin, end - begin);
+        line_.remove_prefix(end == std::string_view::npos ? line_.size() : end);
+        return token;
+    }
 
-    std::ifstream fin((std::string(filename)));
-    std::string line;
+    double NextDouble() {
+        return ParseNumber<double>(NextToken());
+    }
+    // Same, but an absent number reads as missing.
+    double NextDouble(double missing) {
+        std::string_view token = NextToken();
+        return token.empty() ? missing : ParseNumber<double>(token);
+    }
+    Vector NextVector() {
+        double x = NextDouble();
+        double y = NextDouble();
+        double z = NextDouble();
+        return {x, y, z};
+    }
 
-    std::string material;
-    // bool material_created = false;
+    // Parses the leading number of the token like std::stod/std::stoi do.
+    template <class T>
+    static T ParseNumber(std::string_view token) {
+        std::string_view digits = token;
+        if (!digits.empty() && digits[0] == '+') {
+            digits.remove_prefix(1);
+        }
+        T value;
+        auto [end, error] = std::from_chars(digits.data(), digits.data() + digits.size(), value);
+        if (error != std::errc()) {
+            throw std::runtime_error("bad number \"" + std::string(token) + "\"");
+        }
+        return value;
+    }
 
-    while (std::getline(fin, line)) {
-        auto tokens = Tokenize(line);
+private:
+    std::string_view text_;
+    std::string_view line_;
+};
 
-        if (tokens.empty()) {
-            continue;
+// Splits a face vertex "v", "v/t", "v//n" or "v/t/n" into its indices, 0 where one is missing.
+inline void ParseFaceVertex(std::string_view token, int* vertex, int* texture, int* normal) {
+    int* indices[] = {vertex, texture, normal};
+    for (int* index : indices) {
+        size_t end = token.find('/');
+        std::string_view part = token.substr(0, end);
+        *index = part.empty() ? 0 : TextScanner::ParseNumber<int>(part);
+        token.remove_prefix(end == std::string_view::npos ? token.size() : end + 1);
+    }
+}
+
+// Materials of an MTL file in the order they are first defined.
+inline std::vector<Material> ReadMaterials(std::string_view filename) {
+    std::vector<Material> materials;
+    std::map<std::string, size_t, std::less<>> indices;
+
+    MappedFile file((std::string(filename)));
+    TextScanner scanner(file.GetContents());
+
+    size_t selected = materials.size();
+    auto select = [&](std::string_view name) {
+        auto [found, inserted] = indices.try_emplace(std::string(name), materials.size());
+        if (inserted) {
+            materials.emplace_back().name = name;
         }
-        if (tokens[0] == "#") {
-            continue;
+        selected = found->second;
+    };
+    auto current = [&]() -> Material& {
+        if (selected == materials.size()) {
+            // properties before the first newmtl, as the old reader did
+            select("");
         }
+        return materials[selected];
+    };
+
+    while (scanner.NextLine()) {
+        std::string_view tag = scanner.NextToken();
 
-        if (tokens[0] == "newmtl") {
-            material = tokens[1];
-            materials[material].name = material;
+        if (tag == "newmtl") {
+            select(scanner.NextToken());
 
-        } else if (tokens[0] == "Ka") {
-            materials[material].ambient_color = {std::stod(tokens[1]), std::stod(tokens[2]),
-                                                 std::stod(tokens[3])};
+        } else if (tag == "Ka") {
+            current().ambient_color = scanner.NextVector();
 
-        } else if (tokens[0] == "Kd") {
-            materials[material].diffuse_color = {std::stod(tokens[1]), std::stod(tokens[2]),
-                                                 std::stod(tokens[3])};
+        } else if (tag == "Kd") {
+            current().diffuse_color = scanner.NextVector();
 
-        } else if (tokens[0] == "Ks") {
-            materials[material].specular_color = {std::stod(tokens[1]), std::stod(tokens[2]),
-                                                  std::stod(tokens[3])};
+        } else if (tag == "Ks") {
+            current().specular_color = scanner.NextVector();
 
-        } else if (tokens[0] == "Ns") {
-            materials[material].specular_exponent = std::stod(tokens[1]);
+        } else if (tag == "Ns") {
+            current().specular_exponent = scanner.NextDouble();
 
-        } else if (tokens[0] == "al") {
-            materials[material].albedo = {std::stod(tokens[1]), std::stod(tokens[2]),
-                                          std::stod(tokens[3])};
+        } else if (tag == "al") {
+            double albedo0 = scanner.NextDouble();
+            double albedo1 = scanner.NextDouble();
+            double albedo2 = scanner.NextDouble();
+            current().albedo = {albedo0, albedo1, albedo2};
 
-        } else if (tokens[0] == "illum") {
+        } else if (tag == "Ni") {
+            current().refraction_index = scanner.NextDouble();
 
-        } else if (tokens[0] == "Ni") {
-            materials[material].refraction_index = std::stod(tokens[1]);
-        } else if (tokens[0] == "Ke") {
-            materials[material].intensity = {std::stod(tokens[1]), std::stod(tokens[2]),
-                                             std::stod(tokens[3])};
+        } else if (tag == "Ke") {
+            current().intensity = scanner.NextVector();
         }
     }
 
@@ -146,89 +347,346 @@ inline std::map<std::string, Material> ReadMaterials(std::string_view filename)
 inline Scene ReadScene(const std::string& filename) {
     Scene scene;
 
-    std::ifstream fin((std::string(filename)));
-    std::string line;
+    MappedFile file(filename);
+    TextScanner scanner(file.GetContents());
+
+    Mesh mesh;
+    MaterialIds material_ids;
+    uint16_t material = kNoMaterial;
+
+    // reused by every face, so faces allocate only while they grow
+    std::vector<uint32_t> vertex_indices;
+    std::vector<uint32_t> texture_indices;
+    std::vector<uint32_t> normal_indices;
+
+    while (scanner.NextLine()) {
+        std::string_view tag = scanner.NextToken();
+        if (tag.empty()) {
+            continue;
+        } else if (tag == "S") {
+            Vector center = scanner.NextVector();
+            double radius = scanner.NextDouble();
+            scene.AddSphereObject(center[0], center[1], center[2], radius, material);
+
+        } else if (tag == "P") {
+            Vector position = scanner.NextVector();
+            Vector intensity = scanner.NextVector();
+            scene.AddLight(position[0], position[1], position[2], intensity[0], intensity[1],
+                           intensity[2]);
+
+        } else if (tag == "v") {
+            mesh.positions.push_back(scanner.NextVector());
+
+        } else if (tag == "vt") {
+            // v and w are optional
+            double u = scanner.NextDouble();
+            double v = scanner.NextDouble(0);
+            double w = scanner.NextDouble(0);
+            mesh.texture_coords.push_back({u, v, w});
+
+        } else if (tag == "vn") {
+            mesh.normals.push_back(scanner.NextVector());
+
+        } else if (tag == "f") {
+            vertex_indices.clear();
+            texture_indices.clear();
+            normal_indices.clear();
+            for (auto token = scanner.NextToken(); !token.empty(); token = scanner.NextToken()) {
+                int vertex, texture, normal;
+                ParseFaceVertex(token, &vertex, &texture, &normal);
+                vertex_indices.push_back(GetAttributeIndex(mesh.positions.size() - 1, vertex));
+                texture_indices.push_back(
+                    GetAttributeIndex(mesh.texture_coords.size() - 1, texture));
+                normal_indices.push_back(GetAttributeIndex(mesh.normals.size() - 1, normal));
+            }
+            for (size_t j = 2; j < vertex_indices.size(); ++j) {
+                mesh.triangles.push_back({
+                    {vertex_indices[0], vertex_indices[j - 1], vertex_indices[j]},
+                    {texture_indices[0], texture_indices[j - 1], texture_indices[j]},
+                    {normal_indices[0], normal_indices[j - 1], normal_indices[j]},
+                    material,
+                });
+            }
+
+        } else if (tag == "mtllib") {
+            material_ids.AddLibrary(
+                &scene, ReadMaterials(filename.substr(0, filename.find_last_of("/") + 1) +
+                                      std::string(scanner.NextToken())));
+
+        } else if (tag == "usemtl") {
+            material = material_ids.Get(scanner.NextToken());
+        }
+    }
+
+    scene.SetMesh(std::move(mesh));
+    return scene;
+}
+
+// One line-aligned piece of an OBJ file, parsed independently of the others. Face indices are
+// kept as written together with the number of attributes the chunk defined before the face:
+// relative (negative) indices and the range check need the counts of all earlier chunks, which
+// are only known once every chunk is parsed.
+struct ObjChunk {
+    struct FaceVertex {
+        int vertex;
+        int texture;
+        int normal;
+    };
+    struct Face {
+        uint32_t first_vertex;  // into face_vertices
+        uint32_t vertex_count;
+        uint32_t vertices_seen;
+        uint32_t textures_seen;
+        uint32_t normals_seen;
+        int material;  // last usemtl of the chunk before the face, -1 for none
+    };
+    struct SphereEntry {
+        Vector center;
+        double radius;
+        int material;
+    };
+    // mtllib and usemtl lines in file order, names point into the mapped file
+    struct MaterialEvent {
+        bool library;
+        std::string_view name;
+    };
 
-    const Material* material = nullptr;
     std::vector<Vector> vertices;
     std::vector<Vector> textures;
     std::vector<Vector> normals;
+    std::vector<FaceVertex> face_vertices;
+    std::vector<Face> faces;
+    std::vector<SphereEntry> spheres;
+    std::vector<Light> lights;
+    std::vector<MaterialEvent> material_events;
+    size_t triangle_count = 0;  // after splitting faces into fans
+};
+
+// Parses the lines of text the way ReadScene does, without resolving anything.
+inline ObjChunk ParseObjChunk(std::string_view text) {
+    ObjChunk chunk;
+    TextScanner scanner(text);
+    int material = -1;
 
-    while (std::getline(fin, line)) {
-        auto tokens = Tokenize(line);
-        if (tokens.empty()) {
+    while (scanner.NextLine()) {
+        std::string_view tag = scanner.NextToken();
+        if (tag.empty()) {
             continue;
-        } else if (tokens[0] == "S") {
-            scene.AddSphereObject(std::stod(tokens[1]), std::stod(tokens[2]), std::stod(tokens[3]),
-                                  std::stod(tokens[4]), material);
+        } else if (tag == "S") {
+            Vector center = scanner.NextVector();
+            double radius = scanner.NextDouble();
+            chunk.spheres.push_back({center, radius, material});
+
+        } else if (tag == "P") {
+            Vector position = scanner.NextVector();
+            Vector intensity = scanner.NextVector();
+            chunk.lights.push_back(Light(position, intensity));
+
+        } else if (tag == "v") {
+            chunk.vertices.push_back(scanner.NextVector());
+
+        } else if (tag == "vt") {
+            double u = scanner.NextDouble();
+            double v = scanner.NextDouble(0);
+            double w = scanner.NextDouble(0);
+            chunk.textures.push_back({u, v, w});
+
+        } else if (tag == "vn") {
+            chunk.normals.push_back(scanner.NextVector());
+
+        } else if (tag == "f") {
+            ObjChunk::Face face;
+            face.first_vertex = chunk.face_vertices.size();
+            for (auto token = scanner.NextToken(); !token.empty(); token = scanner.NextToken()) {
+                ObjChunk::FaceVertex vertex;
+                ParseFaceVertex(token, &vertex.vertex, &vertex.texture, &vertex.normal);
+                chunk.face_vertices.push_back(vertex);
+            }
+            face.vertex_count = chunk.face_vertices.size() - face.first_vertex;
+            face.vertices_seen = chunk.vertices.size();
+            face.textures_seen = chunk.textures.size();
+            face.normals_seen = chunk.normals.size();
+            face.material = material;
+            chunk.faces.push_back(face);
+            chunk.triangle_count += std::max<uint32_t>(face.vertex_count, 2) - 2;
+
+        } else if (tag == "mtllib") {
+            chunk.material_events.push_back({true, scanner.NextToken()});
+
+        } else if (tag == "usemtl") {
+            material = chunk.material_events.size();
+            chunk.material_events.push_back({false, scanner.NextToken()});
+        }
+    }
 
-        } else if (tokens[0] == "P") {
-            scene.AddLight(std::stod(tokens[1]), std::stod(tokens[2]), std::stod(tokens[3]),
-                           std::stod(tokens[4]), std::stod(tokens[5]), std::stod(tokens[6]));
+    return chunk;
+}
 
-        } else if (tokens[0] == "v") {
-            vertices.push_back(
-                {std::stod((tokens[1])), std::stod((tokens[2])), std::stod((tokens[3]))});
+// Splits text into pieces of about chunk_size bytes that end right after a newline.
+inline std::vector<std::string_view> SplitIntoLineChunks(std::string_view text, size_t chunk_size) {
+    std::vector<std::string_view> chunks;
+    chunk_size = std::max<size_t>(chunk_size, 1);
+    while (!text.empty()) {
+        size_t end = text.size() <= chunk_size ? std::string_view::npos
+                                               : text.find('\n', chunk_size - 1);
+        end = end == std::string_view::npos ? text.size() : end + 1;
+        chunks.push_back(text.substr(0, end));
+        text.remove_prefix(end);
+    }
+    return chunks;
+}
 
-        } else if (tokens[0] == "vt") {
-            textures.push_back(
-                {std::stod((tokens[1])), std::stod((tokens[2])), std::stod((tokens[3]))});
+// Runs task(index) for every index in [0, count) on up to threads threads (0 means one per
+// hardware thread). Rethrows the exception of the smallest failed index, so errors do not depend
+// on scheduling.
+template <class Task>
+void RunChunkTasks(size_t count, size_t threads, Task&& task) {
+    if (threads == 0) {
+        threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+    threads = std::min(threads, count);
+    std::vector<std::exception_ptr> exceptions(count);
+    std::atomic<size_t> next = 0;
+    auto work = [&] {
+        for (size_t index = next++; index < count; index = next++) {
+            try {
+                task(index);
+            } catch (...) {
+                exceptions[index] = std::current_exception();
+            }
+        }
+    };
+    std::vector<std::thread> workers;
+    for (size_t i = 1; i < threads; ++i) {
+        workers.emplace_back(work);
+    }
+    work();
+    for (auto& worker : workers) {
+        worker.join();
+    }
+    for (const auto& exception : exceptions) {
+        if (exception) {
+            std::rethrow_exception(exception);
+        }
+    }
+}
 
-        } else if (tokens[0] == "vn") {
-            normals.push_back(
-                {std::stod((tokens[1])), std::stod((tokens[2])), std::stod((tokens[3]))});
+constexpr size_t kObjChunkSize = 1 << 20;
 
-        } else if (tokens[0] == "f") {
-            if (tokens.size() != 1 + 3 && false) {
-                throw std::runtime_error("idk, maybe there must be 3 vertices? -_-");
-            }
+// Same scene as ReadScene(filename), but the file is parsed in line-aligned chunks of about
+// chunk_size bytes on threads threads (0 means one per hardware thread). Chunks are parsed in
+// parallel, then material libraries and usemtl lines are resolved in file order, and finally the
+// faces of every chunk are resolved against the attributes of all chunks before them.
+inline Scene ReadScene(const std::string& filename, size_t threads,
+                       size_t chunk_size = kObjChunkSize) {
+    if (threads == 0) {
+        threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+    if (threads == 1) {
+        return ReadScene(filename);
+    }
+    Scene scene;
 
-            std::vector<int> vertex_indices;
-            std::vector<int> texture_indices;
-            std::vector<int> normal_indices;
-
-            for (size_t i = 1; i < tokens.size(); ++i) {
-                std::vector<std::string> indices = TokenizeSlash(tokens[i], "/");
-
-                if (indices.size() == 1) {
-                    vertex_indices.push_back(std::stoi(indices[0]));
-                    texture_indices.push_back(0);
-                    normal_indices.push_back(0);
-                    continue;
-                }
-                if (indices.size() == 2) {
-                    vertex_indices.push_back(std::stoi(indices[0]));
-                    texture_indices.push_back(std::stoi(indices[1]));
-                    normal_indices.push_back(0);
-                    continue;
-                }
-                if (indices[1].empty()) {
-                    vertex_indices.push_back(std::stoi(indices[0]));
-                    texture_indices.push_back(0);
-                    normal_indices.push_back(std::stoi(indices[2]));
-                    continue;
-                }
-                vertex_indices.push_back(std::stoi(indices[0]));
-                texture_indices.push_back(std::stoi(indices[1]));
-                normal_indices.push_back(std::stoi(indices[2]));
-            }
-            for (size_t j = 2; j < vertex_indices.size(); ++j) {
-                scene.AddObject({
-                    material,
-                    GetTriangleByIndex(vertices, vertex_indices, 0, j - 1, j),
-                    GetTriangleByIndex(textures, texture_indices, 0, j - 1, j),
-                    GetTriangleByIndex(normals, normal_indices, 0, j - 1, j),
-                });
+    MappedFile file(filename);
+    auto texts = SplitIntoLineChunks(file.GetContents(), chunk_size);
+    std::vector<ObjChunk> chunks(texts.size());
+    RunChunkTasks(chunks.size(), threads,
+                  [&](size_t index) { chunks[index] = ParseObjChunk(texts[index]); });
+
+    // material state is sequential: usemtl looks names up in the latest mtllib
+    MaterialIds material_ids;
+    std::vector<uint16_t> entry_materials(chunks.size());
+    std::vector<std::vector<uint16_t>> used_materials(chunks.size());
+    uint16_t material = kNoMaterial;
+    for (size_t index = 0; index < chunks.size(); ++index) {
+        ObjChunk& chunk = chunks[index];
+        entry_materials[index] = material;
+        used_materials[index].resize(chunk.material_events.size());
+        for (size_t event = 0; event < chunk.material_events.size(); ++event) {
+            const auto& [library, name] = chunk.material_events[event];
+            if (library) {
+                material_ids.AddLibrary(
+                    &scene, ReadMaterials(filename.substr(0, filename.find_last_of("/") + 1) +
+                                          std::string(name)));
+            } else {
+                material = material_ids.Get(name);
+                used_materials[index][event] = material;
             }
+        }
+        for (const auto& sphere : chunk.spheres) {
+            scene.AddSphereObject(sphere.center[0], sphere.center[1], sphere.center[2],
+                                  sphere.radius,
+                                  sphere.material == -1 ? entry_materials[index]
+                                                        : used_materials[index][sphere.material]);
+        }
+        for (const Light& light : chunk.lights) {
+            scene.AddLight(light.position[0], light.position[1], light.position[2],
+                           light.intensity[0], light.intensity[1], light.intensity[2]);
+        }
+    }
 
-        } else if (tokens[0] == "mtllib") {
-            scene.SetMaterials(ReadMaterials(
-                std::string(filename).substr(0, filename.find_last_of("/") + 1) + tokens[1]));
+    Mesh mesh;
+    std::vector<size_t> vertex_offsets(chunks.size());
+    std::vector<size_t> texture_offsets(chunks.size());
+    std::vector<size_t> normal_offsets(chunks.size());
+    std::vector<size_t> triangle_offsets(chunks.size());
+    size_t triangle_count = 0;
+    for (size_t index = 0; index < chunks.size(); ++index) {
+        ObjChunk& chunk = chunks[index];
+        // offsets count attributes, the arrays also hold the leading zero vector
+        vertex_offsets[index] = mesh.positions.size() - 1;
+        texture_offsets[index] = mesh.texture_coords.size() - 1;
+        normal_offsets[index] = mesh.normals.size() - 1;
+        triangle_offsets[index] = triangle_count;
+        mesh.positions.insert(mesh.positions.end(), chunk.vertices.begin(), chunk.vertices.end());
+        mesh.texture_coords.insert(mesh.texture_coords.end(), chunk.textures.begin(),
+                                   chunk.textures.end());
+        mesh.normals.insert(mesh.normals.end(), chunk.normals.begin(), chunk.normals.end());
+        chunk.vertices = {};
+        chunk.textures = {};
+        chunk.normals = {};
+        triangle_count += chunk.triangle_count;
+    }
 
-        } else if (tokens[0] == "usemtl") {
-            material = &scene.GetMaterials().at(tokens[1]);
+    mesh.triangles.resize(triangle_count);
+    std::vector<std::vector<TriangleRecord>> triangle_records(chunks.size());
+    RunChunkTasks(chunks.size(), threads, [&](size_t index) {
+        const ObjChunk& chunk = chunks[index];
+        MeshTriangle* triangle = mesh.triangles.data() + triangle_offsets[index];
+        triangle_records[index].reserve(chunk.triangle_count);
+        for (const ObjChunk::Face& face : chunk.faces) {
+            size_t vertices_seen = vertex_offsets[index] + face.vertices_seen;
+            size_t textures_seen = texture_offsets[index] + face.textures_seen;
+            size_t normals_seen = normal_offsets[index] + face.normals_seen;
+            const ObjChunk::FaceVertex* corners = chunk.face_vertices.data() + face.first_vertex;
+            uint16_t face_material = face.material == -1 ? entry_materials[index]
+                                                         : used_materials[index][face.material];
+            for (size_t j = 2; j < face.vertex_count; ++j, ++triangle) {
+                const ObjChunk::FaceVertex& a = corners[0];
+                const ObjChunk::FaceVertex& b = corners[j - 1];
+                const ObjChunk::FaceVertex& c = corners[j];
+                *triangle = {
+                    {GetAttributeIndex(vertices_seen, a.vertex),
+                     GetAttributeIndex(vertices_seen, b.vertex),
+                     GetAttributeIndex(vertices_seen, c.vertex)},
+                    {GetAttributeIndex(textures_seen, a.texture),
+                     GetAttributeIndex(textures_seen, b.texture),
+                     GetAttributeIndex(textures_seen, c.texture)},
+                    {GetAttributeIndex(normals_seen, a.normal),
+                     GetAttributeIndex(normals_seen, b.normal),
+                     GetAttributeIndex(normals_seen, c.normal)},
+                    face_material,
+                };
+                triangle_records[index].push_back(Scene::GetTriangleRecord(mesh, *triangle));
+            }
         }
-    }
+    });
 
+    std::vector<TriangleRecord> all_triangle_records;
+    all_triangle_records.reserve(triangle_count);
+    for (const auto& records : triangle_records) {
+        all_triangle_records.insert(all_triangle_records.end(), records.begin(), records.end());
+    }
+    scene.SetMesh(std::move(mesh), std::move(all_triangle_records));
     return scene;
 }
@@ -0,0 +1,91 @@
+#pragma once
+
+#include <scene.h>
+#include <material.h>
+#include <object.h>
+#include <vector.h>
+
+#include <array>
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+#include <utility>
+
+// Scene made in code rather than read from an OBJ file: materials, mesh attributes, triangles,
+// spheres and lights are added one at a time, then Build hands the scene over. Ids returned by
+// the Add functions are what triangles and spheres refer to; attribute index 0 is the zero vector,
+// as in Mesh, and stands for a missing attribute.
+class SceneBuilder {
+public:
+    // Returns the id of the material.
+    uint16_t AddMaterial(Material material) {
+        return scene_.AddMaterial(std::move(material));
+    }
+
+    // Return the index of the attribute in its mesh array.
+    uint32_t AddPosition(const Vector& position) {
+        return Append(&mesh_.positions, position);
+    }
+    uint32_t AddTextureCoord(const Vector& texture_coord) {
+        return Append(&mesh_.texture_coords, texture_coord);
+    }
+    uint32_t AddNormal(const Vector& normal) {
+        return Append(&mesh_.normals, normal);
+    }
+
+    // Triangle over attributes added earlier. Without normals the face normal is used; material
+    // may be kNoMaterial, renders then shade it with a plain default material. Throws
+    // std::out_of_range for unknown indices and materials.
+    void AddTriangle(const std::array<uint32_t, 3>& positions, uint16_t material,
+                     const std::array<uint32_t, 3>& normals = {},
+                     const std::array<uint32_t, 3>& texture_coords = {}) {
+        for (int i = 0; i < 3; ++i) {
+            if (positions[i] == 0 || positions[i] >= mesh_.positions.size() ||
+                normals[i] >= mesh_.normals.size() ||
+                texture_coords[i] >= mesh_.texture_coords.size()) {
+                throw std::out_of_range("triangle refers to an attribute not added");
+            }
+        }
+        CheckMaterial(material);
+        mesh_.triangles.push_back({positions, texture_coords, normals, material});
+    }
+    // Triangle with positions of its own.
+    void AddTriangle(const Vector& a, const Vector& b, const Vector& c, uint16_t material) {
+        AddTriangle({AddPosition(a), AddPosition(b), AddPosition(c)}, material);
+    }
+
+    void AddSphere(const Vector& center, double radius, uint16_t material) {
+        CheckMaterial(material);
+        scene_.AddSphereObject(center[0], center[1], center[2], radius, material);
+    }
+
+    void AddLight(const Vector& position, const Vector& intensity) {
+        scene_.AddLight(position[0], position[1], position[2], intensity[0], intensity[1],
+                        intensity[2]);
+    }
+
+    // The scene, with the intersection records of its triangles. The builder is left empty.
+    Scene Build() {
+        scene_.SetMesh(std::move(mesh_));
+        mesh_ = Mesh();
+        return std::exchange(scene_, Scene());
+    }
+
+private:
+    static uint32_t Append(std::vector<Vector>* attributes, const Vector& value) {
+        if (attributes->size() > UINT32_MAX) {
+            throw std::runtime_error("too many mesh attributes");
+        }
+        attributes->push_back(value);
+        return attributes->size() - 1;
+    }
+
+    void CheckMaterial(uint16_t material) const {
+        if (material != kNoMaterial && material >= scene_.GetMaterials().size()) {
+            throw std::out_of_range("unknown material " + std::to_string(material));
+        }
+    }
+
+    Scene scene_;
+    Mesh mesh_;
+};
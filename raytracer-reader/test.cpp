@@ -2,6 +2,13 @@
 #include <util.h>
 
 #include <scene.h>
+#include <binary_scene.h>
+#include <scene_builder.h>
+
+#include <cstddef>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
 
 bool AllEqual(const std::vector<std::string>& a, const std::vector<std::string>& b) {
     if (a.size() != b.size()) {
@@ -50,19 +57,66 @@ TEST_CASE("Tokenize", "[raytracer]") {
     REQUIRE(AllEqual(result, {"1"}));
 }
 
+TEST_CASE("Face vertices", "[raytracer]") {
+    int vertex, texture, normal;
+    ParseFaceVertex("1/2/3", &vertex, &texture, &normal);
+    REQUIRE((vertex == 1 && texture == 2 && normal == 3));
+
+    ParseFaceVertex("-4//5", &vertex, &texture, &normal);
+    REQUIRE((vertex == -4 && texture == 0 && normal == 5));
+
+    ParseFaceVertex("7/+8", &vertex, &texture, &normal);
+    REQUIRE((vertex == 7 && texture == 8 && normal == 0));
+
+    ParseFaceVertex("9", &vertex, &texture, &normal);
+    REQUIRE((vertex == 9 && texture == 0 && normal == 0));
+
+    REQUIRE_THROWS(ParseFaceVertex("x/1", &vertex, &texture, &normal));
+}
+
+TEST_CASE("Text scanner", "[raytracer]") {
+    TextScanner scanner("v 1 -2.5 3e1\r\n\n  vt\t0.5\nlast");
+    REQUIRE(scanner.NextLine());
+    REQUIRE(scanner.NextToken() == "v");
+    Vector vertex = scanner.NextVector();
+    REQUIRE((vertex[0] == 1 && vertex[1] == -2.5 && vertex[2] == 30));
+    REQUIRE(scanner.NextToken().empty());
+
+    REQUIRE(scanner.NextLine());
+    REQUIRE(scanner.NextToken().empty());
+
+    REQUIRE(scanner.NextLine());
+    REQUIRE(scanner.NextToken() == "vt");
+    REQUIRE(scanner.NextDouble() == 0.5);
+    REQUIRE(scanner.NextDouble(-1) == -1);
+
+    REQUIRE(scanner.NextLine());
+    REQUIRE(scanner.NextToken() == "last");
+    REQUIRE(!scanner.NextLine());
+}
+
+const Material& FindMaterial(const Scene& scene, const std::string& name) {
+    for (const Material& material : scene.GetMaterials()) {
+        if (material.name == name) {
+            return material;
+        }
+    }
+    throw std::out_of_range(name);
+}
+
 TEST_CASE("Scene", "[raytracer]") {
     const auto current_dir = GetFileDir(__FILE__);
     const auto scene = ReadScene(current_dir / "tests/box/cube.obj");
     const auto eps = 1e-6;
 
-    const auto& materials_map = scene.GetMaterials();
-    REQUIRE(materials_map.size() == 9);
+    const auto& materials = scene.GetMaterials();
+    REQUIRE(materials.size() == 9);
 
     // objects
     const auto& objects = scene.GetObjects();
     REQUIRE(objects.size() == 10);
 
-    const auto& vertex_coord_check = objects[0].polygon.GetVertex(0);
+    const auto& vertex_coord_check = objects[0].GetVertex(0);
     REQUIRE(std::fabs(vertex_coord_check[0] - 1.) < eps);
     REQUIRE(std::fabs(vertex_coord_check[1] - 0.) < eps);
     REQUIRE(std::fabs(vertex_coord_check[2] - (-1.04)) < eps);
@@ -73,9 +127,24 @@ TEST_CASE("Scene", "[raytracer]") {
     REQUIRE(std::fabs(normal_check[2] - 0.) < eps);
 
     for (const auto& object : objects) {
-        REQUIRE(materials_map.contains(object.material->name));
+        REQUIRE(object.material == &FindMaterial(scene, object.material->name));
     }
 
+    // shared attributes, each array led by the zero vector
+    const auto& mesh = scene.GetMesh();
+    REQUIRE(mesh.positions.size() == 24 + 1);
+    REQUIRE(mesh.normals.size() == 9 + 1);
+    REQUIRE(mesh.texture_coords.size() == 1);
+    REQUIRE(mesh.triangles.size() == objects.size());
+    REQUIRE(&objects[0].GetVertex(0) == &objects[1].GetVertex(2));
+    REQUIRE(mesh.triangles[0].material < materials.size());
+    REQUIRE(objects[0].material == &materials[mesh.triangles[0].material]);
+
+    const auto& triangles = scene.GetTriangleRecords();
+    REQUIRE(triangles.size() == objects.size());
+    REQUIRE(std::fabs(triangles[0].vertex0[2] - (-1.04)) < eps);
+    REQUIRE(triangles[0].has_vertex_normals);
+
     // spheres
     const auto& spheres = scene.GetSphereObjects();
     REQUIRE(spheres.size() == 2);
@@ -86,7 +155,7 @@ TEST_CASE("Scene", "[raytracer]") {
     REQUIRE(std::fabs(center[2] - (-0.4)) < eps);
     REQUIRE(std::fabs(spheres[0].sphere.GetRadius() - 0.3) < eps);
     for (const auto& sphere : spheres) {
-        REQUIRE(materials_map.find(sphere.material->name) != materials_map.end());
+        REQUIRE(sphere.material < materials.size());
     }
 
     // lights
@@ -99,21 +168,213 @@ TEST_CASE("Scene", "[raytracer]") {
     REQUIRE(std::fabs(lights[1].intensity[2] - 0.5) < eps);
 
     // materials
-    const auto& right_sphere = materials_map.at("rightSphere");
+    const auto& right_sphere = FindMaterial(scene, "rightSphere");
     REQUIRE(std::fabs(right_sphere.albedo[0] - 0.) < eps);
     REQUIRE(std::fabs(right_sphere.albedo[1] - 0.3) < eps);
     REQUIRE(std::fabs(right_sphere.albedo[2] - 0.7) < eps);
     REQUIRE(std::fabs(right_sphere.specular_exponent - 1024) < eps);
     REQUIRE(std::fabs(right_sphere.refraction_index - 1.8) < eps);
 
-    const auto& light = materials_map.at("light");
+    const auto& light = FindMaterial(scene, "light");
     REQUIRE(std::fabs(light.ambient_color[1] - 0.78) < eps);
     REQUIRE(std::fabs(light.diffuse_color[2] - 0.78) < eps);
     REQUIRE(std::fabs(light.specular_color[1] - 0.) < eps);
     REQUIRE(std::fabs(light.intensity[2] - 1.) < eps);
 
-    const auto& wall_behind_diffuse = materials_map.at("wallBehind").diffuse_color;
+    const auto& wall_behind_diffuse = FindMaterial(scene, "wallBehind").diffuse_color;
     REQUIRE(std::fabs(wall_behind_diffuse[0] - 0.2) < eps);
     REQUIRE(std::fabs(wall_behind_diffuse[1] - 0.7) < eps);
     REQUIRE(std::fabs(wall_behind_diffuse[2] - 0.8) < eps);
 }
+
+bool SameVectors(const Vector& lhs, const Vector& rhs) {
+    return lhs[0] == rhs[0] && lhs[1] == rhs[1] && lhs[2] == rhs[2];
+}
+
+bool SameCorners(const Object& lhs, const Object& rhs) {
+    for (int i = 0; i < 3; ++i) {
+        if (!SameVectors(lhs.GetVertex(i), rhs.GetVertex(i)) ||
+            !SameVectors(lhs.GetTextureCoords(i), rhs.GetTextureCoords(i)) ||
+            !SameVectors(*lhs.GetNormal(i), *rhs.GetNormal(i))) {
+            return false;
+        }
+    }
+    return true;
+}
+
+std::string GetMaterialName(const Material* material) {
+    return material == nullptr ? "<none>" : material->name;
+}
+
+void CheckSameScenes(const Scene& lhs, const Scene& rhs) {
+    REQUIRE(lhs.GetMaterials().size() == rhs.GetMaterials().size());
+    REQUIRE(lhs.GetObjects().size() == rhs.GetObjects().size());
+    for (size_t i = 0; i < lhs.GetObjects().size(); ++i) {
+        Object a = lhs.GetObjects()[i];
+        Object b = rhs.GetObjects()[i];
+        REQUIRE(GetMaterialName(a.material) == GetMaterialName(b.material));
+        REQUIRE(SameCorners(a, b));
+        REQUIRE(lhs.GetTriangleRecords()[i].has_vertex_normals ==
+                rhs.GetTriangleRecords()[i].has_vertex_normals);
+    }
+    REQUIRE(lhs.GetSphereObjects().size() == rhs.GetSphereObjects().size());
+    for (size_t i = 0; i < lhs.GetSphereObjects().size(); ++i) {
+        const SphereObject& a = lhs.GetSphereObjects()[i];
+        const SphereObject& b = rhs.GetSphereObjects()[i];
+        REQUIRE(GetMaterialName(lhs.GetMaterial(a.material)) ==
+                GetMaterialName(rhs.GetMaterial(b.material)));
+        REQUIRE(SameVectors(a.sphere.GetCenter(), b.sphere.GetCenter()));
+        REQUIRE(a.sphere.GetRadius() == b.sphere.GetRadius());
+    }
+    REQUIRE(lhs.GetLights().size() == rhs.GetLights().size());
+    for (size_t i = 0; i < lhs.GetLights().size(); ++i) {
+        REQUIRE(SameVectors(lhs.GetLights()[i].position, rhs.GetLights()[i].position));
+        REQUIRE(SameVectors(lhs.GetLights()[i].intensity, rhs.GetLights()[i].intensity));
+    }
+}
+
+TEST_CASE("Chunked scene", "[raytracer]") {
+    const auto current_dir = GetFileDir(__FILE__);
+    const std::string cube = current_dir / "tests/box/cube.obj";
+    const auto serial = ReadScene(cube);
+    for (size_t chunk_size : {1, 50, 300, 1 << 20}) {
+        CheckSameScenes(serial, ReadScene(cube, 3, chunk_size));
+    }
+
+    // relative indices and material state crossing chunk boundaries
+    auto dir = std::filesystem::temp_directory_path() / "raytracer_reader_chunks";
+    std::filesystem::create_directories(dir);
+    std::ofstream(dir / "chunks.mtl") << "newmtl a\nKd 1 0 0\nnewmtl b\nKd 0 1 0\n";
+    {
+        std::ofstream obj(dir / "chunks.obj");
+        obj << "mtllib chunks.mtl\n";
+        for (int i = 0; i < 50; ++i) {
+            obj << "v " << i << " " << i * 0.5 << " 0\nv " << i << " 1 0\nv " << i << " 0 1\n";
+            obj << "vn 0 0 1\nvt 0.5\n";
+            if (i % 7 == 0) {
+                obj << "usemtl " << (i % 2 ? "a" : "b") << "\nS 0 " << i << " 0 0.5\n";
+            }
+            obj << "f -3/-1/-1 -2//-1 -1\n";
+            if (i > 2) {
+                obj << "f " << 3 * i - 4 << " -1/" << i << " " << 2 << "/1/-" << i + 1 << " -7\n";
+            }
+            obj << "P 0 " << i << " 0 1 1 1\n";
+        }
+    }
+    const std::string chunks = dir / "chunks.obj";
+    const auto serial_chunks = ReadScene(chunks);
+    REQUIRE(serial_chunks.GetObjects().size() == 50 + 47 * 2);
+    for (size_t chunk_size : {1, 20, 100, 1000}) {
+        CheckSameScenes(serial_chunks, ReadScene(chunks, 4, chunk_size));
+    }
+
+    // an index past the vertices read so far fails like it does for the serial reader
+    std::ofstream(dir / "forward.obj") << "v 0 0 0\nv 1 0 0\nf 1 2 3\nv 0 1 0\n";
+    REQUIRE_THROWS(ReadScene(dir / "forward.obj"));
+    REQUIRE_THROWS(ReadScene(dir / "forward.obj", 2, 8));
+
+    std::ofstream(dir / "unknown.obj") << "mtllib chunks.mtl\nusemtl c\n";
+    REQUIRE_THROWS_AS(ReadScene(dir / "unknown.obj"), std::out_of_range);
+    REQUIRE_THROWS_AS(ReadScene(dir / "unknown.obj", 2, 8), std::out_of_range);
+
+    std::filesystem::remove_all(dir);
+}
+
+TEST_CASE("Compiled scene", "[raytracer]") {
+    const auto current_dir = GetFileDir(__FILE__);
+    const std::string cube = current_dir / "tests/box/cube.obj";
+    const auto dir = std::filesystem::temp_directory_path() / "raytracer_reader_compiled";
+    std::filesystem::create_directories(dir);
+    const std::string compiled = dir / "cube.rtb";
+
+    const auto scene = ReadScene(cube);
+    WriteBinaryScene(scene, compiled);
+    REQUIRE(IsBinaryScene(compiled));
+    REQUIRE(!IsBinaryScene(cube));
+
+    const auto loaded = LoadScene(compiled);
+    CheckSameScenes(scene, loaded);
+    REQUIRE(loaded.GetMaterials().size() == scene.GetMaterials().size());
+    for (size_t i = 0; i < scene.GetMaterials().size(); ++i) {
+        const Material& a = scene.GetMaterials()[i];
+        const Material& b = loaded.GetMaterials()[i];
+        REQUIRE(a.name == b.name);
+        REQUIRE(SameVectors(a.diffuse_color, b.diffuse_color));
+        REQUIRE(a.albedo == b.albedo);
+        REQUIRE(a.refraction_index == b.refraction_index);
+    }
+    for (size_t i = 0; i < scene.GetTriangleRecords().size(); ++i) {
+        REQUIRE(SameVectors(scene.GetTriangleRecords()[i].normal,
+                            loaded.GetTriangleRecords()[i].normal));
+    }
+    CheckSameScenes(scene, LoadScene(cube));
+    // the same scene always makes the same file
+    REQUIRE(SerializeScene(ReadScene(cube)) == SerializeScene(scene));
+
+    // padding is written as zeros whatever the memory held
+    SphereObject sphere{1, Sphere({1, 2, 3}, 4)};
+    std::vector<SphereObject> spheres(2, sphere);
+    std::memset(static_cast<void*>(spheres.data()), 0xab, spheres.size() * sizeof(SphereObject));
+    for (SphereObject& object : spheres) {
+        object = sphere;
+    }
+    SectionWriter writer(sizeof(uint64_t));
+    FileSection section = writer.AppendFields(spheres.data(), spheres.size(),
+                                              &SphereObject::material, &SphereObject::sphere);
+    std::string data = writer.Finish(uint64_t{0});
+    for (size_t i = 0; i < spheres.size(); ++i) {
+        const char* bytes = data.data() + section.offset + i * sizeof(SphereObject);
+        for (size_t k = sizeof(uint16_t); k < offsetof(SphereObject, sphere); ++k) {
+            REQUIRE(bytes[k] == 0);
+        }
+        REQUIRE(std::memcmp(bytes + offsetof(SphereObject, sphere), &spheres[i].sphere,
+                            sizeof(Sphere)) == 0);
+    }
+
+    // a truncated file is rejected rather than read past its end
+    std::filesystem::resize_file(compiled, std::filesystem::file_size(compiled) - 64);
+    REQUIRE_THROWS_AS(ReadBinaryScene(compiled), std::runtime_error);
+
+    std::filesystem::remove_all(dir);
+}
+
+TEST_CASE("Scene builder", "[raytracer]") {
+    SceneBuilder builder;
+    Material red;
+    red.name = "red";
+    red.diffuse_color = {1, 0, 0};
+    uint16_t material = builder.AddMaterial(red);
+    REQUIRE(material == 0);
+
+    uint32_t a = builder.AddPosition({0, 0, 0});
+    uint32_t b = builder.AddPosition({1, 0, 0});
+    uint32_t c = builder.AddPosition({0, 1, 0});
+    uint32_t normal = builder.AddNormal({0, 0, 1});
+    REQUIRE(a == 1);
+    REQUIRE(normal == 1);
+    builder.AddTriangle({a, b, c}, material, {normal, normal, normal});
+    builder.AddTriangle({0, 0, 1}, {1, 0, 1}, {0, 1, 1}, kNoMaterial);
+    builder.AddSphere({0, 0, -2}, 0.5, material);
+    builder.AddLight({0, 5, 0}, {1, 1, 1});
+
+    REQUIRE_THROWS_AS(builder.AddTriangle({a, b, 99}, material), std::out_of_range);
+    REQUIRE_THROWS_AS(builder.AddTriangle({a, b, c}, material, {normal, 2, normal}),
+                      std::out_of_range);
+    REQUIRE_THROWS_AS(builder.AddTriangle({a, b, c}, 1), std::out_of_range);
+    REQUIRE_THROWS_AS(builder.AddSphere({0, 0, 0}, 1, 7), std::out_of_range);
+
+    Scene scene = builder.Build();
+    REQUIRE(scene.GetMaterials().size() == 1);
+    REQUIRE(scene.GetObjects().size() == 2);
+    REQUIRE(scene.GetTriangleRecords().size() == 2);
+    REQUIRE(scene.GetSphereObjects().size() == 1);
+    REQUIRE(scene.GetLights().size() == 1);
+    REQUIRE(scene.GetMesh().positions.size() == 1 + 6);
+    REQUIRE(scene.GetObjects()[0].material->name == "red");
+    REQUIRE(scene.GetObjects()[1].material == nullptr);
+    REQUIRE((*scene.GetObjects()[0].GetNormal(2))[2] == 1);
+    REQUIRE(scene.GetObjects()[1].GetVertex(2)[1] == 1);
+
+    // the builder starts over
+    REQUIRE(builder.Build().GetObjects().size() == 0);
+}
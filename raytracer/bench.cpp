@@ -0,0 +1,670 @@
+#include <catch.hpp>
+#include <util.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <numbers>
+#include <numeric>
+#include <string>
+#include <thread>
+
+#include <sys/resource.h>
+
+#include <camera_options.h>
+#include <render_options.h>
+#include <commons.hpp>
+#include <raytracer.h>
+
+const auto kTestsDir = GetFileDir(__FILE__) / "tests";
+
+template <class Function>
+double MeasureSeconds(Function&& function) {
+    auto start = std::chrono::steady_clock::now();
+    function();
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+std::vector<Ray> GetPrimaryRays(const CameraOptions& camera_options) {
+    auto directions = ComputeRayDirections(camera_options);
+    std::vector<Ray> rays;
+    for (const auto& column : directions) {
+        for (const auto& direction : column) {
+            rays.emplace_back(Vector(camera_options.look_from), direction);
+        }
+    }
+    return rays;
+}
+
+// Primary rays grouped by squares of kPacketSide x kPacketSide pixels.
+std::vector<std::vector<Ray>> GetPrimaryPackets(const CameraOptions& camera_options) {
+    auto directions = ComputeRayDirections(camera_options);
+    std::vector<std::vector<Ray>> packets;
+    for (int x = 0; x < camera_options.screen_width; x += kPacketSide) {
+        for (int y = 0; y < camera_options.screen_height; y += kPacketSide) {
+            auto& rays = packets.emplace_back();
+            for (int i = x; i < std::min(x + kPacketSide, camera_options.screen_width); ++i) {
+                for (int j = y; j < std::min(y + kPacketSide, camera_options.screen_height); ++j) {
+                    rays.emplace_back(Vector(camera_options.look_from), directions[i][j]);
+                }
+            }
+        }
+    }
+    return packets;
+}
+
+void Report(const std::string& name, size_t rays, double seconds, double baseline_seconds) {
+    std::cout << "  " << name << ": " << rays / seconds / 1e6 << " Mrays/s, x"
+              << baseline_seconds / seconds << "\n";
+}
+
+void BenchmarkKernels(const std::string& obj_filename, const CameraOptions& camera_options) {
+    constexpr int kRepeats = 4;
+    PreparedScene prepared = PrepareScene(ReadScene(kTestsDir / obj_filename));
+    const Scene& scene = prepared.scene;
+    auto rays = GetPrimaryRays(camera_options);
+
+    std::vector<TriangleBlock> triangle_blocks;
+    for (uint32_t i = 0; i < scene.GetTriangleRecords().size(); ++i) {
+        if (i % kBlockWidth == 0) {
+            triangle_blocks.emplace_back();
+        }
+        triangle_blocks.back().Add(scene.GetTriangleRecords()[i],
+                                   i + scene.GetSphereObjects().size());
+    }
+    std::vector<SphereBlock> sphere_blocks;
+    for (uint32_t i = 0; i < scene.GetSphereObjects().size(); ++i) {
+        if (i % kBlockWidth == 0) {
+            sphere_blocks.emplace_back();
+        }
+        sphere_blocks.back().Add(scene.GetSphereObjects()[i].sphere, i);
+    }
+
+    size_t primitives = scene.GetSphereObjects().size() + scene.GetTriangleRecords().size();
+    std::vector<size_t> hits(5);
+    double scalar_scan = MeasureSeconds([&] {
+        for (int repeat = 0; repeat < kRepeats; ++repeat) {
+            for (const Ray& ray : rays) {
+                Scalar distance = std::numeric_limits<Scalar>::infinity();
+                for (uint32_t primitive = 0; primitive < primitives; ++primitive) {
+                    if (auto hit = FindHit(ray, scene, primitive)) {
+                        distance = std::min(distance, hit->distance);
+                    }
+                }
+                hits[0] += distance < std::numeric_limits<Scalar>::infinity();
+            }
+        }
+    });
+    double block_scan = MeasureSeconds([&] {
+        for (int repeat = 0; repeat < kRepeats; ++repeat) {
+            for (const Ray& ray : rays) {
+                BlockHit hit;
+                for (const auto& block : sphere_blocks) {
+                    IntersectBlock(ray, block, &hit);
+                }
+                for (const auto& block : triangle_blocks) {
+                    IntersectBlock(ray, block, &hit);
+                }
+                hits[1] += hit.primitive != kNoPrimitive;
+            }
+        }
+    });
+    double scalar_bvh = MeasureSeconds([&] {
+        for (int repeat = 0; repeat < kRepeats; ++repeat) {
+            for (const Ray& ray : rays) {
+                hits[2] += FindClosestHit(scene, prepared.bvh, ray).has_value();
+            }
+        }
+    });
+    double block_bvh = MeasureSeconds([&] {
+        for (int repeat = 0; repeat < kRepeats; ++repeat) {
+            for (const Ray& ray : rays) {
+                hits[3] += FindClosestHit(prepared, ray).has_value();
+            }
+        }
+    });
+    auto packets = GetPrimaryPackets(camera_options);
+    RayPacket packet;
+    PacketHits packet_hits;
+    double packet_bvh = MeasureSeconds([&] {
+        for (int repeat = 0; repeat < kRepeats; ++repeat) {
+            for (const auto& packet_rays : packets) {
+                packet.Clear();
+                for (const Ray& ray : packet_rays) {
+                    packet.Add(ray);
+                }
+                FindClosestHits(prepared, &packet, &packet_hits);
+                for (size_t i = 0; i < packet.Size(); ++i) {
+                    hits[4] += packet_hits[i].has_value();
+                }
+            }
+        }
+    });
+
+    // packets find exactly the hits of single rays
+    for (const auto& packet_rays : packets) {
+        packet.Clear();
+        for (const Ray& ray : packet_rays) {
+            packet.Add(ray);
+        }
+        FindClosestHits(prepared, &packet, &packet_hits);
+        for (size_t i = 0; i < packet.Size(); ++i) {
+            auto hit = FindClosestHit(prepared, packet_rays[i]);
+            REQUIRE(hit.has_value() == packet_hits[i].has_value());
+            if (hit) {
+                REQUIRE(hit->primitive == packet_hits[i]->primitive);
+                REQUIRE(hit->record.distance == packet_hits[i]->record.distance);
+            }
+        }
+    }
+
+    size_t total = rays.size() * kRepeats;
+    std::cout << obj_filename << " (" << primitives << " primitives, block width " << kBlockWidth
+              << ")\n";
+    Report("scalar scan", total, scalar_scan, scalar_scan);
+    Report("block scan", total, block_scan, scalar_scan);
+    Report("scalar bvh", total, scalar_bvh, scalar_scan);
+    Report("block bvh", total, block_bvh, scalar_scan);
+    Report("packet bvh", total, packet_bvh, scalar_scan);
+    for (size_t count : hits) {
+        REQUIRE(count == hits[0]);
+    }
+}
+
+TEST_CASE("Closest hit kernels", "[benchmark]") {
+    CameraOptions camera_opts(500, 500);
+    camera_opts.look_from = {-0.5, 1.5, 1.98};
+    camera_opts.look_to = {0.0, 1.0, 0.0};
+    BenchmarkKernels("distorted_box/CornellBox-Original.obj", camera_opts);
+
+    camera_opts.look_from = {-0.5, 1.5, 0.98};
+    BenchmarkKernels("classic_box/CornellBox-Original.obj", camera_opts);
+}
+
+// Writes a height field of 2 * size * size triangles with normals and texture coordinates, laid
+// out like exported meshes are.
+void WriteGridObj(const std::filesystem::path& path, int size) {
+    std::ofstream mtl(path.parent_path() / "grid.mtl");
+    mtl << "newmtl grid\nKd 0.5 0.5 0.5\n";
+    std::ofstream obj(path);
+    obj << "mtllib grid.mtl\nusemtl grid\n";
+    for (int i = 0; i <= size; ++i) {
+        for (int j = 0; j <= size; ++j) {
+            obj << "v " << i * 0.01 << " " << 0.001 * ((i * 7 + j * 13) % 97) << " " << j * 0.01
+                << "\nvn 0 1 0\nvt " << i / double(size) << " " << j / double(size) << "\n";
+        }
+    }
+    for (int i = 0; i < size; ++i) {
+        for (int j = 0; j < size; ++j) {
+            int a = i * (size + 1) + j + 1;
+            int b = a + size + 1;
+            obj << "f " << a << "/" << a << "/" << a << " " << b << "/" << b << "/" << b << " "
+                << b + 1 << "/" << b + 1 << "/" << b + 1 << " " << a + 1 << "/" << a + 1 << "/"
+                << a + 1 << "\n";
+        }
+    }
+}
+
+TEST_CASE("OBJ parsing", "[benchmark]") {
+    constexpr int kGridSize = 500;
+    auto dir = std::filesystem::temp_directory_path() / "raytracer_bench_obj";
+    std::filesystem::create_directories(dir);
+    auto path = dir / "grid.obj";
+    WriteGridObj(path, kGridSize);
+
+    Scene scene;
+    double seconds = MeasureSeconds([&] { scene = ReadScene(path); });
+    double megabytes = std::filesystem::file_size(path) / 1e6;
+    std::cout << "OBJ parsing: " << scene.GetObjects().size() << " triangles, " << megabytes
+              << " MB in " << seconds << " s, " << megabytes / seconds << " MB/s\n";
+    REQUIRE(scene.GetObjects().size() == 2 * kGridSize * kGridSize);
+
+    const Mesh& mesh = scene.GetMesh();
+    size_t triangles = mesh.triangles.size();
+    size_t mesh_bytes = (mesh.positions.size() + mesh.texture_coords.size() + mesh.normals.size()) *
+                            sizeof(Vector) +
+                        triangles * (sizeof(MeshTriangle) + sizeof(TriangleRecord));
+    // a Material pointer and nine vectors per triangle, as objects were stored before
+    size_t flat_bytes =
+        triangles * (sizeof(Material*) + 9 * sizeof(Vector) + sizeof(TriangleRecord));
+    std::cout << "  memory per triangle: " << double(mesh_bytes) / triangles << " bytes indexed, "
+              << double(flat_bytes) / triangles << " bytes flat\n";
+
+    unsigned threads = std::max(1u, std::thread::hardware_concurrency());
+    double chunked_seconds = MeasureSeconds([&] { scene = ReadScene(path, threads); });
+    std::cout << "  chunked on " << threads << " threads: " << chunked_seconds << " s, "
+              << megabytes / chunked_seconds << " MB/s, x" << seconds / chunked_seconds << "\n";
+    REQUIRE(scene.GetObjects().size() == 2 * kGridSize * kGridSize);
+
+    auto compiled = dir / "grid.rtb";
+    WriteBinaryScene(scene, compiled);
+    double compiled_seconds = MeasureSeconds([&] { scene = LoadScene(compiled); });
+    std::cout << "  compiled scene: " << std::filesystem::file_size(compiled) / 1e6 << " MB in "
+              << compiled_seconds << " s, x" << seconds / compiled_seconds << "\n";
+    REQUIRE(scene.GetObjects().size() == 2 * kGridSize * kGridSize);
+
+    std::filesystem::remove_all(dir);
+}
+
+// Rays traced per depth of the ray tree and render time as branches of small weight are cut,
+// with the number of pixels that differ from the image that traces every branch.
+void BenchmarkRayTree(const std::string& obj_filename, const CameraOptions& camera_options,
+                      int depth) {
+    std::cout << obj_filename << " (depth " << depth << ", rays per depth)\n";
+    RenderOptions render_options{depth};
+    render_options.min_throughput = -1;
+    Image baseline = Render(kTestsDir / obj_filename, camera_options, render_options);
+    double baseline_seconds = 0;
+    for (double min_throughput : {-1., 0., 1e-2, 5e-2}) {
+        render_options.min_throughput = min_throughput;
+        RenderStats stats;
+        auto start = std::chrono::steady_clock::now();
+        Image image = Render(kTestsDir / obj_filename, camera_options, render_options, &stats);
+        double seconds =
+            std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        if (min_throughput < 0) {
+            baseline_seconds = seconds;
+        }
+
+        uint64_t rays = 0;
+        std::cout << "  min throughput " << min_throughput << ":";
+        for (uint64_t count : stats.rays_per_depth) {
+            std::cout << " " << count;
+            rays += count;
+        }
+        int mismatches = 0;
+        for (int y = 0; y < image.Height(); ++y) {
+            for (int x = 0; x < image.Width(); ++x) {
+                mismatches += !(image.GetPixel(y, x) == baseline.GetPixel(y, x));
+            }
+        }
+        std::cout << ", " << rays << " rays in " << seconds << " s, x"
+                  << baseline_seconds / seconds << ", " << mismatches << " pixels changed\n";
+    }
+}
+
+TEST_CASE("Ray tree", "[benchmark]") {
+    CameraOptions mirrors(800, 600);
+    mirrors.look_from = {2, 1.5, -0.1};
+    mirrors.look_to = {1, 1.2, -2.8};
+    BenchmarkRayTree("mirrors/scene.obj", mirrors, 9);
+
+    CameraOptions box(640, 480, std::numbers::pi / 3);
+    box.look_from = {0.0, 0.7, 1.75};
+    box.look_to = {0.0, 0.7, 0.0};
+    BenchmarkRayTree("box/cube.obj", box, 8);
+}
+
+// Depth-first and wavefront tracing of the same image, which must not differ.
+void BenchmarkWavefront(const std::string& obj_filename, const CameraOptions& camera_options,
+                        RenderOptions render_options) {
+    auto start = std::chrono::steady_clock::now();
+    Image expected = Render(kTestsDir / obj_filename, camera_options, render_options);
+    double depth_first =
+        std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    render_options.wavefront = true;
+    start = std::chrono::steady_clock::now();
+    Image image = Render(kTestsDir / obj_filename, camera_options, render_options);
+    double wavefront =
+        std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    std::cout << obj_filename << " (depth " << render_options.depth << ", min throughput "
+              << render_options.min_throughput << "): depth first " << depth_first
+              << " s, wavefront " << wavefront << " s, x" << depth_first / wavefront << "\n";
+    for (int y = 0; y < image.Height(); ++y) {
+        for (int x = 0; x < image.Width(); ++x) {
+            REQUIRE(image.GetPixel(y, x) == expected.GetPixel(y, x));
+        }
+    }
+}
+
+// The mirrors scene with a bumpy mirror of 2 * size * size triangles across the room, whose
+// reflections scatter the rays.
+void WriteBumpyMirrorsObj(const std::filesystem::path& path, int size) {
+    std::filesystem::copy_file(kTestsDir / "mirrors/materials.mtl",
+                               path.parent_path() / "materials.mtl",
+                               std::filesystem::copy_options::overwrite_existing);
+    std::ofstream obj(path);
+    obj << std::ifstream(kTestsDir / "mirrors/scene.obj").rdbuf() << "\nusemtl left\n";
+    for (int i = 0; i <= size; ++i) {
+        for (int j = 0; j <= size; ++j) {
+            double x = 0.05 + 2.9 * i / size;
+            double z = -0.05 - 2.9 * j / size;
+            obj << "v " << x << " " << 0.3 + 0.05 * std::sin(40 * x) * std::cos(40 * z) << " "
+                << z << "\n";
+        }
+    }
+    for (int i = 0; i < size; ++i) {
+        for (int j = 0; j < size; ++j) {
+            int a = -(size + 1) * (size + 1) + i * (size + 1) + j;
+            int b = a + size + 1;
+            obj << "f " << a << " " << b << " " << b + 1 << "\nf " << a << " " << b + 1 << " "
+                << a + 1 << "\n";
+        }
+    }
+}
+
+TEST_CASE("Wavefront", "[benchmark]") {
+    CameraOptions mirrors(800, 600);
+    mirrors.look_from = {2, 1.5, -0.1};
+    mirrors.look_to = {1, 1.2, -2.8};
+    RenderOptions render_options{9};
+    BenchmarkWavefront("mirrors/scene.obj", mirrors, render_options);
+    render_options.min_throughput = -1;
+    BenchmarkWavefront("mirrors/scene.obj", mirrors, render_options);
+
+    CameraOptions box(640, 480, std::numbers::pi / 3);
+    box.look_from = {0.0, 0.7, 1.75};
+    box.look_to = {0.0, 0.7, 0.0};
+    BenchmarkWavefront("box/cube.obj", box, RenderOptions{8});
+
+    auto dir = std::filesystem::temp_directory_path() / "raytracer_bench_wavefront";
+    std::filesystem::create_directories(dir);
+    WriteBumpyMirrorsObj(dir / "scene.obj", 300);
+    CameraOptions bumpy(160, 120);
+    bumpy.look_from = {2, 1.5, -0.1};
+    bumpy.look_to = {1, 1.2, -2.8};
+    BenchmarkWavefront(dir / "scene.obj", bumpy, RenderOptions{9});
+    std::filesystem::remove_all(dir);
+}
+
+// The classic box lit by its three lights and count dim ones spread through the room.
+void WriteManyLightsObj(const std::filesystem::path& path, int count) {
+    std::filesystem::copy_file(kTestsDir / "classic_box/CornellBox-Original.mtl",
+                               path.parent_path() / "CornellBox-Original.mtl",
+                               std::filesystem::copy_options::overwrite_existing);
+    std::ofstream obj(path);
+    obj << std::ifstream(kTestsDir / "classic_box/CornellBox-Original.obj").rdbuf() << "\n";
+    RandomGenerator rnd;
+    auto coords = rnd.GenRealVector(3 * count, -0.95, 0.95);
+    for (int i = 0; i < count; ++i) {
+        obj << "P " << coords[3 * i] << " " << 1 + coords[3 * i + 1] << " " << coords[3 * i + 2]
+            << " 0.00005 0.00005 0.00005\n";
+    }
+}
+
+TEST_CASE("Light tree", "[benchmark]") {
+    auto dir = std::filesystem::temp_directory_path() / "raytracer_bench_lights";
+    std::filesystem::create_directories(dir);
+    WriteManyLightsObj(dir / "scene.obj", 1000);
+    CameraOptions camera_options(160, 160);
+    camera_options.look_from = {-0.5, 1.5, 0.98};
+    camera_options.look_to = {0.0, 1.0, 0.0};
+    RenderOptions render_options{4};
+
+    render_options.light_tolerance = -1;
+    auto start = std::chrono::steady_clock::now();
+    Image all = Render(dir / "scene.obj", camera_options, render_options);
+    double all_seconds =
+        std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    std::cout << "1003 lights, every light: " << all_seconds << " s\n";
+    for (double tolerance : {0., 1e-5, 1e-4}) {
+        render_options.light_tolerance = tolerance;
+        start = std::chrono::steady_clock::now();
+        Image image = Render(dir / "scene.obj", camera_options, render_options);
+        double seconds =
+            std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        double distance = 0;
+        for (int y = 0; y < image.Height(); ++y) {
+            for (int x = 0; x < image.Width(); ++x) {
+                distance =
+                    std::max(distance, PixelDistance(image.GetPixel(y, x), all.GetPixel(y, x)));
+            }
+        }
+        std::cout << "  tolerance " << tolerance << ": " << seconds << " s, x"
+                  << all_seconds / seconds << ", largest pixel difference " << distance << "\n";
+        if (tolerance == 0) {
+            REQUIRE(distance == 0);
+        }
+    }
+    std::filesystem::remove_all(dir);
+}
+
+TEST_CASE("Light sampling", "[benchmark]") {
+    auto dir = std::filesystem::temp_directory_path() / "raytracer_bench_light_samples";
+    std::filesystem::create_directories(dir);
+    WriteManyLightsObj(dir / "scene.obj", 1000);
+    CameraOptions camera_options(160, 160);
+    camera_options.look_from = {-0.5, 1.5, 0.98};
+    camera_options.look_to = {0.0, 1.0, 0.0};
+    RenderOptions render_options{4};
+
+    auto start = std::chrono::steady_clock::now();
+    Image exact = Render(dir / "scene.obj", camera_options, render_options);
+    double exact_seconds =
+        std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    std::cout << "1003 lights, every light: " << exact_seconds << " s\n";
+    for (int samples : {1, 4, 16, 64}) {
+        render_options.light_samples = samples;
+        start = std::chrono::steady_clock::now();
+        Image image = Render(dir / "scene.obj", camera_options, render_options);
+        double seconds =
+            std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        double distance = 0;
+        for (int y = 0; y < image.Height(); ++y) {
+            for (int x = 0; x < image.Width(); ++x) {
+                distance += PixelDistance(image.GetPixel(y, x), exact.GetPixel(y, x));
+            }
+        }
+        std::cout << "  " << samples << " lights per point: " << seconds << " s, x"
+                  << exact_seconds / seconds << ", mean pixel difference "
+                  << distance / (image.Width() * image.Height()) << "\n";
+    }
+    std::filesystem::remove_all(dir);
+}
+
+TEST_CASE("Progressive", "[benchmark]") {
+    auto dir = std::filesystem::temp_directory_path() / "raytracer_bench_progressive";
+    std::filesystem::create_directories(dir);
+    WriteManyLightsObj(dir / "scene.obj", 1000);
+    CameraOptions camera_options(320, 320);
+    camera_options.look_from = {-0.5, 1.5, 0.98};
+    camera_options.look_to = {0.0, 1.0, 0.0};
+    RenderOptions render_options{4};
+    render_options.light_samples = 16;
+
+    double seconds =
+        MeasureSeconds([&] { Render(dir / "scene.obj", camera_options, render_options); });
+    std::cout << "1003 lights, 16 per point, 320x320: render " << seconds << " s\n";
+    auto start = std::chrono::steady_clock::now();
+    RenderProgressive(dir / "scene.obj", camera_options, render_options,
+                      [&](const Image&, int pass) {
+                          std::cout << "  frame " << pass << " after "
+                                    << std::chrono::duration<double>(
+                                           std::chrono::steady_clock::now() - start)
+                                           .count()
+                                    << " s\n";
+                          return true;
+                      });
+    std::filesystem::remove_all(dir);
+}
+
+TEST_CASE("Adaptive anti-aliasing", "[benchmark]") {
+    CameraOptions camera_options(320, 320);
+    camera_options.look_from = {-0.5, 1.5, 0.98};
+    camera_options.look_to = {0.0, 1.0, 0.0};
+    RenderOptions render_options{4};
+    auto filename = kTestsDir / "classic_box/CornellBox-Original.obj";
+
+    for (auto [max_samples, threshold] : {std::pair{1, 0.05}, {16, 0.05}, {16, -1.}}) {
+        render_options.max_samples = max_samples;
+        render_options.antialiasing_threshold = threshold;
+        RenderStats stats;
+        double seconds =
+            MeasureSeconds([&] { Render(filename, camera_options, render_options, &stats); });
+        uint64_t samples = 0;
+        for (const auto& column : stats.samples_per_pixel) {
+            samples += std::accumulate(column.begin(), column.end(), uint64_t{0});
+        }
+        std::cout << "classic box 320x320, up to " << max_samples << " samples, threshold "
+                  << threshold << ": " << seconds << " s, "
+                  << static_cast<double>(samples) / (320 * 320) << " samples per pixel\n";
+    }
+}
+
+TEST_CASE("Scene registry", "[benchmark]") {
+    auto dir = std::filesystem::temp_directory_path() / "raytracer_bench_registry";
+    std::filesystem::create_directories(dir);
+    auto path = dir / "grid.obj";
+    WriteGridObj(path, 300);
+    CameraOptions camera_options(64, 64);
+    camera_options.look_from = {1.5, 2.0, 1.5};
+    camera_options.look_to = {1.5, 0.0, 1.6};
+    RenderOptions render_options{1, RenderMode::kDepth};
+
+    for (bool reuse_scenes : {false, true}) {
+        render_options.reuse_scenes = reuse_scenes;
+        double first = MeasureSeconds([&] { Render(path, camera_options, render_options); });
+        double again = MeasureSeconds([&] {
+            for (int i = 0; i < 10; ++i) {
+                Render(path, camera_options, render_options);
+            }
+        });
+        std::cout << "180000 triangles, 64x64 depth, "
+                  << (reuse_scenes ? "registry" : "no registry") << ": first render " << first
+                  << " s, next ones " << again / 10 << " s\n";
+    }
+    std::cout << "  registry holds " << GetSceneRegistry().GetMemoryUsage() / 1e6 << " MB\n";
+    std::filesystem::remove_all(dir);
+}
+
+TEST_CASE("Batch", "[benchmark]") {
+    auto dir = std::filesystem::temp_directory_path() / "raytracer_bench_batch";
+    auto filename = kTestsDir / "classic_box/CornellBox-Original.obj";
+    // turntable around the box
+    std::vector<RenderJob> jobs;
+    for (int k = 0; k < 12; ++k) {
+        double angle = 2 * std::numbers::pi * k / 12;
+        CameraOptions camera_options(256, 256);
+        camera_options.look_from = {2.5 * std::sin(angle), 1.0, 2.5 * std::cos(angle)};
+        camera_options.look_to = {0.0, 1.0, 0.0};
+        jobs.push_back({camera_options, RenderOptions{4}});
+    }
+
+    double separate = MeasureSeconds([&] {
+        std::filesystem::create_directories(dir);
+        for (size_t k = 0; k < jobs.size(); ++k) {
+            Image image = Render(filename, jobs[k].camera_options, jobs[k].render_options);
+            image.Write(dir / ("separate_" + std::to_string(k) + ".png"));
+        }
+    });
+    double batch = MeasureSeconds([&] { RenderBatchToDirectory(filename, jobs, dir); });
+    std::cout << "12 cameras 256x256 to PNG: one Render each " << separate << " s, batch "
+              << batch << " s\n";
+    std::filesystem::remove_all(dir);
+}
+
+// The grid of WriteGridObj, built in code.
+Scene BuildGridScene(int size) {
+    SceneBuilder builder;
+    Material grid;
+    grid.name = "grid";
+    grid.diffuse_color = {0.5, 0.5, 0.5};
+    uint16_t material = builder.AddMaterial(grid);
+    for (int i = 0; i <= size; ++i) {
+        for (int j = 0; j <= size; ++j) {
+            builder.AddPosition({i * 0.01, 0.001 * ((i * 7 + j * 13) % 97), j * 0.01});
+            builder.AddNormal({0, 1, 0});
+            builder.AddTextureCoord({i / double(size), j / double(size), 0});
+        }
+    }
+    for (int i = 0; i < size; ++i) {
+        for (int j = 0; j < size; ++j) {
+            uint32_t a = i * (size + 1) + j + 1;
+            uint32_t b = a + size + 1;
+            builder.AddTriangle({a, b, b + 1}, material, {a, b, b + 1}, {a, b, b + 1});
+            builder.AddTriangle({a, b + 1, a + 1}, material, {a, b + 1, a + 1}, {a, b + 1, a + 1});
+        }
+    }
+    return builder.Build();
+}
+
+TEST_CASE("Scene built in code", "[benchmark]") {
+    constexpr int kScenes = 20;
+    auto dir = std::filesystem::temp_directory_path() / "raytracer_bench_builder";
+    std::filesystem::create_directories(dir);
+    CameraOptions camera_options(64, 64);
+    camera_options.look_from = {0.5, 1.0, 0.5};
+    camera_options.look_to = {0.5, 0.0, 0.6};
+    RenderOptions render_options{1, RenderMode::kDepth};
+    render_options.reuse_scenes = false;
+
+    double through_files = MeasureSeconds([&] {
+        for (int k = 0; k < kScenes; ++k) {
+            WriteGridObj(dir / "grid.obj", 100);
+            Render(dir / "grid.obj", camera_options, render_options);
+        }
+    });
+    double in_memory = MeasureSeconds([&] {
+        for (int k = 0; k < kScenes; ++k) {
+            Render(Prepare(BuildGridScene(100)), camera_options, render_options);
+        }
+    });
+    std::cout << kScenes << " generated 20000-triangle scenes, 64x64 depth: through OBJ files "
+              << through_files << " s, built in code " << in_memory << " s\n";
+    std::filesystem::remove_all(dir);
+}
+
+TEST_CASE("Render outputs", "[benchmark]") {
+    auto dir = std::filesystem::temp_directory_path() / "raytracer_bench_outputs";
+    std::filesystem::create_directories(dir);
+    WriteGridObj(dir / "grid.obj", 300);
+    CameraOptions camera_options(320, 320);
+    camera_options.look_from = {1.5, 1.0, 1.5};
+    camera_options.look_to = {1.5, 0.0, 1.6};
+    RenderOptions render_options{2};
+    Render(dir / "grid.obj", camera_options, render_options);
+
+    double separate = MeasureSeconds([&] {
+        for (auto mode : {RenderMode::kDepth, RenderMode::kNormal, RenderMode::kFull}) {
+            render_options.mode = mode;
+            Render(dir / "grid.obj", camera_options, render_options);
+        }
+    });
+    render_options.outputs = kOutputColor | kOutputDepth | kOutputNormal;
+    double together =
+        MeasureSeconds([&] { RenderOutputs(dir / "grid.obj", camera_options, render_options); });
+    render_options.outputs = kOutputDepth | kOutputNormal | kOutputAlbedo | kOutputPrimitive;
+    double primary =
+        MeasureSeconds([&] { RenderOutputs(dir / "grid.obj", camera_options, render_options); });
+    std::cout << "180000-triangle grid 320x320, depth 2: depth, normal and full renders "
+              << separate << " s, one pass " << together << " s; buffers without color "
+              << primary << " s\n";
+    std::filesystem::remove_all(dir);
+}
+
+// peak resident memory of the process so far
+double GetPeakMegabytes() {
+    rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss / 1024.0;
+}
+
+TEST_CASE("Streaming to png", "[benchmark]") {
+    auto dir = std::filesystem::temp_directory_path() / "raytracer_bench_stream";
+    std::filesystem::create_directories(dir);
+    WriteGridObj(dir / "grid.obj", 100);
+    CameraOptions camera_options(2000, 2000);
+    camera_options.look_from = {0.5, 1.0, 0.5};
+    camera_options.look_to = {0.5, 0.0, 0.6};
+    RenderOptions render_options{1};
+    render_options.white_radiance = 1;
+    auto prepared = GetPreparedScene(dir / "grid.obj", render_options);
+
+    // streaming first, the peak it leaves is then its own
+    double before = GetPeakMegabytes();
+    double streamed = MeasureSeconds(
+        [&] { RenderToPng(prepared, camera_options, render_options, dir / "streamed.png"); });
+    double streamed_peak = GetPeakMegabytes();
+    double full = MeasureSeconds([&] {
+        Render(prepared, camera_options, render_options).Write(dir / "full.png");
+    });
+    double full_peak = GetPeakMegabytes();
+    std::cout << "20000-triangle grid 2000x2000, depth 1 to png: streamed in bands of "
+              << render_options.band_height << " rows " << streamed << " s, peak "
+              << streamed_peak - before << " MB more; full frame " << full << " s, peak "
+              << full_peak - before << " MB more\n";
+    std::filesystem::remove_all(dir);
+}
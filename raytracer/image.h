@@ -3,6 +3,7 @@
 #include <png.h>
 #include <jpeglib.h>
 #include <iostream>
+#include <utility>
 
 struct RGB {
     int r, g, b;
@@ -17,6 +18,22 @@ public:
         PrepareImage(width, height);
     }
 
+    // the rows are owned, images are moved rather than copied
+    Image(const Image&) = delete;
+    Image& operator=(const Image&) = delete;
+
+    Image(Image&& other) noexcept
+        : width_(other.width_), height_(other.height_), bytes_(other.bytes_) {
+        other.width_ = other.height_ = 0;
+        other.bytes_ = nullptr;
+    }
+    Image& operator=(Image&& other) noexcept {
+        std::swap(width_, other.width_);
+        std::swap(height_, other.height_);
+        std::swap(bytes_, other.bytes_);
+        return *this;
+    }
+
     void PrepareImage(int width, int height) {
         height_ = height;
         width_ = width;
@@ -0,0 +1,226 @@
+#pragma once
+
+#include <light.h>
+#include <bvh.h>
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <optional>
+#include <span>
+#include <vector>
+
+// Light picked at random and the probability it had.
+struct LightSample {
+    uint32_t light;
+    double probability;
+};
+
+// Bounding volume hierarchy over the point lights of a scene. Every node also knows the largest
+// and the total absolute intensity of its lights in each channel, so a shading point can tell
+// that a whole group of lights is too dim or badly placed to matter and skip it without looking at
+// its lights, or estimate how much the group matters next to others.
+class LightTree {
+public:
+    LightTree() {
+    }
+
+    explicit LightTree(const std::vector<Light>& lights) {
+        std::vector<BoundingBox> boxes;
+        boxes.reserve(lights.size());
+        for (const Light& light : lights) {
+            boxes.emplace_back(light.position, light.position);
+        }
+        bvh_ = Bvh(boxes, kLeafLights);
+
+        const auto& nodes = bvh_.GetNodes();
+        max_intensities_.resize(nodes.size());
+        total_intensities_.resize(nodes.size());
+        // children always follow their parent, so they are done before it
+        for (size_t node_index = nodes.size(); node_index-- > 0;) {
+            const BvhNode& node = nodes[node_index];
+            Vector& max_intensity = max_intensities_[node_index];
+            Vector& total_intensity = total_intensities_[node_index];
+            max_intensity = total_intensity = {0, 0, 0};
+            if (node.IsLeaf()) {
+                for (uint32_t i = node.offset; i < node.offset + node.count; ++i) {
+                    Vector intensity = GetAbsolute(lights[bvh_.GetPrimitives()[i]].intensity);
+                    Extend(&max_intensity, intensity);
+                    total_intensity = total_intensity + intensity;
+                }
+            } else {
+                for (uint32_t child : {static_cast<uint32_t>(node_index + 1), node.offset}) {
+                    Extend(&max_intensity, max_intensities_[child]);
+                    total_intensity = total_intensity + total_intensities_[child];
+                }
+            }
+        }
+    }
+
+    // Calls visit(light) for the lights of every group that keep(box, max_intensity) accepts,
+    // where box bounds the positions of the lights of the group and max_intensity their absolute
+    // intensities channel by channel. A tree of a few lights is a single group that is not
+    // tested, visit gets them all. Lights come in no particular order.
+    template <class Keep, class Visit>
+    void ForEachLight(Keep&& keep, Visit&& visit) const {
+        const auto& nodes = bvh_.GetNodes();
+        if (nodes.empty() || (!nodes[0].IsLeaf() && !keep(nodes[0].box, max_intensities_[0]))) {
+            return;
+        }
+        std::array<uint32_t, BvhBuilder<Scalar>::kMaxDepth> stack;
+        size_t stack_size = 0;
+        uint32_t node_index = 0;
+        while (true) {
+            const BvhNode& node = nodes[node_index];
+            if (node.IsLeaf()) {
+                for (uint32_t i = node.offset; i < node.offset + node.count; ++i) {
+                    visit(bvh_.GetPrimitives()[i]);
+                }
+            } else {
+                uint32_t left = node_index + 1;
+                uint32_t right = node.offset;
+                bool keep_left = keep(nodes[left].box, max_intensities_[left]);
+                bool keep_right = keep(nodes[right].box, max_intensities_[right]);
+                if (keep_left || keep_right) {
+                    if (keep_left && keep_right) {
+                        stack[stack_size++] = right;
+                    }
+                    node_index = keep_left ? left : right;
+                    continue;
+                }
+            }
+            if (stack_size == 0) {
+                return;
+            }
+            node_index = stack[--stack_size];
+        }
+    }
+
+    // Picks lights at random, one for each of the uniform numbers in [0, 1) in u, which must be
+    // sorted and are used up. From the root down, either child is taken with probability
+    // proportional to importance(box, total_intensity), where box bounds the positions of the
+    // lights of the child and total_intensity sums their absolute intensities channel by channel;
+    // in the leaf, a light with probability proportional to weight(light). Calls
+    // visit(sample, count) for every light picked, count being the number of picks that landed on
+    // it. Picks go down the tree together, so importance and weight are computed once per node
+    // reached whatever the number of picks. A light has no chance only if importance or weight
+    // say that it doesn't matter.
+    template <class Importance, class Weight, class Visit>
+    void SampleLights(std::span<double> u, Importance&& importance, Weight&& weight,
+                      Visit&& visit) const {
+        const auto& nodes = bvh_.GetNodes();
+        if (nodes.empty() || u.empty()) {
+            return;
+        }
+        // picks u[begin..end) that reached the node, with the probability of getting there
+        struct Group {
+            uint32_t node_index;
+            size_t begin;
+            size_t end;
+            double probability;
+        };
+        // every level replaces a group with at most two
+        std::array<Group, BvhBuilder<Scalar>::kMaxDepth + 1> stack;
+        size_t stack_size = 0;
+        stack[stack_size++] = {0, 0, u.size(), 1};
+        while (stack_size != 0) {
+            auto [node_index, begin, end, probability] = stack[--stack_size];
+            const BvhNode& node = nodes[node_index];
+            if (node.IsLeaf()) {
+                SampleLeaf(node, u.subspan(begin, end - begin), probability, weight, visit);
+                continue;
+            }
+            uint32_t left = node_index + 1;
+            uint32_t right = node.offset;
+            double left_importance = importance(nodes[left].box, total_intensities_[left]);
+            double right_importance = importance(nodes[right].box, total_intensities_[right]);
+            if (!(left_importance + right_importance > 0)) {
+                continue;
+            }
+            // every pick spends the part of u that chose the child, what is left is uniform
+            // again and still sorted
+            double left_probability = left_importance / (left_importance + right_importance);
+            size_t middle = begin;
+            for (; middle < end && (u[middle] < left_probability || left_probability >= 1);
+                 ++middle) {
+                u[middle] /= left_probability;
+            }
+            for (size_t i = middle; i < end; ++i) {
+                u[i] = (u[i] - left_probability) / (1 - left_probability);
+            }
+            if (middle != end) {
+                stack[stack_size++] = {right, middle, end, probability * (1 - left_probability)};
+            }
+            if (begin != middle) {
+                stack[stack_size++] = {left, begin, middle, probability * left_probability};
+            }
+        }
+    }
+
+    // bytes taken by the tree
+    size_t GetMemoryUsage() const {
+        return bvh_.GetNodes().size() * sizeof(BvhNode) +
+               bvh_.GetPrimitives().size() * sizeof(uint32_t) +
+               (max_intensities_.size() + total_intensities_.size()) * sizeof(Vector);
+    }
+
+private:
+    // leaves hold up to this many lights, bounding fewer costs about as much as lighting them
+    static constexpr size_t kLeafLights = 8;
+
+    // Inverts the distribution of the weights of the lights of the leaf for the sorted u.
+    template <class Weight, class Visit>
+    void SampleLeaf(const BvhNode& leaf, std::span<const double> u, double probability,
+                    Weight&& weight, Visit&& visit) const {
+        auto lights = bvh_.GetPrimitives().begin() + leaf.offset;
+        double total_weight = 0;
+        for (uint32_t i = 0; i < leaf.count; ++i) {
+            double light_weight = weight(lights[i]);
+            total_weight += light_weight > 0 ? light_weight : 0;
+        }
+        if (!(total_weight > 0)) {
+            return;
+        }
+
+        std::optional<LightSample> sample;
+        size_t picked = 0;
+        size_t count = 0;
+        double cumulative_weight = 0;
+        for (uint32_t i = 0; i < leaf.count; ++i) {
+            double light_weight = weight(lights[i]);
+            if (!(light_weight > 0)) {
+                continue;
+            }
+            if (count != 0) {
+                visit(*sample, count);
+            }
+            sample = LightSample{lights[i], probability * light_weight / total_weight};
+            cumulative_weight += light_weight;
+            count = 0;
+            for (; picked < u.size() && u[picked] * total_weight < cumulative_weight; ++picked) {
+                ++count;
+            }
+        }
+        // picks that rounding left past the last weight
+        count += u.size() - picked;
+        if (count != 0) {
+            visit(*sample, count);
+        }
+    }
+
+    static Vector GetAbsolute(const Vector& vector) {
+        return {std::fabs(vector[0]), std::fabs(vector[1]), std::fabs(vector[2])};
+    }
+
+    static void Extend(Vector* max, const Vector& value) {
+        for (int i = 0; i < 3; ++i) {
+            (*max)[i] = std::max((*max)[i], value[i]);
+        }
+    }
+
+    Bvh bvh_;
+    // indexed by node
+    std::vector<Vector> max_intensities_;
+    std::vector<Vector> total_intensities_;
+};
@@ -0,0 +1,99 @@
+#pragma once
+
+#include <png.h>
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <stdexcept>
+#include <string>
+
+// PNG file written a row at a time from the top, so an image never has to be held whole. Rows
+// are 8-bit RGBA, as Image::Write writes them. A writer destroyed before Finish leaves a
+// truncated file behind.
+class PngRowWriter {
+public:
+    PngRowWriter(const std::string& filename, int width, int height)
+        : width_(width), height_(height) {
+        file_ = std::fopen(filename.c_str(), "wb");
+        if (!file_) {
+            throw std::runtime_error("Can't open file " + filename);
+        }
+        png_ = png_create_write_struct(PNG_LIBPNG_VER_STRING, nullptr, nullptr, nullptr);
+        if (png_) {
+            info_ = png_create_info_struct(png_);
+        }
+        if (!info_) {
+            Close();
+            throw std::runtime_error("Can't create png write struct");
+        }
+        if (setjmp(png_jmpbuf(png_))) {
+            abort();
+        }
+        png_init_io(png_, file_);
+        png_set_IHDR(png_, info_, width_, height_, 8, PNG_COLOR_TYPE_RGBA, PNG_INTERLACE_NONE,
+                     PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+        png_write_info(png_, info_);
+    }
+
+    PngRowWriter(const PngRowWriter&) = delete;
+    PngRowWriter& operator=(const PngRowWriter&) = delete;
+
+    ~PngRowWriter() {
+        Close();
+    }
+
+    int Width() const {
+        return width_;
+    }
+    int Height() const {
+        return height_;
+    }
+
+    // Appends the next row, 4 * Width() bytes.
+    void WriteRow(const uint8_t* row) {
+        if (!png_ || rows_written_ == height_) {
+            throw std::logic_error("png row past the end of the image");
+        }
+        if (setjmp(png_jmpbuf(png_))) {
+            abort();
+        }
+        png_write_row(png_, row);
+        ++rows_written_;
+    }
+
+    // Ends and closes the file once every row is written.
+    void Finish() {
+        if (!png_ || rows_written_ != height_) {
+            throw std::logic_error("png finished before its last row");
+        }
+        if (setjmp(png_jmpbuf(png_))) {
+            abort();
+        }
+        png_write_end(png_, nullptr);
+        png_destroy_write_struct(&png_, &info_);
+        int error = std::fclose(file_);
+        file_ = nullptr;
+        if (error != 0) {
+            throw std::runtime_error("Can't write png file");
+        }
+    }
+
+private:
+    void Close() {
+        if (png_) {
+            png_destroy_write_struct(&png_, &info_);
+        }
+        if (file_) {
+            std::fclose(file_);
+            file_ = nullptr;
+        }
+    }
+
+    int width_;
+    int height_;
+    int rows_written_ = 0;
+    FILE* file_ = nullptr;
+    png_structp png_ = nullptr;
+    png_infop info_ = nullptr;
+};
@@ -0,0 +1,261 @@
+#pragma once
+
+#include <scene.h>
+#include <geometry.h>
+#include <bvh.h>
+#include <primitive_block.h>
+#include <ray_packet.h>
+#include <light_tree.h>
+#include <buffer.h>
+
+#include <array>
+#include <cstdint>
+#include <limits>
+#include <optional>
+#include <vector>
+
+// Primitive ids used by the scene BVH: spheres come first, triangles follow them.
+std::vector<BoundingBox> GetPrimitiveBoxes(const Scene& scene) {
+    std::vector<BoundingBox> boxes;
+    boxes.reserve(scene.GetSphereObjects().size() + scene.GetObjects().size());
+    for (const SphereObject& object : scene.GetSphereObjects()) {
+        boxes.push_back(GetBoundingBox(object.sphere));
+    }
+    for (const TriangleRecord& triangle : scene.GetTriangleRecords()) {
+        boxes.push_back(GetBoundingBox(triangle));
+    }
+    return boxes;
+}
+
+bool IsSphere(const Scene& scene, uint32_t primitive) {
+    return primitive < scene.GetSphereObjects().size();
+}
+Object GetObject(const Scene& scene, uint32_t primitive) {
+    return scene.GetObject(primitive - scene.GetSphereObjects().size());
+}
+const TriangleRecord& GetTriangleRecord(const Scene& scene, uint32_t primitive) {
+    return scene.GetTriangleRecords()[primitive - scene.GetSphereObjects().size()];
+}
+
+std::optional<HitRecord> FindHit(const Ray& ray, const Scene& scene, uint32_t primitive) {
+    if (IsSphere(scene, primitive)) {
+        return FindHit(ray, scene.GetSphereObjects()[primitive].sphere);
+    }
+    return FindHit(ray, GetTriangleRecord(scene, primitive));
+}
+
+bool Occludes(const Ray& ray, const Scene& scene, uint32_t primitive, Scalar max_distance) {
+    if (IsSphere(scene, primitive)) {
+        return Occludes(ray, scene.GetSphereObjects()[primitive].sphere, max_distance);
+    }
+    return Occludes(ray, GetTriangleRecord(scene, primitive), max_distance);
+}
+
+// Closest hit as tracked by the traversal, the surface at it is reconstructed afterwards.
+struct Hit {
+    HitRecord record;
+    uint32_t primitive;
+};
+
+// Nearest intersection along the ray, testing one primitive at a time; on equal distances the
+// primitive with the smaller id wins, which matches scanning spheres and then triangles in scene
+// order.
+std::optional<Hit> FindClosestHit(const Scene& scene, const Bvh& bvh, const Ray& ray) {
+    std::optional<Hit> result;
+    Scalar distance = std::numeric_limits<Scalar>::infinity();
+    bvh.Traverse(ray, distance, [&](uint32_t primitive) {
+        auto hit = FindHit(ray, scene, primitive);
+        if (!hit) {
+            return false;
+        }
+        if (hit->distance < distance ||
+            (result && hit->distance == distance && primitive < result->primitive)) {
+            distance = hit->distance;
+            result = Hit{*hit, primitive};
+        }
+        return false;
+    });
+    return result;
+}
+
+// Blocks of one BVH leaf, empty for inner nodes.
+struct LeafRange {
+    uint32_t first_triangle_block = 0;
+    uint32_t triangle_blocks = 0;
+    uint32_t first_sphere_block = 0;
+    uint32_t sphere_blocks = 0;
+};
+
+// Primitives of every BVH leaf repacked into SIMD blocks, spheres and triangles separately.
+class LeafBlocks {
+public:
+    LeafBlocks() {
+    }
+
+    LeafBlocks(const Scene& scene, const Bvh& bvh) {
+        std::vector<LeafRange> ranges(bvh.GetNodes().size());
+        std::vector<TriangleBlock> triangle_blocks;
+        std::vector<SphereBlock> sphere_blocks;
+        const auto& primitives = bvh.GetPrimitives();
+        for (size_t node_index = 0; node_index < bvh.GetNodes().size(); ++node_index) {
+            const BvhNode& node = bvh.GetNodes()[node_index];
+            LeafRange& range = ranges[node_index];
+            range.first_triangle_block = triangle_blocks.size();
+            range.first_sphere_block = sphere_blocks.size();
+            for (uint32_t i = node.offset; i < node.offset + node.count; ++i) {
+                uint32_t primitive = primitives[i];
+                if (IsSphere(scene, primitive)) {
+                    Add(&sphere_blocks, range.first_sphere_block,
+                        scene.GetSphereObjects()[primitive].sphere, primitive);
+                } else {
+                    Add(&triangle_blocks, range.first_triangle_block,
+                        GetTriangleRecord(scene, primitive), primitive);
+                }
+            }
+            range.triangle_blocks = triangle_blocks.size() - range.first_triangle_block;
+            range.sphere_blocks = sphere_blocks.size() - range.first_sphere_block;
+        }
+        ranges_ = std::move(ranges);
+        triangle_blocks_ = std::move(triangle_blocks);
+        sphere_blocks_ = std::move(sphere_blocks);
+    }
+
+    // Blocks built earlier, e.g. mapped from a cache file.
+    LeafBlocks(Buffer<LeafRange> ranges, Buffer<TriangleBlock> triangle_blocks,
+               Buffer<SphereBlock> sphere_blocks)
+        : ranges_(std::move(ranges)),
+          triangle_blocks_(std::move(triangle_blocks)),
+          sphere_blocks_(std::move(sphere_blocks)) {
+    }
+
+    const Buffer<LeafRange>& GetRanges() const {
+        return ranges_;
+    }
+    const Buffer<TriangleBlock>& GetTriangleBlocks() const {
+        return triangle_blocks_;
+    }
+    const Buffer<SphereBlock>& GetSphereBlocks() const {
+        return sphere_blocks_;
+    }
+
+    // Calls visit(block) for every block of the leaf until it returns true.
+    template <class Visit>
+    bool ForEachBlock(uint32_t node_index, Visit&& visit) const {
+        const LeafRange& range = ranges_[node_index];
+        for (uint32_t i = 0; i < range.triangle_blocks; ++i) {
+            if (visit(triangle_blocks_[range.first_triangle_block + i])) {
+                return true;
+            }
+        }
+        for (uint32_t i = 0; i < range.sphere_blocks; ++i) {
+            if (visit(sphere_blocks_[range.first_sphere_block + i])) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+private:
+    template <class Block, class Primitive>
+    static void Add(std::vector<Block>* blocks, size_t first_block, const Primitive& value,
+                    uint32_t primitive) {
+        if (blocks->size() == first_block || blocks->back().size == kBlockWidth) {
+            blocks->emplace_back();
+        }
+        blocks->back().Add(value, primitive);
+    }
+
+    Buffer<LeafRange> ranges_;  // indexed by BVH node
+    Buffer<TriangleBlock> triangle_blocks_;
+    Buffer<SphereBlock> sphere_blocks_;
+};
+
+// Scene together with the acceleration structures built over it.
+struct PreparedScene {
+    Scene scene;
+    Bvh bvh;
+    LeafBlocks blocks;
+    LightTree light_tree;
+};
+
+PreparedScene PrepareScene(Scene scene) {
+    Bvh bvh(GetPrimitiveBoxes(scene), kBlockWidth);
+    LeafBlocks blocks(scene, bvh);
+    LightTree light_tree(scene.GetLights());
+    return {std::move(scene), std::move(bvh), std::move(blocks), std::move(light_tree)};
+}
+
+// Same result as the scalar FindClosestHit, but BVH leaves are tested a SIMD block at a time.
+std::optional<Hit> FindClosestHit(const PreparedScene& prepared, const Ray& ray) {
+    BlockHit hit;
+    prepared.bvh.TraverseLeaves(
+        ray, hit.record.distance, [&](uint32_t node_index, const BvhNode&) {
+            return prepared.blocks.ForEachBlock(node_index, [&](const auto& block) {
+                IntersectBlock(ray, block, &hit);
+                return false;
+            });
+        });
+    if (hit.primitive == kNoPrimitive) {
+        return std::nullopt;
+    }
+    return Hit{hit.record, hit.primitive};
+}
+
+using PacketHits = std::array<std::optional<Hit>, kPacketSize>;
+
+// Closest hits of the rays of the packet, the ones FindClosestHit finds for each ray alone. The
+// packet traverses the BVH as a whole, the leaves it reaches are tested ray by ray with the block
+// kernels. Max distances of the packet shrink to the hits found.
+void FindClosestHits(const PreparedScene& prepared, RayPacket* packet, PacketHits* hits) {
+    std::array<BlockHit, kPacketSize> block_hits;
+    for (size_t i = 0; i < packet->Size(); ++i) {
+        block_hits[i].record.distance = packet->GetMaxDistance(i);
+    }
+    prepared.bvh.TraversePacketLeaves(
+        *packet, [&](uint32_t node_index, const BvhNode&, const RayPacket::Masks& masks) {
+            for (size_t group = 0; group < packet->GetGroupCount(); ++group) {
+                for (size_t lane = 0; lane < RayPacket::kLanes; ++lane) {
+                    if (!masks[group][lane]) {
+                        continue;
+                    }
+                    size_t i = group * RayPacket::kLanes + lane;
+                    prepared.blocks.ForEachBlock(node_index, [&](const auto& block) {
+                        IntersectBlock(packet->GetRay(i), block, &block_hits[i]);
+                        return false;
+                    });
+                    packet->SetMaxDistance(i, block_hits[i].record.distance);
+                }
+            }
+            return false;
+        });
+    for (size_t i = 0; i < packet->Size(); ++i) {
+        if (block_hits[i].primitive == kNoPrimitive) {
+            (*hits)[i] = std::nullopt;
+        } else {
+            (*hits)[i] = Hit{block_hits[i].record, block_hits[i].primitive};
+        }
+    }
+}
+
+// Looks for any primitive closer than max_distance, starting with *last_occluder (may be
+// kNoPrimitive), and stores the one found there.
+bool IsOccluded(const PreparedScene& prepared, const Ray& ray, Scalar max_distance,
+                uint32_t* last_occluder) {
+    if (*last_occluder != kNoPrimitive &&
+        Occludes(ray, prepared.scene, *last_occluder, max_distance)) {
+        return true;
+    }
+
+    uint32_t occluder = kNoPrimitive;
+    prepared.bvh.TraverseLeaves(ray, max_distance, [&](uint32_t node_index, const BvhNode&) {
+        return prepared.blocks.ForEachBlock(node_index, [&](const auto& block) {
+            occluder = FindOccluder(ray, block, max_distance);
+            return occluder != kNoPrimitive;
+        });
+    });
+    if (occluder == kNoPrimitive) {
+        return false;
+    }
+    *last_occluder = occluder;
+    return true;
+}
@@ -1,93 +1,272 @@
 #pragma once
 
 #include <image.h>
+#include <png_writer.h>
 #include <camera_options.h>
 #include <render_options.h>
+#include <thread_pool.h>
 
 #include <scene.h>
 #include <geometry.h>
+#include <prepared_scene.h>
+#include <scene_cache.h>
+#include <scene_registry.h>
+#include <scene_builder.h>
 
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <deque>
+#include <exception>
+#include <filesystem>
+#include <functional>
+#include <mutex>
 #include <string>
+#include <limits>
+#include <optional>
+#include <thread>
+#include <type_traits>
+#include <vector>
 
 // const double kEps = 0.0001;
 const double kInf = 1000000;
 
-bool NormalZeros(const Object& object) {
-    for (int i = 0; i < 3; ++i) {
-        for (int j = 0; j < 3; ++j) {
-            if (std::fabs(object.normal.GetVertex(i)[j]) > kEps) {
-                return false;
-            }
-        }
+// Shading data of a hit, reconstructed once the closest hit is known.
+struct Surface {
+    Vector position;
+    Vector normal;
+    const Material* material;
+};
+
+// Shades primitives without a material (kNoMaterial), e.g. OBJ faces before any usemtl or
+// SceneBuilder primitives given none: plain grey, lit by the lights only.
+const Material* GetDefaultMaterial() {
+    static const Material material = [] {
+        Material result;
+        result.diffuse_color = {0.8, 0.8, 0.8};
+        return result;
+    }();
+    return &material;
+}
+
+// Triangles with vertex normals interpolate them at the Moller-Trumbore coordinates of the hit,
+// other triangles keep the face normal. The material is never null.
+Surface GetSurface(const Scene& scene, const Ray& ray, const Hit& hit) {
+    auto or_default = [](const Material* material) {
+        return material ? material : GetDefaultMaterial();
+    };
+    if (IsSphere(scene, hit.primitive)) {
+        const SphereObject& object = scene.GetSphereObjects()[hit.primitive];
+        Intersection intersection = GetIntersection(ray, object.sphere, hit.record);
+        return {intersection.GetPosition(), intersection.GetNormal(),
+                or_default(scene.GetMaterial(object.material))};
+    }
+    const TriangleRecord& triangle = GetTriangleRecord(scene, hit.primitive);
+    Object object = GetObject(scene, hit.primitive);
+    if (!triangle.has_vertex_normals) {
+        Intersection intersection = GetIntersection(ray, triangle, hit.record);
+        return {intersection.GetPosition(), intersection.GetNormal(),
+                or_default(object.material)};
     }
-    return true;
+    const HitRecord& record = hit.record;
+    Vector position = ray.GetOrigin() + record.distance * ray.GetDirection();
+    Vector normal = (1 - record.u - record.v) * (*object.GetNormal(0)) +
+                    record.u * (*object.GetNormal(1)) + record.v * (*object.GetNormal(2));
+    return {position, normal, or_default(object.material)};
 }
 
-std::vector<std::vector<Vector>> ComputeRayDirections(const CameraOptions& camera_options) {
-    std::vector<std::vector<Vector>> result(camera_options.screen_width,
-                                            std::vector<Vector>(camera_options.screen_height));
+// Directions of the primary rays through points of the screen, given in pixels from its top left
+// corner: pixel (i, j) covers [i, i + 1) x [j, j + 1). Renders of a band of rows of the screen
+// give the first of them, points are then relative to its start.
+class ScreenRays {
+public:
+    explicit ScreenRays(const CameraOptions& camera_options, int first_row = 0)
+        : width_(camera_options.screen_width),
+          height_(camera_options.screen_height),
+          first_row_(first_row),
+          aspect_ratio_(static_cast<double>(width_) / height_),
+          scale_(std::tan(camera_options.fov / 2)) {
+        forward_ = Vector(camera_options.look_from) - Vector(camera_options.look_to);
+        forward_.Normalize();
+        right_ = std::fabs(forward_[1]) + kEps > 1 ? Vector{1, 0, 0}
+                                                   : CrossProduct({0, 1, 0}, forward_);
+        right_.Normalize();
+        up_ = CrossProduct(forward_, right_);
+        up_.Normalize();
+    }
+
+    Vector GetDirection(double screen_x, double screen_y) const {
+        double x = aspect_ratio_ * scale_ * (2 * screen_x / width_ - 1);
+        double y = -1 * scale_ * (2 * (screen_y + first_row_) / height_ - 1);
+        double z = -1;
+        Vector direction = x * right_ + y * up_ + z * forward_;
+        direction.Normalize();
+        return direction;
+    }
+    // through the centre of pixel (i, j)
+    Vector GetPixelDirection(int i, int j) const {
+        return GetDirection(i + 0.5, j + 0.5);
+    }
 
-    double aspect_ratio =
-        static_cast<double>(camera_options.screen_width) / camera_options.screen_height;
-    double scale = std::tan(camera_options.fov / 2);
+    // row of the screen that row 0 of the render is
+    int GetFirstRow() const {
+        return first_row_;
+    }
 
-    Vector forward = Vector(camera_options.look_from) - Vector(camera_options.look_to);
-    forward.Normalize();
-    Vector right =
-        std::fabs(forward[1]) + kEps > 1 ? Vector{1, 0, 0} : CrossProduct({0, 1, 0}, forward);
-    right.Normalize();
-    Vector up = CrossProduct(forward, right);
-    up.Normalize();
+private:
+    int width_;
+    int height_;
+    int first_row_;
+    double aspect_ratio_;
+    double scale_;
+    Vector forward_;
+    Vector right_;
+    Vector up_;
+};
 
+// Directions through the centres of the pixels.
+std::vector<std::vector<Vector>> ComputeRayDirections(const CameraOptions& camera_options) {
+    std::vector<std::vector<Vector>> result(camera_options.screen_width,
+                                            std::vector<Vector>(camera_options.screen_height));
+    ScreenRays screen(camera_options);
     for (int i = 0; i != camera_options.screen_width; ++i) {
         for (int j = 0; j != camera_options.screen_height; ++j) {
-            double x = aspect_ratio * scale * (2 * (i + 0.5) / camera_options.screen_width - 1);
-            double y = -1 * scale * (2 * (j + 0.5) / camera_options.screen_height - 1);
-            double z = -1;
-            result[i][j] = x * right + y * up + z * forward;
-            result[i][j].Normalize();
+            result[i][j] = screen.GetPixelDirection(i, j);
         }
     }
-
     return result;
 }
 
-Image RenderDepth(const std::string& filename, const CameraOptions& camera_options) {
-    Scene scene = ReadScene(filename);
+struct Tile {
+    int x_begin, y_begin;
+    int x_end, y_end;
+};
 
-    auto ray_directions = ComputeRayDirections(camera_options);
-    std::vector<std::vector<double>> img(camera_options.screen_width,
-                                         std::vector<double>(camera_options.screen_height, kInf));
+std::vector<Tile> SplitIntoTiles(int width, int height, int tile_size) {
+    tile_size = std::max(tile_size, 1);
+    std::vector<Tile> tiles;
+    for (int y = 0; y < height; y += tile_size) {
+        for (int x = 0; x < width; x += tile_size) {
+            tiles.push_back({x, y, std::min(x + tile_size, width), std::min(y + tile_size, height)});
+        }
+    }
+    return tiles;
+}
 
-    double max_distance = 0;
+// side of the square of pixels whose primary rays are traced as one packet
+constexpr int kPacketSide = 8;
+static_assert(kPacketSide * kPacketSide == kPacketSize);
 
-    for (int i = 0; i < camera_options.screen_width; ++i) {
-        for (int j = 0; j < camera_options.screen_height; ++j) {
-            Ray ray(Vector(camera_options.look_from), ray_directions[i][j]);
+struct Pixel {
+    int i, j;
+};
 
-            for (const SphereObject& object : scene.GetSphereObjects()) {
-                auto intersection = GetIntersection(ray, object.sphere);
-                if (!intersection) {
-                    continue;
-                }
-                img[i][j] =
-                    std::min(img[i][j], Length(ray.GetOrigin() - intersection->GetPosition()));
-            }
+using PacketPixels = std::array<Pixel, kPacketSize>;
 
-            for (const Object& object : scene.GetObjects()) {
-                auto intersection = GetIntersection(ray, object.polygon);
-                if (!intersection) {
-                    continue;
+// Pixels traced by a pass: the ones on a grid of step pixels, but when refining, not those on the
+// grid twice as coarse, which an earlier pass has traced. Whole renders trace the grid of step 1.
+struct PixelGrid {
+    int step = 1;
+    bool refining = false;
+
+    bool Contains(int i, int j) const {
+        return i % step == 0 && j % step == 0 &&
+               !(refining && i % (2 * step) == 0 && j % (2 * step) == 0);
+    }
+};
+
+// Splits the image into tiles of tile_size x tile_size grid pixels.
+std::vector<Tile> SplitIntoTiles(const CameraOptions& camera_options,
+                                 const RenderOptions& render_options, const PixelGrid& grid) {
+    return SplitIntoTiles(camera_options.screen_width, camera_options.screen_height,
+                          std::max(render_options.tile_size, 1) * grid.step);
+}
+
+// Calls visit(pixels, count) for the pixels of the grid in the tile, a square of up to
+// kPacketSide x kPacketSide grid pixels at a time.
+template <class Visit>
+void ForEachPixelSquare(const Tile& tile, const PixelGrid& grid, Visit&& visit) {
+    int side = kPacketSide * grid.step;
+    PacketPixels pixels;
+    for (int x = tile.x_begin; x < tile.x_end; x += side) {
+        for (int y = tile.y_begin; y < tile.y_end; y += side) {
+            size_t count = 0;
+            for (int i = x; i < std::min(x + side, tile.x_end); i += grid.step) {
+                for (int j = y; j < std::min(y + side, tile.y_end); j += grid.step) {
+                    if (grid.Contains(i, j)) {
+                        pixels[count++] = {i, j};
+                    }
                 }
-                img[i][j] =
-                    std::min(img[i][j], Length(ray.GetOrigin() - intersection->GetPosition()));
             }
-
-            if (img[i][j] < kInf - 1) {
-                max_distance = std::max(img[i][j], max_distance);
+            if (count != 0) {
+                visit(pixels, count);
             }
         }
     }
+}
+
+// Calls render_packet(packet, pixels, worker) for the primary rays of the pixels of the grid, tile
+// by tile on the pool and a square of up to kPacketSide x kPacketSide of them per packet;
+// pixels[k] is where the k-th ray of the packet goes.
+template <class RenderPacket>
+void ForEachPacket(ThreadPool* pool, const CameraOptions& camera_options,
+                   const RenderOptions& render_options, const ScreenRays& screen,
+                   RenderPacket&& render_packet, const PixelGrid& grid = {}) {
+    auto tiles = SplitIntoTiles(camera_options, render_options, grid);
+    std::vector<RayPacket> packets(pool->Size());
+    pool->ParallelFor(tiles.size(), [&](size_t index, size_t worker) {
+        RayPacket& packet = packets[worker];
+        ForEachPixelSquare(tiles[index], grid, [&](const PacketPixels& pixels, size_t count) {
+            packet.Clear();
+            for (size_t k = 0; k < count; ++k) {
+                auto [i, j] = pixels[k];
+                packet.Add(
+                    Ray(Vector(camera_options.look_from), screen.GetPixelDirection(i, j)));
+            }
+            render_packet(&packet, pixels, worker);
+        });
+    });
+}
+
+// Prepared scene of the file, kept by the scene registry unless render_options turn it off.
+std::shared_ptr<const PreparedScene> GetPreparedScene(const std::string& filename,
+                                                      const RenderOptions& render_options) {
+    if (!render_options.reuse_scenes) {
+        return std::make_shared<const PreparedScene>(LoadPreparedScene(
+            filename, render_options.cache_directory, render_options.threads));
+    }
+    return GetSceneRegistry().Get(filename, render_options.cache_directory,
+                                  render_options.threads);
+}
+
+Image RenderDepth(const PreparedScene& prepared, const CameraOptions& camera_options,
+                  const RenderOptions& render_options, ThreadPool* pool) {
+    ScreenRays screen(camera_options);
+    std::vector<std::vector<double>> img(camera_options.screen_width,
+                                         std::vector<double>(camera_options.screen_height, kInf));
+
+    // per-worker maxima, combined after the pass
+    std::vector<double> max_distances(pool->Size(), 0);
+    std::vector<PacketHits> hits(pool->Size());
+    ForEachPacket(pool, camera_options, render_options, screen,
+                  [&](RayPacket* packet, const PacketPixels& pixels, size_t worker) {
+                      FindClosestHits(prepared, packet, &hits[worker]);
+                      for (size_t k = 0; k < packet->Size(); ++k) {
+                          auto [i, j] = pixels[k];
+                          const auto& hit = hits[worker][k];
+                          if (hit) {
+                              img[i][j] = std::min<double>(img[i][j], hit->record.distance);
+                          }
+
+                          if (img[i][j] < kInf - 1) {
+                              max_distances[worker] = std::max(img[i][j], max_distances[worker]);
+                          }
+                      }
+                  });
+    double max_distance = *std::max_element(max_distances.begin(), max_distances.end());
 
     if (max_distance < kEps) {
         throw std::runtime_error("lol, max_distance <= 0");
@@ -104,54 +283,25 @@ Image RenderDepth(const std::string& filename, const CameraOptions& camera_optio
     return result;
 }
 
-Image RenderNormal(const std::string& filename, const CameraOptions& camera_options) {
-    Scene scene = ReadScene(filename);
-
-    auto ray_directions = ComputeRayDirections(camera_options);
+Image RenderNormal(const PreparedScene& prepared, const CameraOptions& camera_options,
+                   const RenderOptions& render_options, ThreadPool* pool) {
+    ScreenRays screen(camera_options);
     std::vector<std::vector<Vector>> img(
         camera_options.screen_width,
         std::vector<Vector>(camera_options.screen_height, {-kInf, -kInf, -kInf}));
 
-    for (int i = 0; i < camera_options.screen_width; ++i) {
-        for (int j = 0; j < camera_options.screen_height; ++j) {
-            Ray ray(Vector(camera_options.look_from), ray_directions[i][j]);
-            double distance = kInf;
-
-            for (const SphereObject& object : scene.GetSphereObjects()) {
-                auto intersection = GetIntersection(ray, object.sphere);
-                if (!intersection) {
-                    continue;
-                }
-                if (Length(ray.GetOrigin() - intersection->GetPosition()) < distance) {
-                    distance = Length(ray.GetOrigin() - intersection->GetPosition());
-                    img[i][j] = intersection->GetNormal();
-                }
-            }
-
-            for (const Object& object : scene.GetObjects()) {
-                auto intersection = GetIntersection(ray, object.polygon);
-                if (!intersection) {
-                    continue;
-                }
-
-                if (Length(ray.GetOrigin() - intersection->GetPosition()) < distance) {
-                    distance = Length(ray.GetOrigin() - intersection->GetPosition());
-
-                    if (NormalZeros(object)) {
-                        img[i][j] = intersection->GetNormal();
-                        continue;
-                    }
-
-                    Vector barycentric =
-                        GetBarycentricCoords(object.polygon, intersection->GetPosition());
-                    img[i][j] = {0, 0, 0};
-                    for (int k = 0; k != 3; ++k) {
-                        img[i][j] = img[i][j] + barycentric[k] * (*object.GetNormal(k));
-                    }
-                }
-            }
-        }
-    }
+    std::vector<PacketHits> hits(pool->Size());
+    ForEachPacket(pool, camera_options, render_options, screen,
+                  [&](RayPacket* packet, const PacketPixels& pixels, size_t worker) {
+                      FindClosestHits(prepared, packet, &hits[worker]);
+                      for (size_t k = 0; k < packet->Size(); ++k) {
+                          auto [i, j] = pixels[k];
+                          if (const auto& hit = hits[worker][k]) {
+                              img[i][j] =
+                                  GetSurface(prepared.scene, packet->GetRay(k), *hit).normal;
+                          }
+                      }
+                  });
 
     Image result(camera_options.screen_width, camera_options.screen_height);
     for (int i = 0; i < camera_options.screen_width; ++i) {
@@ -170,176 +320,420 @@ Image RenderNormal(const std::string& filename, const CameraOptions& camera_opti
     return result;
 }
 
-// WARNING: value of 1e-6 and less does shit on test deer in release
-const double kEps2 = 1e-5;
-const double kEps3 = 1e-5;
+const Scalar kEps2 = Epsilons<Scalar>::kEps2;
+const Scalar kEps3 = Epsilons<Scalar>::kEps3;
 
-bool NoIntersection(const Scene& scene, const Ray& ray, double length) {
-    for (const SphereObject& object : scene.GetSphereObjects()) {
-        auto intersection = GetIntersection(ray, object.sphere);
-        if (!intersection) {
-            continue;
-        }
-        if (Length(ray.GetOrigin() - intersection->GetPosition()) < length + kEps3) {
-            return false;
-        }
+// Light added at a shading point by one unoccluded light.
+struct LightContribution {
+    uint32_t light;
+    Vector contribution;
+};
+
+// Remembers, for every light, the primitive that blocked the last shadow ray towards it:
+// neighbouring shading points are usually shadowed by the same occluder, so it is tested before
+// traversing the BVH. Also keeps room for the contributions of the lights at a shading point and
+// for the random numbers that pick lights. Owned by a single rendering thread.
+class OcclusionCache {
+public:
+    explicit OcclusionCache(size_t lights_count) : last_occluders_(lights_count, kNoPrimitive) {
+        contributions_.reserve(lights_count);
     }
-    for (const Object& object : scene.GetObjects()) {
-        auto intersection = GetIntersection(ray, object.polygon);
-        if (!intersection) {
-            continue;
-        }
-        if (Length(ray.GetOrigin() - intersection->GetPosition()) < length + kEps3) {
-            return false;
+
+    uint32_t& operator[](size_t light) {
+        return last_occluders_[light];
+    }
+
+    std::vector<LightContribution>& GetContributions() {
+        return contributions_;
+    }
+    std::vector<double>& GetSampleNumbers() {
+        return sample_numbers_;
+    }
+
+private:
+    std::vector<uint32_t> last_occluders_;
+    std::vector<LightContribution> contributions_;
+    std::vector<double> sample_numbers_;
+};
+
+bool NoIntersection(const PreparedScene& prepared, const Ray& ray, Scalar length,
+                    uint32_t* last_occluder) {
+    return !IsOccluded(prepared, ray, length + kEps3, last_occluder);
+}
+
+// Upper bound of DotProduct(direction, v) over the unit vectors v from point towards the points of
+// box, from the cone around the bounding sphere of the box. direction need not be a unit vector.
+Scalar GetMaxDotProduct(const Vector& direction, const Vector& point, const BoundingBox& box) {
+    // a few rounding errors of Scalar, so that the bound holds for the dot products as computed
+    constexpr Scalar kSlack = std::is_same_v<Scalar, float> ? 1e-5 : 1e-9;
+    Scalar length = Length(direction);
+    Vector to_center = box.GetCenter() - point;
+    Scalar distance = Length(to_center);
+    Scalar radius = 0.5 * Length(box.GetMax() - box.GetMin());
+    if (distance <= radius) {
+        return length;
+    }
+    Scalar cosine = DotProduct(direction, to_center) / (length * distance);
+    Scalar cone_sine = radius / distance;
+    Scalar cone_cosine = std::sqrt(1 - cone_sine * cone_sine);
+    if (!(cosine < cone_cosine)) {
+        return length;
+    }
+    Scalar sine = std::sqrt(std::max<Scalar>(0, 1 - cosine * cosine));
+    return length * (cosine * cone_cosine + sine * cone_sine + kSlack);
+}
+
+// What the light adds at the surface seen from the point from, unless something occludes it.
+Vector GetUnoccludedLight(const Surface& surface, const Vector& from, const Light& light) {
+    const Material& material = *surface.material;
+    const Vector& normal = surface.normal;
+    Vector v_l = light.position - surface.position;
+    Vector v_e = from - surface.position;
+    v_l.Normalize();
+    v_e.Normalize();
+
+    Scalar diffuse = std::max<Scalar>(0, DotProduct(normal, v_l));
+    Scalar specular = std::pow(std::max<Scalar>(0, DotProduct(v_e, Reflect(-1 * v_l, normal))),
+                               material.specular_exponent);
+    return material.albedo[0] * light.intensity *
+           (diffuse * material.diffuse_color + specular * material.specular_color);
+}
+
+// Upper bound, channel by channel, of the absolute value of what lights in a box add at the
+// surface seen from the point from, unoccluded, for absolute light intensities adding up to at
+// most intensity. It is zero for lights that can't light the surface at all.
+class UnoccludedLightBound {
+public:
+    UnoccludedLightBound(const Surface& surface, const Vector& from) : surface_(surface) {
+        // the specular term of a light is the dot product of its direction with the mirror
+        // direction
+        Vector to_eye = from - surface.position;
+        to_eye.Normalize();
+        mirror_ = Reflect(-1 * to_eye, surface.normal);
+    }
+
+    Vector operator()(const BoundingBox& box, const Vector& intensity) const {
+        const Material& material = *surface_.material;
+        Scalar diffuse =
+            std::max<Scalar>(0, GetMaxDotProduct(surface_.normal, surface_.position, box));
+        Scalar specular =
+            std::pow(std::max<Scalar>(0, GetMaxDotProduct(mirror_, surface_.position, box)),
+                     material.specular_exponent);
+        Vector bound;
+        for (int i = 0; i < 3; ++i) {
+            bound[i] = std::fabs(material.albedo[0]) * intensity[i] *
+                       (diffuse * std::fabs(material.diffuse_color[i]) +
+                        specular * std::fabs(material.specular_color[i]));
         }
+        return bound;
     }
-    return true;
+
+private:
+    const Surface& surface_;
+    Vector mirror_;
+};
+
+// Traces the shadow ray from the surface to the light.
+bool IsLit(const PreparedScene& prepared, OcclusionCache* occlusion_cache, const Surface& surface,
+           uint32_t light_index) {
+    const Light& light = prepared.scene.GetLights()[light_index];
+    Vector direction = light.position - surface.position;
+    direction.Normalize();
+    Scalar length = Length(surface.position - light.position);
+    return NoIntersection(prepared, Ray(surface.position + kEps2 * surface.normal, direction),
+                          length, &(*occlusion_cache)[light_index]);
 }
 
-Vector ComputeLights(const Scene& scene, const Intersection& intersection, const Material& material,
-                     const Vector& normal, const Vector& from) {
+// Adds up the lights of the scene at the surface seen from the point from. Lights that would add
+// no more than light_tolerance to any channel, even unoccluded, are skipped without a shadow ray,
+// and the light tree skips whole groups of them at once; zero skips only the lights that can't
+// light the surface at all, which leaves the result unchanged.
+Vector ComputeLights(const PreparedScene& prepared, OcclusionCache* occlusion_cache,
+                     const Surface& surface, const Vector& from, Scalar light_tolerance) {
+    const Scene& scene = prepared.scene;
+    const Material& material = *surface.material;
     Vector result = material.ambient_color + material.intensity;
 
-    for (const Light& light : scene.GetLights()) {
-        Vector direction = light.position - intersection.GetPosition();
-        direction.Normalize();
+    auto above_tolerance = [&](const Vector& contribution) {
+        return !(std::fabs(contribution[0]) <= light_tolerance &&
+                 std::fabs(contribution[1]) <= light_tolerance &&
+                 std::fabs(contribution[2]) <= light_tolerance);
+    };
+    UnoccludedLightBound bound(surface, from);
+    std::vector<LightContribution>& contributions = occlusion_cache->GetContributions();
+    contributions.clear();
+    prepared.light_tree.ForEachLight(
+        [&](const BoundingBox& box, const Vector& max_intensity) {
+            return above_tolerance(bound(box, max_intensity));
+        },
+        [&](uint32_t light_index) {
+            Vector contribution =
+                GetUnoccludedLight(surface, from, scene.GetLights()[light_index]);
+            if (above_tolerance(contribution) &&
+                IsLit(prepared, occlusion_cache, surface, light_index)) {
+                contributions.push_back({light_index, contribution});
+            }
+        });
 
-        double length = Length(intersection.GetPosition() - light.position);
-        bool no_intersection = NoIntersection(
-            scene, Ray(intersection.GetPosition() + kEps2 * normal, direction), length);
+    // added in scene order, whatever order the tree visits the lights in
+    std::sort(contributions.begin(), contributions.end(),
+              [](const LightContribution& a, const LightContribution& b) {
+                  return a.light < b.light;
+              });
+    for (const LightContribution& contribution : contributions) {
+        result = result + contribution.contribution;
+    }
+    return result;
+}
 
-        if (no_intersection) {
-            Vector v_l = light.position - intersection.GetPosition();
-            Vector v_e = from - intersection.GetPosition();
-            v_l.Normalize();
-            v_e.Normalize();
+// Deterministic pseudo-random numbers (splitmix64), cheap to seed for every shading point.
+class RandomSequence {
+public:
+    explicit RandomSequence(uint64_t seed) : state_(seed) {
+    }
 
-            double diffuse = std::max(0.0, DotProduct(normal, v_l));
-            double specular = std::pow(std::max(0.0, DotProduct(v_e, Reflect(-1. * v_l, normal))),
-                                       material.specular_exponent);
-            result = result +
-                     material.albedo[0] * light.intensity *
-                         (diffuse * material.diffuse_color + specular * material.specular_color);
-        }
+    uint64_t Next() {
+        uint64_t x = (state_ += 0x9e3779b97f4a7c15ULL);
+        x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+        return x ^ (x >> 31);
+    }
+
+    // uniform in [0, 1)
+    double NextUniform() {
+        return static_cast<double>(Next() >> 11) * 0x1p-53;
+    }
+
+private:
+    uint64_t state_;
+};
+
+// Unbiased estimate of ComputeLights with at most samples shadow rays: samples lights are picked
+// at random, with probabilities roughly proportional to what they add unoccluded (the light tree
+// is walked down by the bounds of its groups, then the lights of a leaf are weighed exactly), and
+// each unoccluded one is weighted by the inverse of its probability. The picks are stratified and
+// come from random, so the same sequence gives the same estimate. Scenes with no more lights than
+// samples are lit exactly, by ComputeLights.
+Vector SampleLights(const PreparedScene& prepared, OcclusionCache* occlusion_cache,
+                    const Surface& surface, const Vector& from, int samples,
+                    RandomSequence* random) {
+    const Scene& scene = prepared.scene;
+    if (scene.GetLights().size() <= static_cast<size_t>(samples)) {
+        return ComputeLights(prepared, occlusion_cache, surface, from, 0);
     }
+    const Material& material = *surface.material;
+    Vector result = material.ambient_color + material.intensity;
 
+    std::vector<double>& u = occlusion_cache->GetSampleNumbers();
+    u.resize(samples);
+    for (int sample = 0; sample < samples; ++sample) {
+        u[sample] = (sample + random->NextUniform()) / samples;
+    }
+    UnoccludedLightBound bound(surface, from);
+    prepared.light_tree.SampleLights(
+        u,
+        [&](const BoundingBox& box, const Vector& total_intensity) {
+            Vector max_light = bound(box, total_intensity);
+            return max_light[0] + max_light[1] + max_light[2];
+        },
+        [&](uint32_t light_index) {
+            Vector light = GetUnoccludedLight(surface, from, scene.GetLights()[light_index]);
+            return std::fabs(light[0]) + std::fabs(light[1]) + std::fabs(light[2]);
+        },
+        [&](const LightSample& sample, size_t count) {
+            // one shadow ray for all the picks of the light
+            if (IsLit(prepared, occlusion_cache, surface, sample.light)) {
+                Vector light = GetUnoccludedLight(surface, from, scene.GetLights()[sample.light]);
+                result = result + (count / (samples * sample.probability)) * light;
+            }
+        });
     return result;
 }
 
-Vector SendRay(const Scene& scene, const RenderOptions& render_options, const Ray& ray, bool inside,
-               int level) {
-    if (level >= render_options.depth) {
-        return {0, 0, 0};
+// Ray of the ray tree waiting to be traced, with the weight of its radiance in the pixel and the
+// seed of the random choices at its hit.
+struct PendingRay {
+    Ray ray;
+    bool inside;
+    int level;
+    Scalar throughput;
+    uint64_t seed;
+};
+
+// Seed of the primary ray of a pixel, random choices depend on the pixel only.
+uint64_t GetPixelSeed(int i, int j) {
+    return static_cast<uint64_t>(i) << 32 | static_cast<uint32_t>(j);
+}
+
+// Reflected and refracted rays spawned by a hit, in the order depth-first tracing visits them.
+struct ChildRays {
+    std::array<PendingRay, 2> rays;
+    int count = 0;
+};
+
+// Light that the hit of a pending ray sends into the pixel, and the rays the depth and
+// render_options.min_throughput leave to trace from there: every path carries the product of the
+// albedo weights along it, and branches whose weight drops below the threshold are cut.
+Vector ShadeHit(const PreparedScene& prepared, OcclusionCache* occlusion_cache,
+                const RenderOptions& render_options, const PendingRay& pending, const Hit& hit,
+                ChildRays* children) {
+    auto traced = [&](Scalar throughput) {
+        return render_options.min_throughput < 0 ||
+               (throughput != 0 && throughput >= render_options.min_throughput);
+    };
+
+    const Ray& ray = pending.ray;
+    Surface surface = GetSurface(prepared.scene, ray, hit);
+    const Vector& normal = surface.normal;
+    const Material* material = surface.material;
+    RandomSequence random(pending.seed);
+    std::array<uint64_t, 2> seeds = {random.Next(), random.Next()};
+    Vector light = pending.throughput *
+                   (render_options.light_samples > 0
+                        ? SampleLights(prepared, occlusion_cache, surface, ray.GetOrigin(),
+                                       render_options.light_samples, &random)
+                        : ComputeLights(prepared, occlusion_cache, surface, ray.GetOrigin(),
+                                        render_options.light_tolerance));
+    children->count = 0;
+    if (pending.level + 1 >= render_options.depth) {
+        return light;
     }
-    bool intersection_found = false;
-    double distance;
-    Vector normal;
-    const Material* material;
-    Intersection result_intersection;
 
-    for (const SphereObject& object : scene.GetSphereObjects()) {
-        auto intersection = GetIntersection(ray, object.sphere);
-        if (!intersection.has_value()) {
-            continue;
-        }
-        if (!intersection_found ||
-            Length(ray.GetOrigin() - intersection.value().GetPosition()) < distance) {
-            intersection_found = true;
-            distance = Length(ray.GetOrigin() - intersection.value().GetPosition());
-            normal = intersection.value().GetNormal();
-            material = object.material;
-            result_intersection = {intersection.value().GetPosition(),
-                                   intersection.value().GetNormal(),
-                                   intersection.value().GetDistance()};
+    Vector vector = surface.position - ray.GetOrigin();
+    vector.Normalize();
+    int level = pending.level + 1;
+
+    if (pending.inside) {
+        Scalar throughput = pending.throughput * (material->albedo[1] + material->albedo[2]);
+        auto refracted = Refract(vector, normal, material->refraction_index);
+        if (refracted && traced(throughput)) {
+            children->rays[children->count++] = {
+                Ray(surface.position - kEps2 * normal, *refracted), false, level, throughput,
+                seeds[0]};
         }
+        return light;
     }
 
-    for (const Object& object : scene.GetObjects()) {
-        std::optional<Intersection> intersection = GetIntersection(ray, object.polygon);
-        if (!intersection.has_value()) {
+    Scalar refracted_throughput = pending.throughput * material->albedo[2];
+    auto refracted = Refract(vector, normal, 1 / material->refraction_index);
+    if (refracted && traced(refracted_throughput)) {
+        children->rays[children->count++] = {Ray(surface.position - kEps2 * normal, *refracted),
+                                             true, level, refracted_throughput, seeds[0]};
+    }
+    Scalar reflected_throughput = pending.throughput * material->albedo[1];
+    if (traced(reflected_throughput)) {
+        children->rays[children->count++] = {
+            Ray(surface.position + kEps2 * normal, Reflect(vector, normal)), false, level,
+            reflected_throughput, seeds[1]};
+    }
+    return light;
+}
+
+// Per-worker state of SendRay: the stack of pending rays, reserved once for the deepest tree a
+// render can have, the light gathered at every depth of the current tree and the number of rays
+// traced at every depth.
+class RayTree {
+public:
+    explicit RayTree(int depth)
+        : light_per_depth_(std::max(depth, 0)), rays_per_depth_(std::max(depth, 0)) {
+        // every traced ray replaces itself with at most two children
+        stack_.reserve(std::max(depth, 0) + 1);
+    }
+
+    std::vector<PendingRay>& GetStack() {
+        return stack_;
+    }
+    std::vector<Vector>& GetLightPerDepth() {
+        return light_per_depth_;
+    }
+    void CountRay(int level) {
+        ++rays_per_depth_[level];
+    }
+    const std::vector<uint64_t>& GetRaysPerDepth() const {
+        return rays_per_depth_;
+    }
+
+private:
+    std::vector<PendingRay> stack_;
+    std::vector<Vector> light_per_depth_;
+    std::vector<uint64_t> rays_per_depth_;
+};
+
+// Radiance along the ray: light at the first hit plus, for as long as the depth allows,
+// reflected and refracted rays weighted by the albedo of the surface. The tree is walked with
+// an explicit stack; light is summed depth by depth, in the order the wavefront engine sums it,
+// so both give the same image. primary_hit is the closest hit of primary_ray, found beforehand
+// with the rest of its packet.
+Vector SendRay(const PreparedScene& prepared, OcclusionCache* occlusion_cache, RayTree* tree,
+               const RenderOptions& render_options, const Ray& primary_ray, uint64_t seed,
+               const std::optional<Hit>& primary_hit) {
+    std::vector<Vector>& light_per_depth = tree->GetLightPerDepth();
+    std::fill(light_per_depth.begin(), light_per_depth.end(), Vector{0, 0, 0});
+    std::vector<PendingRay>& stack = tree->GetStack();
+    stack.clear();
+    if (render_options.depth > 0) {
+        stack.push_back({primary_ray, false, 0, 1, seed});
+    }
+    ChildRays children;
+    while (!stack.empty()) {
+        PendingRay pending = stack.back();
+        stack.pop_back();
+        tree->CountRay(pending.level);
+
+        auto hit = pending.level == 0 ? primary_hit : FindClosestHit(prepared, pending.ray);
+        if (!hit) {
             continue;
         }
-        if (!intersection_found ||
-            Length(ray.GetOrigin() - intersection.value().GetPosition()) < distance) {
-            intersection_found = true;
-            distance = Length(ray.GetOrigin() - intersection.value().GetPosition());
-
-            if (NormalZeros(object)) {
-                normal = intersection.value().GetNormal();
-            } else {
-                normal = {0, 0, 0};
-                Vector barycentric =
-                    GetBarycentricCoords(object.polygon, intersection.value().GetPosition());
-                for (int k = 0; k < 3; ++k) {
-                    normal = normal + barycentric[k] * (*object.GetNormal(k));
-                }
-            }
-            material = object.material;
-            result_intersection = {intersection.value().GetPosition(),
-                                   intersection.value().GetNormal(),
-                                   intersection.value().GetDistance()};
+        Vector& light = light_per_depth[pending.level];
+        light = light + ShadeHit(prepared, occlusion_cache, render_options, pending, *hit,
+                                 &children);
+        for (int i = children.count; i-- > 0;) {
+            stack.push_back(children.rays[i]);
         }
     }
 
-    if (!intersection_found) {
-        return {0, 0, 0};
+    Vector result = {0, 0, 0};
+    for (const Vector& light : light_per_depth) {
+        result = result + light;
     }
+    return result;
+}
 
-    Vector vector = result_intersection.GetPosition() - ray.GetOrigin();
-    vector.Normalize();
-    Vector reflected = Reflect(vector, normal);
-
-    if (inside) {
-        Vector refracted = *Refract(vector, normal, material->refraction_index);
-        return ComputeLights(scene, result_intersection, *material, normal, ray.GetOrigin()) +
-               (material->albedo[1] + material->albedo[2]) *
-                   SendRay(scene, render_options,
-                           Ray(result_intersection.GetPosition() - kEps2 * normal, refracted),
-                           false, level + 1);
-    }
-
-    Vector refracted = *Refract(vector, normal, 1 / material->refraction_index);
-    return ComputeLights(scene, result_intersection, *material, normal, ray.GetOrigin()) +
-           material->albedo[1] *
-               SendRay(scene, render_options,
-                       Ray(result_intersection.GetPosition() + kEps2 * normal, reflected), false,
-                       level + 1) +
-           material->albedo[2] *
-               SendRay(scene, render_options,
-                       Ray(result_intersection.GetPosition() - kEps2 * normal, refracted), true,
-                       level + 1);
-}
-
-void PostProcessing(std::vector<std::vector<Vector>>* img) {
-    // post processing
-    double max_value = 0;
-    for (size_t i = 0; i < img->size(); ++i) {
-        for (size_t j = 0; j < (*img)[0].size(); ++j) {
+// Brightest channel of the radiance in img.
+double GetMaxValue(const std::vector<std::vector<Vector>>& img, ThreadPool* pool) {
+    std::vector<double> max_values(pool->Size(), 0);
+    pool->ParallelFor(img.size(), [&](size_t i, size_t worker) {
+        for (size_t j = 0; j < img[i].size(); ++j) {
             for (int k = 0; k < 3; ++k) {
-                if ((*img)[i][j][k] > max_value) {
-                    max_value = (*img)[i][j][k];
+                if (img[i][j][k] > max_values[worker]) {
+                    max_values[worker] = img[i][j][k];
                 }
             }
         }
-    }
-    for (size_t i = 0; i < img->size(); ++i) {
-        for (size_t j = 0; j < (*img)[0].size(); ++j) {
+    });
+    return *std::max_element(max_values.begin(), max_values.end());
+}
+
+// Maps the radiance in img to colours, max_value to white; brighter channels go past 1.
+void ToneMap(std::vector<std::vector<Vector>>* img, double max_value, ThreadPool* pool) {
+    pool->ParallelFor(img->size(), [&](size_t i, size_t) {
+        for (size_t j = 0; j < (*img)[i].size(); ++j) {
             (*img)[i][j] = (*img)[i][j] *
                            (Vector{1, 1, 1} + (*img)[i][j] / Vector{max_value * max_value,
                                                                     max_value * max_value,
                                                                     max_value * max_value}) /
                            (Vector{1, 1, 1} + (*img)[i][j]);
-        }
-    }
 
-    // gamma
-    for (size_t i = 0; i < img->size(); ++i) {
-        for (size_t j = 0; j < (*img)[0].size(); ++j) {
+            // gamma
             for (int k = 0; k < 3; ++k) {
                 (*img)[i][j][k] = std::pow((*img)[i][j][k], 1 / 2.2);
             }
         }
-    }
+    });
+}
+
+void PostProcessing(std::vector<std::vector<Vector>>* img, ThreadPool* pool) {
+    ToneMap(img, GetMaxValue(*img, pool), pool);
 }
 
 Image ImgToImage(const std::vector<std::vector<Vector>>& img, int width, int height) {
@@ -355,39 +749,852 @@ Image ImgToImage(const std::vector<std::vector<Vector>>& img, int width, int hei
     return image;
 }
 
-Image RenderFull(const std::string& filename, const CameraOptions& camera_options,
-                 const RenderOptions& render_options) {
-    Scene scene = ReadScene(filename);
+// Buffers of RenderOutputs, indexed [x][y]; the ones not asked for stay empty. Pixels whose
+// primary ray hits nothing get an infinite depth, zero normal and albedo, kNoPrimitive and
+// kNoMaterial.
+struct OutputBuffers {
+    std::optional<Image> color;
+    std::vector<std::vector<float>> depth;
+    std::vector<std::vector<Vector>> normal;
+    std::vector<std::vector<Vector>> albedo;
+    std::vector<std::vector<uint32_t>> primitive;
+    std::vector<std::vector<uint16_t>> material;
+};
 
-    auto ray_directions = ComputeRayDirections(camera_options);
-    std::vector<std::vector<Vector>> img(camera_options.screen_width,
-                                         std::vector<Vector>(camera_options.screen_height));
+// Buffers of the outputs allocated, but the color.
+OutputBuffers MakeOutputBuffers(uint32_t outputs, int width, int height) {
+    auto make = [&](auto* buffer, auto value) {
+        buffer->assign(width, std::vector<decltype(value)>(height, value));
+    };
+    OutputBuffers buffers;
+    if (outputs & kOutputDepth) {
+        make(&buffers.depth, std::numeric_limits<float>::infinity());
+    }
+    if (outputs & kOutputNormal) {
+        make(&buffers.normal, Vector{0, 0, 0});
+    }
+    if (outputs & kOutputAlbedo) {
+        make(&buffers.albedo, Vector{0, 0, 0});
+    }
+    if (outputs & kOutputPrimitive) {
+        make(&buffers.primitive, kNoPrimitive);
+        make(&buffers.material, kNoMaterial);
+    }
+    return buffers;
+}
 
-    for (int i = 0; i != camera_options.screen_width; ++i) {
-        for (int j = 0; j != camera_options.screen_height; ++j) {
-            Ray ray(Vector(camera_options.look_from), ray_directions[i][j]);
-            img[i][j] = SendRay(scene, render_options, ray, false, 0);
+// Stores what the primary ray of pixel (i, j) hit in the buffers allocated.
+void RecordPrimaryHit(const PreparedScene& prepared, const Ray& ray, const std::optional<Hit>& hit,
+                      int i, int j, OutputBuffers* buffers) {
+    if (!hit) {
+        return;
+    }
+    if (!buffers->depth.empty()) {
+        buffers->depth[i][j] = hit->record.distance;
+    }
+    if (!buffers->normal.empty() || !buffers->albedo.empty()) {
+        Surface surface = GetSurface(prepared.scene, ray, *hit);
+        if (!buffers->normal.empty()) {
+            buffers->normal[i][j] = surface.normal;
+        }
+        if (!buffers->albedo.empty()) {
+            buffers->albedo[i][j] = surface.material->diffuse_color;
+        }
+    }
+    if (!buffers->primitive.empty()) {
+        const Scene& scene = prepared.scene;
+        uint32_t primitive = hit->primitive;
+        buffers->primitive[i][j] = primitive;
+        buffers->material[i][j] =
+            IsSphere(scene, primitive)
+                ? scene.GetSphereObjects()[primitive].material
+                : scene.GetMesh().triangles[primitive - scene.GetSphereObjects().size()].material;
+    }
+}
+
+// Walks the ray tree of every pixel of the grid depth first with SendRay, packet by packet. The
+// primary hits also go to buffers, if given.
+void TraceDepthFirst(const PreparedScene& prepared, const CameraOptions& camera_options,
+                     const RenderOptions& render_options, const ScreenRays& screen,
+                     ThreadPool* pool, std::vector<std::vector<Vector>>* img,
+                     std::vector<uint64_t>* rays_per_depth, const PixelGrid& grid = {},
+                     OutputBuffers* buffers = nullptr) {
+    std::vector<OcclusionCache> occlusion_caches(
+        pool->Size(), OcclusionCache(prepared.scene.GetLights().size()));
+    std::vector<RayTree> trees(pool->Size(), RayTree(render_options.depth));
+    std::vector<PacketHits> hits(pool->Size());
+    ForEachPacket(pool, camera_options, render_options, screen,
+                  [&](RayPacket* packet, const PacketPixels& pixels, size_t worker) {
+                      FindClosestHits(prepared, packet, &hits[worker]);
+                      for (size_t k = 0; k < packet->Size(); ++k) {
+                          auto [i, j] = pixels[k];
+                          if (buffers) {
+                              RecordPrimaryHit(prepared, packet->GetRay(k), hits[worker][k], i, j,
+                                               buffers);
+                          }
+                          (*img)[i][j] =
+                              SendRay(prepared, &occlusion_caches[worker], &trees[worker],
+                                      render_options, packet->GetRay(k),
+                                      GetPixelSeed(i, j + screen.GetFirstRow()), hits[worker][k]);
+                      }
+                  },
+                  grid);
+    for (const RayTree& tree : trees) {
+        for (size_t level = 0; level < tree.GetRaysPerDepth().size(); ++level) {
+            (*rays_per_depth)[level] += tree.GetRaysPerDepth()[level];
+        }
+    }
+}
+
+// Wavefront tracing: instead of walking the ray tree of one pixel after another, every bounce
+// is traced for many pixels at once. The rays of a bounce form a stream that is sorted so that
+// rays starting close together and going the same way are neighbours, traced in packets, and
+// shaded in a separate pass; the reflected and refracted rays of the hits form the stream of the
+// next bounce. Sorting only permutes the order rays are traced and shaded in: the stream itself
+// keeps the rays of every pixel in the order SendRay visits them, and light is summed in that
+// order, so the image is the same as the depth-first one.
+
+// pixels traced together, bounds the memory taken by the streams
+constexpr size_t kWavefrontPixels = 1 << 16;
+// rays traced or shaded by one task of the pool
+constexpr size_t kWavefrontBatch = 4 * kPacketSize;
+
+struct StreamRay {
+    PendingRay pending;
+    uint32_t pixel;  // among the pixels of the wavefront
+};
+
+// Sort key of a stream ray: the octant of its direction, then the Morton code of its origin on a
+// 512^3 grid over bounds.
+uint32_t GetStreamKey(const Ray& ray, const BoundingBox& bounds) {
+    uint32_t key = 0;
+    std::array<uint32_t, 3> cells;
+    for (int axis = 0; axis < 3; ++axis) {
+        key = key << 1 | (ray.GetDirection()[axis] < 0);
+        Scalar low = bounds.GetMin()[axis];
+        Scalar cell = (ray.GetOrigin()[axis] - low) / (bounds.GetMax()[axis] - low) * 512;
+        // NaN of empty or flat bounds goes to the first cell
+        cells[axis] = cell > 0 ? static_cast<uint32_t>(std::min<Scalar>(cell, 511)) : 0;
+    }
+    for (int bit = 8; bit >= 0; --bit) {
+        for (int axis = 0; axis < 3; ++axis) {
+            key = key << 1 | (cells[axis] >> bit & 1);
+        }
+    }
+    return key;
+}
+
+// Sorts key << 32 | index values by key, three least significant digit radix passes over the 30
+// key bits. Passes are stable, so equal keys keep their index order.
+void SortStreamOrder(std::vector<uint64_t>* order, std::vector<uint64_t>* scratch) {
+    constexpr int kDigitBits = 10;
+    scratch->resize(order->size());
+    for (int shift = 32; shift < 32 + 3 * kDigitBits; shift += kDigitBits) {
+        std::array<size_t, (1 << kDigitBits) + 1> offsets{};
+        for (uint64_t value : *order) {
+            ++offsets[(value >> shift & ((1 << kDigitBits) - 1)) + 1];
+        }
+        for (size_t digit = 1; digit < offsets.size(); ++digit) {
+            offsets[digit] += offsets[digit - 1];
+        }
+        for (uint64_t value : *order) {
+            (*scratch)[offsets[value >> shift & ((1 << kDigitBits) - 1)]++] = value;
+        }
+        std::swap(*order, *scratch);
+    }
+}
+
+// Per-worker state of the wavefront passes.
+struct WavefrontWorker {
+    OcclusionCache occlusion_cache;
+    RayPacket packet = {};
+    PacketHits hits = {};
+};
+
+// Same result as TraceDepthFirst, computed bounce by bounce for kWavefrontPixels pixels at a
+// time.
+void TraceWavefronts(const PreparedScene& prepared, const CameraOptions& camera_options,
+                     const RenderOptions& render_options, const ScreenRays& screen,
+                     ThreadPool* pool, std::vector<std::vector<Vector>>* img,
+                     std::vector<uint64_t>* rays_per_depth, const PixelGrid& grid = {}) {
+    // pixels in the order of the primary ray packets, the first bounce is as coherent as they are
+    std::vector<Pixel> pixels;
+    for (const Tile& tile : SplitIntoTiles(camera_options, render_options, grid)) {
+        ForEachPixelSquare(tile, grid, [&](const PacketPixels& square, size_t count) {
+            pixels.insert(pixels.end(), square.begin(), square.begin() + count);
+        });
+    }
+
+    BoundingBox bounds;
+    if (!prepared.bvh.GetNodes().empty()) {
+        bounds = prepared.bvh.GetNodes()[0].box;
+    }
+    std::vector<WavefrontWorker> workers(
+        pool->Size(), WavefrontWorker{OcclusionCache(prepared.scene.GetLights().size())});
+    std::vector<StreamRay> stream;
+    std::vector<StreamRay> next_stream;
+    std::vector<uint64_t> order;  // key << 32 | index into the stream, sorted
+    std::vector<uint64_t> sort_scratch;
+    std::vector<StreamRay> sorted_stream;
+    std::vector<uint32_t> ranks;
+    std::vector<std::optional<Hit>> hits;
+    std::vector<Vector> lights;
+    std::vector<ChildRays> children;
+    std::vector<Vector> pixel_lights;
+    std::vector<Vector> results;
+
+    for (size_t first = 0; first < pixels.size(); first += kWavefrontPixels) {
+        size_t pixel_count = std::min(kWavefrontPixels, pixels.size() - first);
+        results.assign(pixel_count, {0, 0, 0});
+        stream.clear();
+        if (render_options.depth > 0) {
+            for (size_t pixel = 0; pixel < pixel_count; ++pixel) {
+                auto [i, j] = pixels[first + pixel];
+                Ray ray(Vector(camera_options.look_from), screen.GetPixelDirection(i, j));
+                stream.push_back({{ray, false, 0, 1, GetPixelSeed(i, j + screen.GetFirstRow())},
+                                  static_cast<uint32_t>(pixel)});
+            }
+        }
+
+        for (int level = 0; !stream.empty(); ++level) {
+            (*rays_per_depth)[level] += stream.size();
+            order.resize(stream.size());
+            for (size_t index = 0; index < stream.size(); ++index) {
+                order[index] =
+                    static_cast<uint64_t>(GetStreamKey(stream[index].pending.ray, bounds)) << 32 |
+                    index;
+            }
+            SortStreamOrder(&order, &sort_scratch);
+            // the passes run over a sorted copy of the stream, ranks map rays back to it
+            sorted_stream.resize(stream.size());
+            ranks.resize(stream.size());
+            for (size_t k = 0; k < order.size(); ++k) {
+                auto index = static_cast<uint32_t>(order[k]);
+                sorted_stream[k] = stream[index];
+                ranks[index] = k;
+            }
+
+            size_t batches = (stream.size() + kWavefrontBatch - 1) / kWavefrontBatch;
+            hits.resize(stream.size());
+            pool->ParallelFor(batches, [&](size_t batch, size_t worker) {
+                WavefrontWorker& state = workers[worker];
+                size_t end = std::min((batch + 1) * kWavefrontBatch, stream.size());
+                for (size_t begin = batch * kWavefrontBatch; begin < end; begin += kPacketSize) {
+                    size_t packet_end = std::min(begin + kPacketSize, end);
+                    state.packet.Clear();
+                    for (size_t k = begin; k < packet_end; ++k) {
+                        state.packet.Add(sorted_stream[k].pending.ray);
+                    }
+                    FindClosestHits(prepared, &state.packet, &state.hits);
+                    std::copy(state.hits.begin(), state.hits.begin() + (packet_end - begin),
+                              hits.begin() + begin);
+                }
+            });
+
+            lights.resize(stream.size());
+            children.resize(stream.size());
+            pool->ParallelFor(batches, [&](size_t batch, size_t worker) {
+                WavefrontWorker& state = workers[worker];
+                size_t end = std::min((batch + 1) * kWavefrontBatch, stream.size());
+                for (size_t k = batch * kWavefrontBatch; k < end; ++k) {
+                    children[k].count = 0;
+                    if (hits[k]) {
+                        lights[k] = ShadeHit(prepared, &state.occlusion_cache, render_options,
+                                             sorted_stream[k].pending, *hits[k], &children[k]);
+                    }
+                }
+            });
+
+            // light and the next bounce are gathered in stream order
+            pixel_lights.assign(pixel_count, {0, 0, 0});
+            next_stream.clear();
+            for (size_t index = 0; index < stream.size(); ++index) {
+                uint32_t k = ranks[index];
+                if (!hits[k]) {
+                    continue;
+                }
+                uint32_t pixel = stream[index].pixel;
+                pixel_lights[pixel] = pixel_lights[pixel] + lights[k];
+                for (int child = 0; child < children[k].count; ++child) {
+                    next_stream.push_back({children[k].rays[child], pixel});
+                }
+            }
+            for (size_t pixel = 0; pixel < pixel_count; ++pixel) {
+                results[pixel] = results[pixel] + pixel_lights[pixel];
+            }
+            std::swap(stream, next_stream);
+        }
+
+        for (size_t pixel = 0; pixel < pixel_count; ++pixel) {
+            auto [i, j] = pixels[first + pixel];
+            (*img)[i][j] = results[pixel];
+        }
+    }
+}
+
+// Traces the pixels of the grid with the engine render_options ask for. Filling buffers takes
+// the depth-first engine, whose image is the same.
+void TracePixels(const PreparedScene& prepared, const CameraOptions& camera_options,
+                 const RenderOptions& render_options, const ScreenRays& screen,
+                 ThreadPool* pool, std::vector<std::vector<Vector>>* img,
+                 std::vector<uint64_t>* rays_per_depth, const PixelGrid& grid = {},
+                 OutputBuffers* buffers = nullptr) {
+    if (render_options.wavefront && !buffers) {
+        TraceWavefronts(prepared, camera_options, render_options, screen, pool, img,
+                        rays_per_depth, grid);
+    } else {
+        TraceDepthFirst(prepared, camera_options, render_options, screen, pool, img,
+                        rays_per_depth, grid, buffers);
+    }
+}
+
+// Adaptive anti-aliasing: every pixel starts with the sample at its centre; pixels whose colour
+// differs from a neighbour's get kFirstSamples, and those whose samples still disagree get up to
+// render_options.max_samples. Samples beyond the first go through the points of the R2 sequence
+// and have seeds of their own, so the image doesn't depend on the threads or the tracing engine.
+
+// samples of the pixels that go on an edge, before looking at how much they disagree
+constexpr int kFirstSamples = 4;
+
+// Position of the sample-th sample in its pixel: the centre, then the R2 low-discrepancy
+// sequence, which covers the pixel evenly however many samples are taken.
+std::array<double, 2> GetSampleOffset(int sample) {
+    // 1 / g and 1 / g^2 for the plastic number g, g^3 = g + 1
+    constexpr double kAlpha1 = 0.7548776662466927;
+    constexpr double kAlpha2 = 0.5698402909980532;
+    double x = 0.5 + sample * kAlpha1;
+    double y = 0.5 + sample * kAlpha2;
+    return {x - std::floor(x), y - std::floor(y)};
+}
+
+// Seed of the sample-th primary ray of a pixel, GetPixelSeed for the first one. The others go
+// through a splitmix64 step of the pixel seed, which spreads the pixels over all 64 bits however
+// wide the screen, before the sample number is mixed in.
+uint64_t GetSampleSeed(int i, int j, int sample) {
+    uint64_t seed = GetPixelSeed(i, j);
+    if (sample == 0) {
+        return seed;
+    }
+    return RandomSequence(seed).Next() ^ static_cast<uint64_t>(sample);
+}
+
+// Colour as anti-aliasing compares it, every channel mapped to (-1, 1).
+Vector GetDisplayColor(const Vector& radiance) {
+    Vector color;
+    for (int k = 0; k < 3; ++k) {
+        color[k] = radiance[k] / (1 + std::fabs(radiance[k]));
+    }
+    return color;
+}
+
+bool IsContrasted(const Vector& lhs, const Vector& rhs, double threshold) {
+    for (int k = 0; k < 3; ++k) {
+        if (!(std::fabs(lhs[k] - rhs[k]) <= threshold)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+struct PixelSample {
+    Pixel pixel;
+    int sample;
+};
+
+// Radiance of every sample, traced depth first in packets of consecutive samples.
+void TraceSamples(const PreparedScene& prepared, const CameraOptions& camera_options,
+                  const RenderOptions& render_options, const ScreenRays& screen,
+                  const std::vector<PixelSample>& samples, ThreadPool* pool,
+                  std::vector<Vector>* radiance, std::vector<uint64_t>* rays_per_depth) {
+    radiance->resize(samples.size());
+    std::vector<OcclusionCache> occlusion_caches(
+        pool->Size(), OcclusionCache(prepared.scene.GetLights().size()));
+    std::vector<RayTree> trees(pool->Size(), RayTree(render_options.depth));
+    std::vector<RayPacket> packets(pool->Size());
+    std::vector<PacketHits> hits(pool->Size());
+    size_t packet_count = (samples.size() + kPacketSize - 1) / kPacketSize;
+    pool->ParallelFor(packet_count, [&](size_t index, size_t worker) {
+        size_t begin = index * kPacketSize;
+        size_t end = std::min(begin + kPacketSize, samples.size());
+        RayPacket& packet = packets[worker];
+        packet.Clear();
+        for (size_t k = begin; k < end; ++k) {
+            auto [pixel, sample] = samples[k];
+            auto [x, y] = GetSampleOffset(sample);
+            packet.Add(Ray(Vector(camera_options.look_from),
+                           screen.GetDirection(pixel.i + x, pixel.j + y)));
+        }
+        FindClosestHits(prepared, &packet, &hits[worker]);
+        for (size_t k = begin; k < end; ++k) {
+            auto [pixel, sample] = samples[k];
+            (*radiance)[k] = SendRay(prepared, &occlusion_caches[worker], &trees[worker],
+                                     render_options, packet.GetRay(k - begin),
+                                     GetSampleSeed(pixel.i, pixel.j + screen.GetFirstRow(),
+                                                   sample),
+                                     hits[worker][k - begin]);
+        }
+    });
+    for (const RayTree& tree : trees) {
+        for (size_t level = 0; level < tree.GetRaysPerDepth().size(); ++level) {
+            (*rays_per_depth)[level] += tree.GetRaysPerDepth()[level];
+        }
+    }
+}
+
+// Refines img, holding the radiance at the centre of every pixel, into the average of the
+// samples adaptive anti-aliasing takes; samples_per_pixel gets their counts.
+void SamplePixels(const PreparedScene& prepared, const CameraOptions& camera_options,
+                  const RenderOptions& render_options, const ScreenRays& screen,
+                  ThreadPool* pool, std::vector<std::vector<Vector>>* img,
+                  std::vector<uint64_t>* rays_per_depth,
+                  std::vector<std::vector<int>>* samples_per_pixel) {
+    int width = camera_options.screen_width;
+    int height = camera_options.screen_height;
+    double threshold = render_options.antialiasing_threshold;
+    samples_per_pixel->assign(width, std::vector<int>(height, 1));
+    if (render_options.max_samples <= 1) {
+        return;
+    }
+
+    std::vector<std::vector<char>> on_edge(width, std::vector<char>(height, threshold < 0));
+    for (int i = 0; i < width; ++i) {
+        for (int j = 0; j < height; ++j) {
+            Vector color = GetDisplayColor((*img)[i][j]);
+            if (i + 1 < width &&
+                IsContrasted(color, GetDisplayColor((*img)[i + 1][j]), threshold)) {
+                on_edge[i][j] = on_edge[i + 1][j] = true;
+            }
+            if (j + 1 < height &&
+                IsContrasted(color, GetDisplayColor((*img)[i][j + 1]), threshold)) {
+                on_edge[i][j] = on_edge[i][j + 1] = true;
+            }
+        }
+    }
+    std::vector<Pixel> pixels;
+    for (int i = 0; i < width; ++i) {
+        for (int j = 0; j < height; ++j) {
+            if (on_edge[i][j]) {
+                pixels.push_back({i, j});
+            }
+        }
+    }
+
+    // sums of the samples, and their lowest and highest colours
+    std::vector<std::vector<Vector>> sums = *img;
+    std::vector<std::vector<Vector>> lows(width, std::vector<Vector>(height));
+    std::vector<std::vector<Vector>> highs(width, std::vector<Vector>(height));
+    for (auto [i, j] : pixels) {
+        lows[i][j] = highs[i][j] = GetDisplayColor((*img)[i][j]);
+    }
+    std::vector<PixelSample> samples;
+    std::vector<Vector> radiance;
+    // samples [first, last) of the pixels
+    auto add_samples = [&](int first, int last) {
+        samples.clear();
+        for (const Pixel& pixel : pixels) {
+            for (int sample = first; sample < last; ++sample) {
+                samples.push_back({pixel, sample});
+            }
+        }
+        TraceSamples(prepared, camera_options, render_options, screen, samples, pool, &radiance,
+                     rays_per_depth);
+        for (size_t k = 0; k < samples.size(); ++k) {
+            auto [i, j] = samples[k].pixel;
+            sums[i][j] = sums[i][j] + radiance[k];
+            Vector color = GetDisplayColor(radiance[k]);
+            for (int c = 0; c < 3; ++c) {
+                lows[i][j][c] = std::min(lows[i][j][c], color[c]);
+                highs[i][j][c] = std::max(highs[i][j][c], color[c]);
+            }
+        }
+        for (auto [i, j] : pixels) {
+            (*samples_per_pixel)[i][j] = last;
+        }
+    };
+
+    int first_samples = std::min(kFirstSamples, render_options.max_samples);
+    add_samples(1, first_samples);
+    std::erase_if(pixels, [&](const Pixel& pixel) {
+        return !IsContrasted(lows[pixel.i][pixel.j], highs[pixel.i][pixel.j], threshold);
+    });
+    add_samples(first_samples, render_options.max_samples);
+
+    pool->ParallelFor(width, [&](size_t i, size_t) {
+        for (int j = 0; j < height; ++j) {
+            int count = (*samples_per_pixel)[i][j];
+            if (count > 1) {
+                (*img)[i][j] = static_cast<Scalar>(1) / count * sums[i][j];
+            }
         }
+    });
+}
+
+// buffers, if given, get the primary hits.
+Image RenderFull(const PreparedScene& prepared, const CameraOptions& camera_options,
+                 const RenderOptions& render_options, ThreadPool* pool, RenderStats* stats,
+                 OutputBuffers* buffers = nullptr) {
+    ScreenRays screen(camera_options);
+    std::vector<std::vector<Vector>> img(camera_options.screen_width,
+                                         std::vector<Vector>(camera_options.screen_height));
+    std::vector<uint64_t> rays_per_depth(std::max(render_options.depth, 0));
+    TracePixels(prepared, camera_options, render_options, screen, pool, &img, &rays_per_depth,
+                {}, buffers);
+    std::vector<std::vector<int>> samples_per_pixel;
+    SamplePixels(prepared, camera_options, render_options, screen, pool, &img, &rays_per_depth,
+                 &samples_per_pixel);
+    if (stats) {
+        stats->rays_per_depth = std::move(rays_per_depth);
+        stats->samples_per_pixel = std::move(samples_per_pixel);
     }
 
-    PostProcessing(&img);
+    PostProcessing(&img, pool);
 
     return ImgToImage(img, camera_options.screen_width, camera_options.screen_height);
 }
 
-Image Render(const std::string& filename, const CameraOptions& camera_options,
-             const RenderOptions& render_options) {
+// Renders the prepared scene on the pool, render_options.threads is not looked at.
+Image RenderPrepared(const PreparedScene& prepared, const CameraOptions& camera_options,
+                     const RenderOptions& render_options, ThreadPool* pool, RenderStats* stats) {
     if (render_options.mode == RenderMode::kDepth) {
-        return RenderDepth(filename, camera_options);
+        return RenderDepth(prepared, camera_options, render_options, pool);
     }
     if (render_options.mode == RenderMode::kNormal) {
         // throw std::runtime_error("not implemented yet");
-        return RenderNormal(filename, camera_options);
+        return RenderNormal(prepared, camera_options, render_options, pool);
     }
 
     if (render_options.mode == RenderMode::kFull) {
         // throw std::runtime_error("not implemented");
-        return RenderFull(filename, camera_options, render_options);
+        return RenderFull(prepared, camera_options, render_options, pool, stats);
     }
     throw std::runtime_error("not implemented, and never gonna be");
 }
+
+// Prepared scene of a scene made in code, e.g. with SceneBuilder, for the render functions that
+// take one. It can be rendered any number of times, from any number of threads.
+std::shared_ptr<const PreparedScene> Prepare(Scene scene) {
+    return std::make_shared<const PreparedScene>(PrepareScene(std::move(scene)));
+}
+
+// stats, if given, is filled for full renders. cache_directory and reuse_scenes of render_options
+// are not looked at.
+Image Render(const std::shared_ptr<const PreparedScene>& prepared,
+             const CameraOptions& camera_options, const RenderOptions& render_options,
+             RenderStats* stats = nullptr) {
+    ThreadPool pool(render_options.threads);
+    return RenderPrepared(*prepared, camera_options, render_options, &pool, stats);
+}
+
+// stats, if given, is filled for full renders.
+Image Render(const std::string& filename, const CameraOptions& camera_options,
+             const RenderOptions& render_options, RenderStats* stats = nullptr) {
+    return Render(GetPreparedScene(filename, render_options), camera_options, render_options,
+                  stats);
+}
+
+// Fills the buffers render_options.outputs asks for, tracing the primary rays once for all of
+// them. The color is the image of a full render whatever the mode; the other buffers come from
+// the primary rays through the centres of the pixels, whatever anti-aliasing adds. Without the
+// color only primary rays are traced. stats, if given, is filled when the color is rendered.
+OutputBuffers RenderOutputs(const std::shared_ptr<const PreparedScene>& prepared,
+                            const CameraOptions& camera_options,
+                            const RenderOptions& render_options, RenderStats* stats = nullptr) {
+    ThreadPool pool(render_options.threads);
+    OutputBuffers buffers = MakeOutputBuffers(
+        render_options.outputs, camera_options.screen_width, camera_options.screen_height);
+    if (render_options.outputs & kOutputColor) {
+        buffers.color =
+            RenderFull(*prepared, camera_options, render_options, &pool, stats, &buffers);
+        return buffers;
+    }
+    if (render_options.outputs == 0) {
+        return buffers;
+    }
+    ScreenRays screen(camera_options);
+    std::vector<PacketHits> hits(pool.Size());
+    ForEachPacket(&pool, camera_options, render_options, screen,
+                  [&](RayPacket* packet, const PacketPixels& pixels, size_t worker) {
+                      FindClosestHits(*prepared, packet, &hits[worker]);
+                      for (size_t k = 0; k < packet->Size(); ++k) {
+                          auto [i, j] = pixels[k];
+                          RecordPrimaryHit(*prepared, packet->GetRay(k), hits[worker][k], i, j,
+                                           &buffers);
+                      }
+                  });
+    return buffers;
+}
+
+OutputBuffers RenderOutputs(const std::string& filename, const CameraOptions& camera_options,
+                            const RenderOptions& render_options, RenderStats* stats = nullptr) {
+    return RenderOutputs(GetPreparedScene(filename, render_options), camera_options,
+                         render_options, stats);
+}
+
+// side, in pixels, of the render that estimates the exposure of RenderToPng
+constexpr int kExposurePrepassSide = 128;
+
+// Radiance RenderToPng maps to white: render_options.white_radiance if set, else the brightest
+// channel of a render of the view at most kExposurePrepassSide pixels across, with a sample per
+// pixel. Highlights smaller than its pixels may be missed, they saturate.
+double GetWhiteRadiance(const PreparedScene& prepared, const CameraOptions& camera_options,
+                        const RenderOptions& render_options, ThreadPool* pool) {
+    if (render_options.white_radiance > 0) {
+        return render_options.white_radiance;
+    }
+    int side = std::max(camera_options.screen_width, camera_options.screen_height);
+    int scale = (side + kExposurePrepassSide - 1) / kExposurePrepassSide;
+    CameraOptions prepass = camera_options;
+    prepass.screen_width = std::max(camera_options.screen_width / scale, 1);
+    prepass.screen_height = std::max(camera_options.screen_height / scale, 1);
+    std::vector<std::vector<Vector>> img(prepass.screen_width,
+                                         std::vector<Vector>(prepass.screen_height));
+    std::vector<uint64_t> rays_per_depth(std::max(render_options.depth, 0));
+    TracePixels(prepared, prepass, render_options, ScreenRays(prepass), pool, &img,
+                &rays_per_depth);
+    return GetMaxValue(img, pool);
+}
+
+// Full render written to a PNG file a band of render_options.band_height rows at a time: every
+// band is traced, anti-aliased, tone mapped and written before the next one starts, and primary
+// rays are made as they are traced, so memory grows with the width of the image and the height
+// of the bands rather than with the image. The exposure is fixed beforehand by GetWhiteRadiance;
+// with white_radiance set to the brightest channel of the render the file holds the image Render
+// gives. Anti-aliasing traces the rows next to a band again to compare pixels across its edges.
+// render_options.mode is not looked at. stats, if given, gets the rays of the bands;
+// samples_per_pixel, which would take a full frame, is left empty.
+void RenderToPng(const std::shared_ptr<const PreparedScene>& prepared,
+                 const CameraOptions& camera_options, const RenderOptions& render_options,
+                 const std::string& output, RenderStats* stats = nullptr) {
+    ThreadPool pool(render_options.threads);
+    int width = camera_options.screen_width;
+    int height = camera_options.screen_height;
+    double white_radiance = GetWhiteRadiance(*prepared, camera_options, render_options, &pool);
+    int band_height = std::max(render_options.band_height, 1);
+    int margin = render_options.max_samples > 1 ? 1 : 0;
+
+    PngRowWriter writer(output, width, height);
+    std::vector<uint64_t> rays_per_depth(std::max(render_options.depth, 0));
+    std::vector<std::vector<Vector>> img;
+    std::vector<std::vector<int>> samples_per_pixel;
+    std::vector<uint8_t> row(4 * width);
+    for (int first = 0; first < height; first += band_height) {
+        int last = std::min(first + band_height, height);
+        // rows traced, the band and its margin
+        int traced_first = std::max(first - margin, 0);
+        CameraOptions band = camera_options;
+        band.screen_height = std::min(last + margin, height) - traced_first;
+        ScreenRays screen(camera_options, traced_first);
+        img.assign(width, std::vector<Vector>(band.screen_height));
+        TracePixels(*prepared, band, render_options, screen, &pool, &img, &rays_per_depth);
+        SamplePixels(*prepared, band, render_options, screen, &pool, &img, &rays_per_depth,
+                     &samples_per_pixel);
+        ToneMap(&img, white_radiance, &pool);
+        for (int j = first; j < last; ++j) {
+            for (int i = 0; i < width; ++i) {
+                for (int k = 0; k < 3; ++k) {
+                    int value = 255 * img[i][j - traced_first][k];
+                    row[4 * i + k] = std::clamp(value, 0, 255);
+                }
+                row[4 * i + 3] = 255;
+            }
+            writer.WriteRow(row.data());
+        }
+    }
+    writer.Finish();
+    if (stats) {
+        stats->rays_per_depth = std::move(rays_per_depth);
+        stats->samples_per_pixel.clear();
+    }
+}
+
+void RenderToPng(const std::string& filename, const CameraOptions& camera_options,
+                 const RenderOptions& render_options, const std::string& output,
+                 RenderStats* stats = nullptr) {
+    RenderToPng(GetPreparedScene(filename, render_options), camera_options, render_options,
+                output, stats);
+}
+
+// side of the blocks of pixels that share a primary ray in the first frame of progressive renders
+constexpr int kProgressiveStep = 8;
+
+// Gets every frame of a progressive render and the index of its pass; returning false stops the
+// render.
+using FrameCallback = std::function<bool(const Image& frame, int pass)>;
+
+// Full render in passes, for previews: the first pass traces one pixel of every
+// kProgressiveStep x kProgressiveStep block, which the whole block shows, and every next pass
+// halves the blocks, tracing the pixels that earlier passes haven't; the last one also
+// anti-aliases. The passes together trace what Render does and the last frame is the image it
+// makes. on_frame gets the frame of every pass; returns the last one. Depth and normal renders are
+// a single frame.
+Image RenderProgressive(const std::shared_ptr<const PreparedScene>& scene,
+                        const CameraOptions& camera_options, const RenderOptions& render_options,
+                        const FrameCallback& on_frame, RenderStats* stats = nullptr) {
+    if (render_options.mode != RenderMode::kFull) {
+        Image image = Render(scene, camera_options, render_options);
+        on_frame(image, 0);
+        return image;
+    }
+
+    ThreadPool pool(render_options.threads);
+    const PreparedScene& prepared = *scene;
+    ScreenRays screen(camera_options);
+    int width = camera_options.screen_width;
+    int height = camera_options.screen_height;
+    std::vector<std::vector<Vector>> img(width, std::vector<Vector>(height));
+    std::vector<std::vector<Vector>> frame(width, std::vector<Vector>(height));
+    std::vector<uint64_t> rays_per_depth(std::max(render_options.depth, 0));
+    std::vector<std::vector<int>> samples_per_pixel;
+    for (int step = kProgressiveStep, pass = 0;; step /= 2, ++pass) {
+        TracePixels(prepared, camera_options, render_options, screen, &pool, &img,
+                    &rays_per_depth, PixelGrid{step, step != kProgressiveStep});
+        if (step == 1) {
+            SamplePixels(prepared, camera_options, render_options, screen, &pool, &img,
+                         &rays_per_depth, &samples_per_pixel);
+        }
+        pool.ParallelFor(width, [&](size_t i, size_t) {
+            for (int j = 0; j < height; ++j) {
+                frame[i][j] = img[i - i % step][j - j % step];
+            }
+        });
+        PostProcessing(&frame, &pool);
+        Image image = ImgToImage(frame, width, height);
+        if (!on_frame(image, pass) || step == 1) {
+            if (stats) {
+                stats->rays_per_depth = std::move(rays_per_depth);
+                stats->samples_per_pixel = std::move(samples_per_pixel);
+            }
+            return image;
+        }
+    }
+}
+
+Image RenderProgressive(const std::string& filename, const CameraOptions& camera_options,
+                        const RenderOptions& render_options, const FrameCallback& on_frame,
+                        RenderStats* stats = nullptr) {
+    return RenderProgressive(GetPreparedScene(filename, render_options), camera_options,
+                             render_options, on_frame, stats);
+}
+
+// One image of a batch.
+struct RenderJob {
+    CameraOptions camera_options;
+    RenderOptions render_options;
+};
+
+// finished images waiting for the consumer of a batch before rendering waits too
+constexpr size_t kBatchQueuedImages = 2;
+
+using ImageCallback = std::function<void(size_t index, Image&& image)>;
+
+// Renders the jobs in order on one pool of threads threads, 0 meaning one per hardware thread;
+// the threads, cache_directory and reuse_scenes of their render options are not looked at.
+// on_image(index, image) gets the image of every job in order, on a thread of its own, so
+// consuming an image (encoding it, say) overlaps with tracing the next ones. An exception thrown
+// by on_image stops the batch and is rethrown here.
+void RenderBatch(const std::shared_ptr<const PreparedScene>& prepared,
+                 const std::vector<RenderJob>& jobs, const ImageCallback& on_image,
+                 int threads = 0) {
+    if (jobs.empty()) {
+        return;
+    }
+    ThreadPool pool(threads);
+
+    std::mutex mutex;
+    std::condition_variable changed;
+    std::deque<Image> queue;
+    bool finished = false;
+    std::exception_ptr consumer_error;
+    std::thread consumer([&] {
+        for (size_t index = 0;; ++index) {
+            std::unique_lock lock(mutex);
+            changed.wait(lock, [&] { return !queue.empty() || finished; });
+            if (queue.empty()) {
+                return;
+            }
+            Image image = std::move(queue.front());
+            queue.pop_front();
+            lock.unlock();
+            changed.notify_all();
+            try {
+                on_image(index, std::move(image));
+            } catch (...) {
+                lock.lock();
+                consumer_error = std::current_exception();
+                changed.notify_all();
+                return;
+            }
+        }
+    });
+
+    std::exception_ptr error;
+    try {
+        for (const RenderJob& job : jobs) {
+            Image image = RenderPrepared(*prepared, job.camera_options, job.render_options, &pool,
+                                         nullptr);
+            std::unique_lock lock(mutex);
+            changed.wait(lock,
+                         [&] { return queue.size() < kBatchQueuedImages || consumer_error; });
+            if (consumer_error) {
+                break;
+            }
+            queue.push_back(std::move(image));
+            changed.notify_all();
+        }
+    } catch (...) {
+        error = std::current_exception();
+    }
+    {
+        std::lock_guard lock(mutex);
+        finished = true;
+    }
+    changed.notify_all();
+    consumer.join();
+    if (error) {
+        std::rethrow_exception(error);
+    }
+    if (consumer_error) {
+        std::rethrow_exception(consumer_error);
+    }
+}
+
+// The scene is loaded once, as the render options of the first job say.
+void RenderBatch(const std::string& filename, const std::vector<RenderJob>& jobs,
+                 const ImageCallback& on_image, int threads = 0) {
+    if (jobs.empty()) {
+        return;
+    }
+    RenderBatch(GetPreparedScene(filename, jobs[0].render_options), jobs, on_image, threads);
+}
+
+// Images of the jobs, in order. scene is a file name or a prepared scene, as for the functions
+// above.
+template <class SceneSource>
+std::vector<Image> RenderBatch(const SceneSource& scene, const std::vector<RenderJob>& jobs,
+                               int threads = 0) {
+    std::vector<Image> images;
+    images.reserve(jobs.size());
+    RenderBatch(
+        scene, jobs, [&](size_t, Image&& image) { images.push_back(std::move(image)); },
+        threads);
+    return images;
+}
+
+// Writes the image of job i to directory/frame_<i>.png, i on four digits, encoding every image
+// while the next ones render. Returns the paths written.
+template <class SceneSource>
+std::vector<std::string> RenderBatchToDirectory(const SceneSource& scene,
+                                                const std::vector<RenderJob>& jobs,
+                                                const std::string& directory, int threads = 0) {
+    std::filesystem::create_directories(directory);
+    std::vector<std::string> paths;
+    for (size_t index = 0; index < jobs.size(); ++index) {
+        char name[32];
+        std::snprintf(name, sizeof(name), "frame_%04zu.png", index);
+        paths.push_back((std::filesystem::path(directory) / name).string());
+    }
+    RenderBatch(
+        scene, jobs, [&](size_t index, Image&& image) { image.Write(paths[index]); },
+        threads);
+    return paths;
+}
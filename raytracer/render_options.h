@@ -1,8 +1,64 @@
 #pragma once
 
+#include <cstdint>
+#include <string>
+#include <vector>
+
 enum class RenderMode { kDepth, kNormal, kFull };
 
+// Buffers RenderOutputs can fill from one pass over the primary rays, combined into a bit mask.
+enum RenderOutput : uint32_t {
+    kOutputColor = 1 << 0,      // the image of a full render
+    kOutputDepth = 1 << 1,      // distance along the primary ray
+    kOutputNormal = 1 << 2,     // shading normal at the primary hit
+    kOutputAlbedo = 1 << 3,     // diffuse colour of the material hit
+    kOutputPrimitive = 1 << 4,  // ids of the primitive and of the material hit
+};
+
 struct RenderOptions {
     int depth;
     RenderMode mode = RenderMode::kFull;
+    int threads = 0;  // 0 means one per hardware thread
+    int tile_size = 16;
+    // prepared scenes are cached there across renders, empty disables the cache
+    std::string cache_directory = {};
+    // prepared scenes are kept in memory by the scene registry, so rendering the same files again
+    // doesn't load them; false loads the scene for this render only
+    bool reuse_scenes = true;
+    // reflected and refracted rays whose weight in the pixel is below this are not traced; zero
+    // weights are always skipped, a negative value traces every branch
+    double min_throughput = 0;
+    // full renders trace reflected and refracted rays a bounce at a time for many pixels, sorted
+    // into coherent batches, instead of depth first pixel by pixel; the image is the same
+    bool wavefront = false;
+    // lights that can add at most this much to a channel of a shading point are skipped, with no
+    // shadow ray; zero skips only the lights that don't reach the point at all
+    double light_tolerance = 0;
+    // when positive, every shading point traces shadow rays to this many lights picked at random
+    // with probabilities that follow their estimated contributions, for a noisy but unbiased
+    // estimate of the lighting; the choices depend on the pixel only, so renders are reproducible
+    int light_samples = 0;
+    // full renders trace more primary rays, spread over the pixel, for pixels whose colour differs
+    // from a neighbour's by more than antialiasing_threshold (in a channel of the colour mapped
+    // to [0, 1)), first a few and up to max_samples where these still disagree; the pixel is their
+    // average. One sample traces the centre of every pixel only, a negative threshold samples
+    // every pixel max_samples times
+    int max_samples = 1;
+    double antialiasing_threshold = 0.05;
+    // buffers RenderOutputs fills, RenderOutput values or-ed together; Render ignores it
+    uint32_t outputs = kOutputColor;
+    // rows RenderToPng renders and writes at a time, its memory grows with them rather than with
+    // the size of the image
+    int band_height = 64;
+    // radiance RenderToPng maps to white, brighter channels saturate; zero estimates it with a
+    // small render of the view beforehand
+    double white_radiance = 0;
+};
+
+// Counters filled by a render.
+struct RenderStats {
+    // rays of the ray tree traced at each depth, primary rays at 0
+    std::vector<uint64_t> rays_per_depth;
+    // primary rays averaged into every pixel, indexed [x][y]
+    std::vector<std::vector<int>> samples_per_pixel;
 };
@@ -0,0 +1,319 @@
+#pragma once
+
+#include <scene.h>
+#include <binary_scene.h>
+#include <mapped_file.h>
+#include <buffer.h>
+#include <prepared_scene.h>
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <vector>
+
+#include <unistd.h>
+
+// On-disk cache of prepared scenes. A cache file holds the parsed scene and its acceleration
+// structures and is named after a hash of the OBJ and MTL contents and of everything that
+// changes the built structures, so an up to date file is found by name and never invalidated.
+// The BVH and the leaf blocks are used straight from the mapping, the scene is copied out of it and
+// the light tree, cheap next to the rest, is built again.
+
+// 64-bit hash of byte strings, a key for cache files rather than a cryptographic digest.
+class ContentHash {
+public:
+    void Update(std::string_view bytes) {
+        Update(static_cast<uint64_t>(bytes.size()));
+        size_t i = 0;
+        for (; i + sizeof(uint64_t) <= bytes.size(); i += sizeof(uint64_t)) {
+            uint64_t word;
+            std::memcpy(&word, bytes.data() + i, sizeof(word));
+            Update(word);
+        }
+        uint64_t tail = 0;
+        std::memcpy(&tail, bytes.data() + i, bytes.size() - i);
+        Update(tail);
+    }
+
+    void Update(uint64_t value) {
+        state_ = Mix(state_ ^ value);
+    }
+
+    uint64_t Get() const {
+        return state_;
+    }
+
+private:
+    static uint64_t Mix(uint64_t x) {
+        x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+        return x ^ (x >> 31);
+    }
+
+    uint64_t state_ = 0x243f6a8885a308d3ULL;
+};
+
+// Bumped whenever the file layout or the BVH and block builders change.
+constexpr uint32_t kSceneCacheVersion = 4;
+
+// Sections of the acceleration structures, the scene itself is stored as in compiled scenes.
+enum SceneCacheSection {
+    kCacheBvhNodes,
+    kCacheBvhPrimitives,
+    kCacheLeafRanges,
+    kCacheTriangleBlocks,
+    kCacheSphereBlocks,
+    kCacheSectionCount
+};
+
+struct SceneCacheHeader {
+    std::array<char, 8> magic;
+    uint32_t version;
+    uint32_t section_count;
+    uint64_t key;
+    SceneSections scene_sections;
+    std::array<FileSection, kCacheSectionCount> sections;
+};
+
+constexpr std::array<char, 8> kSceneCacheMagic = {'R', 'T', 'S', 'C', 'E', 'N', 'E', '\0'};
+
+// Names of the material libraries an OBJ file refers to, relative to its directory.
+std::vector<std::string> FindMaterialLibraries(std::string_view obj) {
+    std::vector<std::string> libraries;
+    TextScanner scanner(obj);
+    while (scanner.NextLine()) {
+        if (scanner.NextToken() == "mtllib") {
+            libraries.emplace_back(scanner.NextToken());
+        }
+    }
+    return libraries;
+}
+
+// Hash of the scene files and of the build parameters, names the cache file.
+uint64_t GetSceneCacheKey(const std::string& filename) {
+    ContentHash hash;
+    hash.Update(kSceneCacheVersion);
+    hash.Update(sizeof(Scalar));
+    hash.Update(kBlockWidth);
+    hash.Update(sizeof(BvhNode));
+    hash.Update(sizeof(TriangleBlock));
+    hash.Update(sizeof(SphereBlock));
+
+    MappedFile obj(filename);
+    hash.Update(obj.GetContents());
+    if (IsBinaryScene(filename)) {
+        // compiled scenes already contain their materials
+        return hash.Get();
+    }
+    std::string directory = filename.substr(0, filename.find_last_of("/") + 1);
+    for (const std::string& library : FindMaterialLibraries(obj.GetContents())) {
+        hash.Update(library);
+        if (std::filesystem::exists(directory + library)) {
+            hash.Update(MappedFile(directory + library).GetContents());
+        }
+    }
+    return hash.Get();
+}
+
+std::string GetSceneCachePath(const std::string& cache_directory, uint64_t key) {
+    char name[32];
+    std::snprintf(name, sizeof(name), "%016llx.rtscene", static_cast<unsigned long long>(key));
+    return (std::filesystem::path(cache_directory) / name).string();
+}
+
+std::string SerializePreparedScene(const PreparedScene& prepared, uint64_t key) {
+    SectionWriter writer(sizeof(SceneCacheHeader));
+    SceneCacheHeader header{};
+    header.magic = kSceneCacheMagic;
+    header.version = kSceneCacheVersion;
+    header.section_count = kCacheSectionCount;
+    header.key = key;
+    header.scene_sections = AppendScene(&writer, prepared.scene);
+
+    const Bvh& bvh = prepared.bvh;
+    const LeafBlocks& blocks = prepared.blocks;
+    auto& sections = header.sections;
+    sections[kCacheBvhNodes] = writer.Append(bvh.GetNodes().data(), bvh.GetNodes().size());
+    sections[kCacheBvhPrimitives] =
+        writer.Append(bvh.GetPrimitives().data(), bvh.GetPrimitives().size());
+    sections[kCacheLeafRanges] =
+        writer.Append(blocks.GetRanges().data(), blocks.GetRanges().size());
+    // blocks are padded to whole cache lines
+    const auto& triangle_blocks = blocks.GetTriangleBlocks();
+    sections[kCacheTriangleBlocks] = writer.AppendFields(
+        triangle_blocks.data(), triangle_blocks.size(), &TriangleBlock::vertex0,
+        &TriangleBlock::edge1, &TriangleBlock::edge2, &TriangleBlock::primitives,
+        &TriangleBlock::size);
+    const auto& sphere_blocks = blocks.GetSphereBlocks();
+    sections[kCacheSphereBlocks] = writer.AppendFields(
+        sphere_blocks.data(), sphere_blocks.size(), &SphereBlock::center, &SphereBlock::radius2,
+        &SphereBlock::primitives, &SphereBlock::size);
+    return writer.Finish(header);
+}
+
+// Whether the structures read from a cache file only refer to what is there, so a damaged file is
+// rebuilt instead of being traversed out of bounds: children come after their parent and no
+// deeper than the traversal stacks go, leaves and block ranges stay within their arrays, and the
+// BVH and the blocks name primitives of the right kind, spheres being the first sphere_count.
+bool IsConsistent(const Buffer<BvhNode>& nodes, const Buffer<uint32_t>& primitives,
+                  const Buffer<LeafRange>& ranges, const Buffer<TriangleBlock>& triangle_blocks,
+                  const Buffer<SphereBlock>& sphere_blocks, size_t sphere_count) {
+    std::vector<size_t> depths(nodes.size());
+    for (size_t node_index = 0; node_index < nodes.size(); ++node_index) {
+        const BvhNode& node = nodes[node_index];
+        if (depths[node_index] >= BvhBuilder<Scalar>::kMaxDepth) {
+            return false;
+        }
+        if (node.IsLeaf()) {
+            if (uint64_t{node.offset} + node.count > primitives.size()) {
+                return false;
+            }
+        } else {
+            if (node.offset <= node_index + 1 || node.offset >= nodes.size()) {
+                return false;
+            }
+            for (size_t child : {node_index + 1, size_t{node.offset}}) {
+                depths[child] = std::max(depths[child], depths[node_index] + 1);
+            }
+        }
+
+        const LeafRange& range = ranges[node_index];
+        if (uint64_t{range.first_triangle_block} + range.triangle_blocks >
+                triangle_blocks.size() ||
+            uint64_t{range.first_sphere_block} + range.sphere_blocks > sphere_blocks.size()) {
+            return false;
+        }
+    }
+    for (uint32_t primitive : primitives) {
+        if (primitive >= primitives.size()) {
+            return false;
+        }
+    }
+    // unused lanes must stay empty, the kernels test every lane
+    auto has_primitives = [](const auto& block, auto is_of_kind) {
+        if (block.size > kBlockWidth) {
+            return false;
+        }
+        for (size_t lane = 0; lane < kBlockWidth; ++lane) {
+            uint32_t primitive = block.primitives[lane];
+            if (lane < block.size ? !is_of_kind(primitive) : primitive != kNoPrimitive) {
+                return false;
+            }
+        }
+        return true;
+    };
+    auto is_triangle = [&](uint32_t primitive) {
+        return primitive >= sphere_count && primitive < primitives.size();
+    };
+    auto is_sphere = [&](uint32_t primitive) { return primitive < sphere_count; };
+    for (const TriangleBlock& block : triangle_blocks) {
+        if (!has_primitives(block, is_triangle)) {
+            return false;
+        }
+    }
+    for (const SphereBlock& block : sphere_blocks) {
+        if (!has_primitives(block, is_sphere)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Reads a cache file written by SerializePreparedScene, nullopt if it is not a valid cache for
+// key. The returned scene keeps the file mapped.
+std::optional<PreparedScene> LoadSceneCache(const std::string& path, uint64_t key) {
+    auto file = std::make_shared<MappedFile>(path);
+    SceneCacheHeader header;
+    if (file->GetSize() < sizeof(header)) {
+        return std::nullopt;
+    }
+    std::memcpy(&header, file->GetData(), sizeof(header));
+    if (header.magic != kSceneCacheMagic || header.version != kSceneCacheVersion ||
+        header.section_count != kCacheSectionCount || header.key != key) {
+        return std::nullopt;
+    }
+
+    Buffer<BvhNode> nodes;
+    Buffer<uint32_t> primitives;
+    Buffer<LeafRange> ranges;
+    Buffer<TriangleBlock> triangle_blocks;
+    Buffer<SphereBlock> sphere_blocks;
+    const auto& sections = header.sections;
+    bool valid = GetSection(file, sections[kCacheBvhNodes], &nodes) &&
+                 GetSection(file, sections[kCacheBvhPrimitives], &primitives) &&
+                 GetSection(file, sections[kCacheLeafRanges], &ranges) &&
+                 GetSection(file, sections[kCacheTriangleBlocks], &triangle_blocks) &&
+                 GetSection(file, sections[kCacheSphereBlocks], &sphere_blocks);
+    if (!valid || ranges.size() != nodes.size()) {
+        return std::nullopt;
+    }
+    auto scene = ReadSceneSections(file, header.scene_sections);
+    if (!scene ||
+        primitives.size() !=
+            scene->GetSphereObjects().size() + scene->GetTriangleRecords().size() ||
+        !IsConsistent(nodes, primitives, ranges, triangle_blocks, sphere_blocks,
+                      scene->GetSphereObjects().size())) {
+        return std::nullopt;
+    }
+
+    LightTree light_tree(scene->GetLights());
+    return PreparedScene{std::move(*scene), Bvh(std::move(nodes), std::move(primitives)),
+                         LeafBlocks(std::move(ranges), std::move(triangle_blocks),
+                                    std::move(sphere_blocks)),
+                         std::move(light_tree)};
+}
+
+// Writes the file under a temporary name and renames it, so concurrent renders never map a
+// partially written cache. Every call has a name of its own, threads of a process writing the
+// same cache included. Caching is best effort: a failed write leaves no file behind.
+void WriteSceneCache(const std::string& path, const std::string& data) {
+    static std::atomic<uint64_t> writes = 0;
+    std::string temporary =
+        path + ".tmp" + std::to_string(getpid()) + "." + std::to_string(writes++);
+    std::error_code error;
+    std::filesystem::create_directories(std::filesystem::path(path).parent_path(), error);
+    {
+        std::ofstream out(temporary, std::ios::binary);
+        out.write(data.data(), data.size());
+        if (!out) {
+            out.close();
+            std::filesystem::remove(temporary, error);
+            return;
+        }
+    }
+    std::filesystem::rename(temporary, path, error);
+    if (error) {
+        std::filesystem::remove(temporary, error);
+    }
+}
+
+// Prepared scene for an OBJ file or a compiled scene. With a cache directory an up to date cache
+// file there is mapped instead of loading the scene and building its acceleration structures; on
+// a miss the scene is built as usual and stored for the next render. Empty cache_directory
+// disables caching. OBJ files are parsed on threads threads, 0 means one per hardware thread.
+PreparedScene LoadPreparedScene(const std::string& filename, const std::string& cache_directory,
+                                int threads = 0) {
+    if (cache_directory.empty()) {
+        return PrepareScene(LoadScene(filename, threads));
+    }
+    uint64_t key = GetSceneCacheKey(filename);
+    std::string path = GetSceneCachePath(cache_directory, key);
+    if (std::filesystem::exists(path)) {
+        if (auto prepared = LoadSceneCache(path, key)) {
+            return std::move(*prepared);
+        }
+    }
+    PreparedScene prepared = PrepareScene(LoadScene(filename, threads));
+    WriteSceneCache(path, SerializePreparedScene(prepared, key));
+    return prepared;
+}
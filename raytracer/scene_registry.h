@@ -0,0 +1,271 @@
+#pragma once
+
+#include <prepared_scene.h>
+#include <scene_cache.h>
+#include <mapped_file.h>
+
+#include <cstdint>
+#include <exception>
+#include <filesystem>
+#include <future>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <system_error>
+#include <unordered_map>
+#include <vector>
+
+// Prepared scenes kept in memory across renders, so rendering a scene again starts tracing at
+// once. Scenes are found by the canonical path of their file and reloaded when the file or one of
+// its material libraries has changed since, as told by their modification times and sizes. Least
+// recently used scenes are dropped once the scenes take more than the memory budget; renders
+// still holding a dropped scene keep it until they finish.
+
+// What a scene file looked like when the scene was loaded from it.
+struct FileStamp {
+    std::string path;
+    bool exists = false;
+    std::filesystem::file_time_type modified = {};
+    uintmax_t size = 0;
+
+    bool operator==(const FileStamp&) const = default;
+};
+
+FileStamp GetFileStamp(const std::string& path) {
+    FileStamp stamp{path};
+    std::error_code error;
+    stamp.modified = std::filesystem::last_write_time(path, error);
+    if (!error) {
+        stamp.size = std::filesystem::file_size(path, error);
+        stamp.exists = !error;
+    }
+    return stamp;
+}
+
+// Stamps of the files the scene of filename is read from: the file itself and, for OBJ files,
+// the material libraries it names.
+std::vector<FileStamp> GetSceneStamps(const std::string& filename) {
+    std::vector<FileStamp> stamps = {GetFileStamp(filename)};
+    if (!stamps[0].exists || IsBinaryScene(filename)) {
+        return stamps;
+    }
+    std::string directory = filename.substr(0, filename.find_last_of("/") + 1);
+    for (const std::string& library :
+         FindMaterialLibraries(MappedFile(filename).GetContents())) {
+        stamps.push_back(GetFileStamp(directory + library));
+    }
+    return stamps;
+}
+
+bool IsUpToDate(const std::vector<FileStamp>& stamps) {
+    for (const FileStamp& stamp : stamps) {
+        if (!(GetFileStamp(stamp.path) == stamp)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Bytes taken by the arrays of the scene and of its acceleration structures, mapped or not.
+size_t GetMemoryUsage(const PreparedScene& prepared) {
+    const Scene& scene = prepared.scene;
+    const Mesh& mesh = scene.GetMesh();
+    const LeafBlocks& blocks = prepared.blocks;
+    size_t usage = scene.GetMaterials().size() * sizeof(Material) +
+                   scene.GetLights().size() * sizeof(Light) +
+                   scene.GetSphereObjects().size() * sizeof(SphereObject) +
+                   (mesh.positions.size() + mesh.texture_coords.size() + mesh.normals.size()) *
+                       sizeof(Vector) +
+                   mesh.triangles.size() * sizeof(MeshTriangle) +
+                   scene.GetTriangleRecords().size() * sizeof(TriangleRecord);
+    usage += prepared.bvh.GetNodes().size() * sizeof(BvhNode) +
+             prepared.bvh.GetPrimitives().size() * sizeof(uint32_t);
+    usage += blocks.GetRanges().size() * sizeof(LeafRange) +
+             blocks.GetTriangleBlocks().size() * sizeof(TriangleBlock) +
+             blocks.GetSphereBlocks().size() * sizeof(SphereBlock);
+    return usage + prepared.light_tree.GetMemoryUsage();
+}
+
+constexpr size_t kDefaultSceneMemoryBudget = size_t{1} << 30;
+
+// Safe to use from any number of threads. A scene asked for by several threads at once is loaded
+// by the first of them, the others wait for it.
+class SceneRegistry {
+public:
+    explicit SceneRegistry(size_t memory_budget = kDefaultSceneMemoryBudget)
+        : memory_budget_(memory_budget) {
+    }
+
+    SceneRegistry(const SceneRegistry&) = delete;
+    SceneRegistry& operator=(const SceneRegistry&) = delete;
+
+    // Prepared scene of the file, loaded by LoadPreparedScene(filename, cache_directory, threads)
+    // unless it is kept here and up to date. Files that can't be found are not kept, loading them
+    // throws as LoadPreparedScene does.
+    std::shared_ptr<const PreparedScene> Get(const std::string& filename,
+                                             const std::string& cache_directory = {},
+                                             int threads = 0) {
+        std::error_code error;
+        std::string key = std::filesystem::canonical(filename, error).string();
+        if (error) {
+            return std::make_shared<const PreparedScene>(
+                LoadPreparedScene(filename, cache_directory, threads));
+        }
+
+        if (auto scene = Find(key)) {
+            return scene->get();
+        }
+        std::vector<FileStamp> stamps = GetSceneStamps(key);
+        std::promise<std::shared_ptr<const PreparedScene>> promise;
+        uint64_t generation;
+        std::optional<SceneFuture> other;
+        {
+            std::lock_guard lock(mutex_);
+            auto it = entries_.find(key);
+            if (it != entries_.end() && it->second.stamps == stamps) {
+                // another thread got there first
+                Touch(&it->second);
+                other = it->second.scene;
+            } else {
+                if (it != entries_.end()) {
+                    Erase(it);
+                }
+                generation = ++generation_;
+                lru_.push_front(key);
+                entries_.emplace(key, Entry{stamps, promise.get_future().share(), generation, 0,
+                                            lru_.begin()});
+            }
+        }
+        if (other) {
+            return other->get();
+        }
+
+        std::shared_ptr<const PreparedScene> scene;
+        try {
+            scene = std::make_shared<const PreparedScene>(
+                LoadPreparedScene(key, cache_directory, threads));
+        } catch (...) {
+            promise.set_exception(std::current_exception());
+            std::lock_guard lock(mutex_);
+            auto it = entries_.find(key);
+            if (it != entries_.end() && it->second.generation == generation) {
+                Erase(it);
+            }
+            throw;
+        }
+        promise.set_value(scene);
+
+        std::lock_guard lock(mutex_);
+        auto it = entries_.find(key);
+        if (it != entries_.end() && it->second.generation == generation) {
+            it->second.memory_usage = ::GetMemoryUsage(*scene);
+            memory_usage_ += it->second.memory_usage;
+            Evict();
+        }
+        return scene;
+    }
+
+    // Drops least recently used scenes until the others fit in memory_budget bytes.
+    void SetMemoryBudget(size_t memory_budget) {
+        std::lock_guard lock(mutex_);
+        memory_budget_ = memory_budget;
+        Evict();
+    }
+
+    // bytes taken by the scenes kept, as GetMemoryUsage counts them
+    size_t GetMemoryUsage() const {
+        std::lock_guard lock(mutex_);
+        return memory_usage_;
+    }
+
+    // scenes kept, loaded or being loaded
+    size_t Size() const {
+        std::lock_guard lock(mutex_);
+        return entries_.size();
+    }
+
+    void Clear() {
+        std::lock_guard lock(mutex_);
+        entries_.clear();
+        lru_.clear();
+        memory_usage_ = 0;
+    }
+
+private:
+    using SceneFuture = std::shared_future<std::shared_ptr<const PreparedScene>>;
+
+    struct Entry {
+        std::vector<FileStamp> stamps;
+        SceneFuture scene;
+        uint64_t generation;  // tells the entry from later ones of the same path
+        size_t memory_usage;  // 0 while the scene is being loaded
+        std::list<std::string>::iterator lru_position;
+    };
+
+    // Future of the kept scene of the canonical path if its files haven't changed.
+    std::optional<SceneFuture> Find(const std::string& key) {
+        std::vector<FileStamp> stamps;
+        SceneFuture scene;
+        uint64_t generation;
+        {
+            std::lock_guard lock(mutex_);
+            auto it = entries_.find(key);
+            if (it == entries_.end()) {
+                return std::nullopt;
+            }
+            stamps = it->second.stamps;
+            scene = it->second.scene;
+            generation = it->second.generation;
+        }
+        // files are looked at with the lock released, other threads go on meanwhile
+        if (!IsUpToDate(stamps)) {
+            return std::nullopt;
+        }
+        std::lock_guard lock(mutex_);
+        auto it = entries_.find(key);
+        if (it != entries_.end() && it->second.generation == generation) {
+            Touch(&it->second);
+        }
+        return scene;
+    }
+
+    void Touch(Entry* entry) {
+        lru_.splice(lru_.begin(), lru_, entry->lru_position);
+    }
+
+    void Erase(std::unordered_map<std::string, Entry>::iterator it) {
+        memory_usage_ -= it->second.memory_usage;
+        lru_.erase(it->second.lru_position);
+        entries_.erase(it);
+    }
+
+    // Drops the least recently used scenes until the rest fit in the budget. Scenes being
+    // loaded take no memory yet and stay.
+    void Evict() {
+        auto position = lru_.end();
+        while (memory_usage_ > memory_budget_ && position != lru_.begin()) {
+            auto it = entries_.find(*std::prev(position));
+            if (it->second.memory_usage == 0) {
+                --position;
+            } else {
+                // erases the element before position only
+                Erase(it);
+            }
+        }
+    }
+
+    mutable std::mutex mutex_;
+    size_t memory_budget_;
+    size_t memory_usage_ = 0;
+    uint64_t generation_ = 0;
+    std::unordered_map<std::string, Entry> entries_;
+    std::list<std::string> lru_;  // most recently used first
+};
+
+// Registry the render functions go through.
+SceneRegistry& GetSceneRegistry() {
+    static SceneRegistry registry;
+    return registry;
+}
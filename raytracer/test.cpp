@@ -1,9 +1,20 @@
 #include <catch.hpp>
 #include <util.h>
 
+#include <algorithm>
+#include <chrono>
 #include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <memory>
+#include <numeric>
 #include <string>
 #include <optional>
+#include <thread>
+#include <vector>
 
 #include <camera_options.h>
 #include <render_options.h>
@@ -23,6 +34,29 @@ void CheckImage(std::string_view obj_filename, std::string_view result_filename,
     Compare(image, ok_image);
 }
 
+int CountMismatches(const Image& lhs, const Image& rhs) {
+    int mismatches = 0;
+    for (int y = 0; y < lhs.Height(); ++y) {
+        for (int x = 0; x < lhs.Width(); ++x) {
+            mismatches += !(lhs.GetPixel(y, x) == rhs.GetPixel(y, x));
+        }
+    }
+    return mismatches;
+}
+
+// Sum of the absolute differences of the channels of all pixels.
+int64_t GetDistance(const Image& lhs, const Image& rhs) {
+    int64_t distance = 0;
+    for (int y = 0; y < lhs.Height(); ++y) {
+        for (int x = 0; x < lhs.Width(); ++x) {
+            RGB a = lhs.GetPixel(y, x);
+            RGB b = rhs.GetPixel(y, x);
+            distance += std::abs(a.r - b.r) + std::abs(a.g - b.g) + std::abs(a.b - b.b);
+        }
+    }
+    return distance;
+}
+
 TEST_CASE("Shading parts", "[raytracer]") {
     CameraOptions camera_opts(640, 480);
     RenderOptions render_opts{1};
@@ -82,3 +116,665 @@ TEST_CASE("Distorted box", "[raytracer]") {
     CheckImage("distorted_box/CornellBox-Original.obj", "distorted_box/result.png", camera_opts,
                render_opts);
 }
+
+TEST_CASE("Thread count does not change the image", "[raytracer]") {
+    CameraOptions camera_opts(200, 150);
+    camera_opts.look_from = {-0.5, 1.5, 0.98};
+    camera_opts.look_to = {0.0, 1.0, 0.0};
+    auto filename = kTestsDir / "classic_box/CornellBox-Original.obj";
+    for (auto mode : {RenderMode::kDepth, RenderMode::kNormal, RenderMode::kFull}) {
+        RenderOptions serial_opts{4, mode, 1, 200};
+        RenderOptions parallel_opts{4, mode, 4, 7};
+        auto serial = Render(filename, camera_opts, serial_opts);
+        auto parallel = Render(filename, camera_opts, parallel_opts);
+        REQUIRE(CountMismatches(serial, parallel) == 0);
+    }
+
+    RenderOptions negative_opts{4, RenderMode::kFull, -1};
+    REQUIRE_THROWS_AS(Render(filename, camera_opts, negative_opts), std::invalid_argument);
+}
+
+TEST_CASE("Scene cache", "[raytracer]") {
+    CameraOptions camera_opts(160, 120, std::numbers::pi / 3);
+    camera_opts.look_from = {0.0, 0.7, 1.75};
+    camera_opts.look_to = {0.0, 0.7, 0.0};
+    auto filename = kTestsDir / "box/cube.obj";
+    auto cache_directory =
+        std::filesystem::temp_directory_path() / ("raytracer_cache_" + std::to_string(getpid()));
+    std::filesystem::remove_all(cache_directory);
+
+    RenderOptions render_opts{4};
+    auto expected = Render(filename, camera_opts, render_opts);
+    render_opts.cache_directory = cache_directory;
+    // every render goes to the cache file rather than to the scene registry
+    render_opts.reuse_scenes = false;
+    // the first render writes the cache file, the second one maps it
+    REQUIRE(CountMismatches(Render(filename, camera_opts, render_opts), expected) == 0);
+    std::vector<std::filesystem::path> files(
+        std::filesystem::directory_iterator(cache_directory), {});
+    REQUIRE(files.size() == 1);
+    REQUIRE(CountMismatches(Render(filename, camera_opts, render_opts), expected) == 0);
+
+    // a damaged file is rebuilt
+    std::ofstream(files[0], std::ios::binary | std::ios::trunc) << "junk";
+    REQUIRE(CountMismatches(Render(filename, camera_opts, render_opts), expected) == 0);
+    REQUIRE(std::filesystem::file_size(files[0]) > sizeof(SceneCacheHeader));
+
+    // so is one whose header and sections are fine but whose contents are not
+    uint64_t key = GetSceneCacheKey(filename);
+    auto damage = [&](SceneCacheSection section, size_t position, size_t size) {
+        std::fstream file(files[0], std::ios::binary | std::ios::in | std::ios::out);
+        SceneCacheHeader header;
+        file.read(reinterpret_cast<char*>(&header), sizeof(header));
+        file.seekp(header.sections[section].offset + position);
+        file << std::string(size, '\xfe');
+    };
+    REQUIRE(LoadSceneCache(files[0], key));
+    // the offset and the count of the root
+    damage(kCacheBvhNodes, offsetof(BvhNode, offset), 2 * sizeof(uint32_t));
+    REQUIRE_FALSE(LoadSceneCache(files[0], key));
+    REQUIRE(CountMismatches(Render(filename, camera_opts, render_opts), expected) == 0);
+    REQUIRE(LoadSceneCache(files[0], key));
+    // a primitive of the first triangle block
+    damage(kCacheTriangleBlocks, offsetof(TriangleBlock, primitives), sizeof(uint32_t));
+    REQUIRE_FALSE(LoadSceneCache(files[0], key));
+    REQUIRE(CountMismatches(Render(filename, camera_opts, render_opts), expected) == 0);
+    REQUIRE(LoadSceneCache(files[0], key));
+
+    // threads writing the same cache at once don't mix their files
+    auto prepared = LoadSceneCache(files[0], key);
+    std::string data = SerializePreparedScene(*prepared, key);
+    std::vector<std::thread> writers;
+    for (int k = 0; k < 4; ++k) {
+        writers.emplace_back([&] { WriteSceneCache(files[0], data); });
+    }
+    for (std::thread& writer : writers) {
+        writer.join();
+    }
+    std::ifstream written(files[0], std::ios::binary);
+    REQUIRE(std::string(std::istreambuf_iterator<char>(written), {}) == data);
+    files.assign(std::filesystem::directory_iterator(cache_directory), {});
+    REQUIRE(files.size() == 1);
+
+    std::filesystem::remove_all(cache_directory);
+}
+
+TEST_CASE("Compiled scene", "[raytracer]") {
+    CameraOptions camera_opts(160, 120, std::numbers::pi / 3);
+    camera_opts.look_from = {0.0, 0.7, 1.75};
+    camera_opts.look_to = {0.0, 0.7, 0.0};
+    auto directory =
+        std::filesystem::temp_directory_path() / ("raytracer_compiled_" + std::to_string(getpid()));
+    std::filesystem::create_directories(directory);
+    auto compiled = directory / "cube.rtb";
+    WriteBinaryScene(ReadScene(kTestsDir / "box/cube.obj"), compiled);
+
+    RenderOptions render_opts{4};
+    auto expected = Render(kTestsDir / "box/cube.obj", camera_opts, render_opts);
+    REQUIRE(CountMismatches(Render(compiled, camera_opts, render_opts), expected) == 0);
+    render_opts.cache_directory = directory / "cache";
+    REQUIRE(CountMismatches(Render(compiled, camera_opts, render_opts), expected) == 0);
+    REQUIRE(CountMismatches(Render(compiled, camera_opts, render_opts), expected) == 0);
+
+    std::filesystem::remove_all(directory);
+}
+
+TEST_CASE("Scene registry", "[raytracer]") {
+    auto directory =
+        std::filesystem::temp_directory_path() / ("raytracer_registry_" + std::to_string(getpid()));
+    std::filesystem::create_directories(directory);
+    for (auto name : {"cube.obj", "CornellBox-Sphere.mtl"}) {
+        std::filesystem::copy_file(kTestsDir / "box" / name, directory / name);
+    }
+    auto filename = directory / "cube.obj";
+    // pushes the modification time forward, sizes alone would miss same-size edits
+    auto touch = [](const std::filesystem::path& path) {
+        std::filesystem::last_write_time(
+            path, std::filesystem::last_write_time(path) + std::chrono::seconds(1));
+    };
+
+    SceneRegistry registry;
+    auto scene = registry.Get(filename);
+    REQUIRE(registry.Get(filename) == scene);
+    REQUIRE(registry.Get((directory / "." / "cube.obj").string()) == scene);
+    REQUIRE(registry.Size() == 1);
+    REQUIRE(registry.GetMemoryUsage() == GetMemoryUsage(*scene));
+
+    // a changed file or material library is loaded again
+    touch(filename);
+    auto reloaded = registry.Get(filename);
+    REQUIRE(reloaded != scene);
+    REQUIRE(registry.Get(filename) == reloaded);
+    std::ofstream(directory / "CornellBox-Sphere.mtl", std::ios::app) << "\n";
+    scene = registry.Get(filename);
+    REQUIRE(scene != reloaded);
+    REQUIRE(registry.Size() == 1);
+
+    // threads asking at once share one load
+    touch(filename);
+    std::vector<std::shared_ptr<const PreparedScene>> scenes(4);
+    {
+        std::vector<std::thread> threads;
+        for (auto& result : scenes) {
+            threads.emplace_back([&] { result = registry.Get(filename); });
+        }
+        for (auto& thread : threads) {
+            thread.join();
+        }
+    }
+    REQUIRE(scenes[0] != scene);
+    REQUIRE(std::count(scenes.begin(), scenes.end(), scenes[0]) == 4);
+
+    // the least recently used scene goes first
+    std::filesystem::copy_file(filename, directory / "copy.obj");
+    auto copy = registry.Get((directory / "copy.obj").string());
+    REQUIRE(registry.Size() == 2);
+    registry.Get(filename);
+    registry.SetMemoryBudget(registry.GetMemoryUsage() - 1);
+    REQUIRE(registry.Size() == 1);
+    REQUIRE(registry.Get(filename) == scenes[0]);
+    REQUIRE(registry.Get((directory / "copy.obj").string()) != copy);
+    REQUIRE(registry.Size() == 1);
+
+    REQUIRE_THROWS(registry.Get((directory / "missing.obj").string()));
+    REQUIRE(registry.Size() == 1);
+
+    std::filesystem::remove_all(directory);
+}
+
+TEST_CASE("Ray tree culling", "[raytracer]") {
+    CameraOptions camera_opts(200, 150);
+    camera_opts.look_from = {2, 1.5, -0.1};
+    camera_opts.look_to = {1, 1.2, -2.8};
+    auto filename = kTestsDir / "mirrors/scene.obj";
+    RenderOptions render_opts{9};
+    auto total = [](const RenderStats& stats) {
+        return std::accumulate(stats.rays_per_depth.begin(), stats.rays_per_depth.end(),
+                               uint64_t{0});
+    };
+
+    render_opts.min_throughput = -1;
+    RenderStats all_stats;
+    auto all = Render(filename, camera_opts, render_opts, &all_stats);
+    REQUIRE(all_stats.rays_per_depth.size() == 9);
+    REQUIRE(all_stats.rays_per_depth[0] == 200 * 150);
+
+    // branches of zero weight add nothing to the image
+    render_opts.min_throughput = 0;
+    RenderStats stats;
+    REQUIRE(CountMismatches(Render(filename, camera_opts, render_opts, &stats), all) == 0);
+    REQUIRE(stats.rays_per_depth[0] == 200 * 150);
+    REQUIRE(total(stats) < total(all_stats));
+
+    // every mirror reflects half of the light, so paths past seven bounces weigh less than 0.01
+    render_opts.min_throughput = 0.01;
+    RenderStats culled_stats;
+    Render(filename, camera_opts, render_opts, &culled_stats);
+    REQUIRE(culled_stats.rays_per_depth[0] == 200 * 150);
+    REQUIRE(culled_stats.rays_per_depth[7] == 0);
+    REQUIRE(total(culled_stats) < total(stats));
+}
+
+TEST_CASE("Wavefront", "[raytracer]") {
+    auto check = [](const std::string& obj_filename, const CameraOptions& camera_opts,
+                    RenderOptions render_opts) {
+        RenderStats stats;
+        auto expected = Render(kTestsDir / obj_filename, camera_opts, render_opts, &stats);
+        render_opts.wavefront = true;
+        for (int threads : {1, 3}) {
+            render_opts.threads = threads;
+            RenderStats wavefront_stats;
+            auto image = Render(kTestsDir / obj_filename, camera_opts, render_opts,
+                                &wavefront_stats);
+            REQUIRE(CountMismatches(image, expected) == 0);
+            REQUIRE(wavefront_stats.rays_per_depth == stats.rays_per_depth);
+        }
+    };
+
+    CameraOptions mirrors(200, 150);
+    mirrors.look_from = {2, 1.5, -0.1};
+    mirrors.look_to = {1, 1.2, -2.8};
+    RenderOptions render_opts{9};
+    check("mirrors/scene.obj", mirrors, render_opts);
+    render_opts.min_throughput = -1;
+    check("mirrors/scene.obj", mirrors, render_opts);
+
+    // more pixels than one wavefront takes
+    CameraOptions box(320, 240, std::numbers::pi / 3);
+    box.look_from = {0.0, 0.7, 1.75};
+    box.look_to = {0.0, 0.7, 0.0};
+    check("box/cube.obj", box, RenderOptions{4});
+}
+
+// One material lit by lights at random positions with random intensities.
+PreparedScene MakeRandomLightsScene(int lights, RandomGenerator* rnd) {
+    Scene scene;
+    Material material;
+    material.diffuse_color = {0.8, 0.6, 0.4};
+    material.specular_color = {0.5, 0.5, 0.5};
+    material.specular_exponent = 20;
+    scene.AddMaterial(material);
+    auto positions = rnd->GenRealVector(3 * lights, -10, 10);
+    auto intensities = rnd->GenRealVector(lights, 0, 0.01);
+    for (int i = 0; i < lights; ++i) {
+        scene.AddLight(positions[3 * i], positions[3 * i + 1], positions[3 * i + 2],
+                       intensities[i], intensities[i], 0.5 * intensities[i]);
+    }
+    return PrepareScene(std::move(scene));
+}
+
+// Points of the material of MakeRandomLightsScene among its lights, facing random ways.
+std::vector<Surface> MakeRandomSurfaces(const PreparedScene& prepared, int count,
+                                        RandomGenerator* rnd) {
+    auto points = rnd->GenRealVector(3 * count, -12, 12);
+    auto normals = rnd->GenRealVector(3 * count, -1, 1);
+    std::vector<Surface> surfaces;
+    for (int i = 0; i < count; ++i) {
+        Vector normal{normals[3 * i], normals[3 * i + 1], normals[3 * i + 2]};
+        normal.Normalize();
+        surfaces.push_back({{points[3 * i], points[3 * i + 1], points[3 * i + 2]},
+                            normal,
+                            prepared.scene.GetMaterial(0)});
+    }
+    return surfaces;
+}
+
+TEST_CASE("Light tree", "[raytracer]") {
+    constexpr int kLights = 2000;
+    RandomGenerator rnd;
+    PreparedScene prepared = MakeRandomLightsScene(kLights, &rnd);
+
+    std::vector<int> visits(kLights);
+    prepared.light_tree.ForEachLight([](const BoundingBox&, const Vector&) { return true; },
+                                     [&](uint32_t light) { ++visits[light]; });
+    REQUIRE(visits == std::vector<int>(kLights, 1));
+
+    OcclusionCache occlusion_cache(kLights);
+    for (const Surface& surface : MakeRandomSurfaces(prepared, 100, &rnd)) {
+        Vector from = surface.position + 3 * surface.normal;
+        auto compute = [&](Scalar light_tolerance) {
+            return ComputeLights(prepared, &occlusion_cache, surface, from, light_tolerance);
+        };
+
+        // a negative tolerance lights with every light, zero skips the ones that add nothing
+        Vector all = compute(-1);
+        Vector exact = compute(0);
+        Vector culled = compute(1e-4);
+        Vector none = compute(1);
+        for (int channel = 0; channel < 3; ++channel) {
+            REQUIRE(exact[channel] == all[channel]);
+            REQUIRE(culled[channel] <= all[channel]);
+            REQUIRE(culled[channel] >= all[channel] - kLights * 1e-4);
+            REQUIRE(none[channel] == 0);
+        }
+    }
+}
+
+TEST_CASE("Light sampling", "[raytracer]") {
+    constexpr int kLights = 500;
+    RandomGenerator rnd;
+    PreparedScene prepared = MakeRandomLightsScene(kLights, &rnd);
+
+    // estimates average to the exact lighting, within a few standard errors
+    OcclusionCache occlusion_cache(kLights);
+    for (const Surface& surface : MakeRandomSurfaces(prepared, 10, &rnd)) {
+        Vector from = surface.position + 3 * surface.normal;
+        Vector exact = ComputeLights(prepared, &occlusion_cache, surface, from, -1);
+        Vector sum{0, 0, 0};
+        Vector square_sum{0, 0, 0};
+        constexpr int kEstimates = 1000;
+        for (int seed = 0; seed < kEstimates; ++seed) {
+            RandomSequence random(seed);
+            Vector estimate = SampleLights(prepared, &occlusion_cache, surface, from, 4, &random);
+            sum = sum + estimate;
+            square_sum = square_sum + estimate * estimate;
+        }
+        for (int channel = 0; channel < 3; ++channel) {
+            double mean = sum[channel] / kEstimates;
+            double variance = square_sum[channel] / kEstimates - mean * mean;
+            REQUIRE(std::fabs(mean - exact[channel]) <= 4 * std::sqrt(variance / kEstimates));
+        }
+    }
+
+    // the choices only depend on the pixel
+    CameraOptions camera_opts(200, 200);
+    camera_opts.look_from = {-0.5, 1.5, 0.98};
+    camera_opts.look_to = {0.0, 1.0, 0.0};
+    RenderOptions render_opts{4};
+    auto filename = kTestsDir / "classic_box/CornellBox-Original.obj";
+    auto exact_image = Render(filename, camera_opts, render_opts);
+    render_opts.light_samples = 1;
+    render_opts.threads = 1;
+    auto sampled = Render(filename, camera_opts, render_opts);
+    REQUIRE(CountMismatches(sampled, exact_image) > 0);
+    render_opts.threads = 3;
+    REQUIRE(CountMismatches(Render(filename, camera_opts, render_opts), sampled) == 0);
+    render_opts.wavefront = true;
+    REQUIRE(CountMismatches(Render(filename, camera_opts, render_opts), sampled) == 0);
+    // as many samples as lights is exact
+    render_opts.light_samples = 3;
+    REQUIRE(CountMismatches(Render(filename, camera_opts, render_opts), exact_image) == 0);
+}
+
+TEST_CASE("Progressive", "[raytracer]") {
+    CameraOptions camera_opts(203, 150);
+    camera_opts.look_from = {-0.5, 1.5, 0.98};
+    camera_opts.look_to = {0.0, 1.0, 0.0};
+    RenderOptions render_opts{4};
+    auto filename = kTestsDir / "classic_box/CornellBox-Original.obj";
+    RenderStats stats;
+    auto expected = Render(filename, camera_opts, render_opts, &stats);
+
+    for (bool wavefront : {false, true}) {
+        render_opts.wavefront = wavefront;
+        std::vector<int> passes;
+        RenderStats progressive_stats;
+        auto image = RenderProgressive(
+            filename, camera_opts, render_opts,
+            [&](const Image& frame, int pass) {
+                REQUIRE(frame.Width() == 203);
+                REQUIRE(frame.Height() == 150);
+                passes.push_back(pass);
+                return true;
+            },
+            &progressive_stats);
+        REQUIRE(passes == std::vector<int>{0, 1, 2, 3});
+        REQUIRE(CountMismatches(image, expected) == 0);
+        REQUIRE(progressive_stats.rays_per_depth == stats.rays_per_depth);
+    }
+
+    // stopped after the first frame, which traced one pixel per 8x8 block
+    RenderStats first_stats;
+    int frames = 0;
+    auto first = RenderProgressive(
+        filename, camera_opts, render_opts,
+        [&](const Image&, int) {
+            ++frames;
+            return false;
+        },
+        &first_stats);
+    REQUIRE(frames == 1);
+    REQUIRE(first_stats.rays_per_depth[0] == 26 * 19);
+    REQUIRE(first.GetPixel(5, 7) == first.GetPixel(0, 0));
+}
+
+TEST_CASE("Adaptive anti-aliasing", "[raytracer]") {
+    CameraOptions camera_opts(160, 120);
+    camera_opts.look_from = {-0.5, 1.5, 0.98};
+    camera_opts.look_to = {0.0, 1.0, 0.0};
+    RenderOptions render_opts{4};
+    auto filename = kTestsDir / "classic_box/CornellBox-Original.obj";
+    RenderStats stats;
+    auto single = Render(filename, camera_opts, render_opts, &stats);
+    REQUIRE(stats.samples_per_pixel ==
+            std::vector<std::vector<int>>(160, std::vector<int>(120, 1)));
+
+    // every pixel sampled fully, what adaptive sampling approximates
+    render_opts.max_samples = 16;
+    render_opts.antialiasing_threshold = -1;
+    auto full = Render(filename, camera_opts, render_opts, &stats);
+    REQUIRE(stats.samples_per_pixel ==
+            std::vector<std::vector<int>>(160, std::vector<int>(120, 16)));
+
+    render_opts.antialiasing_threshold = 0.05;
+    auto adaptive = Render(filename, camera_opts, render_opts, &stats);
+    int refined = 0;
+    uint64_t samples_total = 0;
+    for (const auto& column : stats.samples_per_pixel) {
+        for (int samples : column) {
+            REQUIRE((samples == 1 || samples == 4 || samples == 16));
+            refined += samples > 1;
+            samples_total += samples;
+        }
+    }
+    REQUIRE(refined > 0);
+    REQUIRE(refined < 160 * 120 / 2);
+    REQUIRE(stats.rays_per_depth[0] == samples_total);
+    INFO(GetDistance(adaptive, full) << " " << GetDistance(single, full));
+    REQUIRE(GetDistance(adaptive, full) < GetDistance(single, full) / 2);
+
+    render_opts.threads = 3;
+    REQUIRE(CountMismatches(Render(filename, camera_opts, render_opts), adaptive) == 0);
+    render_opts.wavefront = true;
+    REQUIRE(CountMismatches(Render(filename, camera_opts, render_opts), adaptive) == 0);
+    auto progressive = RenderProgressive(filename, camera_opts, render_opts,
+                                         [](const Image&, int) { return true; });
+    REQUIRE(CountMismatches(progressive, adaptive) == 0);
+
+    // samples of pixels far apart on a wide screen don't share seeds
+    REQUIRE(GetSampleSeed(0, 7, 1) != GetSampleSeed(1 << 16, 7, 0));
+    REQUIRE(GetSampleSeed(0, 7, 1) != GetSampleSeed(0, 7, 2));
+}
+
+TEST_CASE("Batch", "[raytracer]") {
+    auto filename = kTestsDir / "classic_box/CornellBox-Original.obj";
+    std::vector<RenderJob> jobs;
+    for (int k = 0; k < 4; ++k) {
+        CameraOptions camera_opts(120 + 10 * k, 90);
+        camera_opts.look_from = {-0.5 + 0.3 * k, 1.5, 0.98};
+        camera_opts.look_to = {0.0, 1.0, 0.0};
+        jobs.push_back({camera_opts, RenderOptions{4}});
+    }
+    jobs[2].render_options.mode = RenderMode::kNormal;
+    std::vector<Image> expected;
+    for (const RenderJob& job : jobs) {
+        expected.push_back(Render(filename, job.camera_options, job.render_options));
+    }
+
+    auto images = RenderBatch(filename, jobs, 3);
+    REQUIRE(images.size() == jobs.size());
+    for (size_t k = 0; k < jobs.size(); ++k) {
+        REQUIRE(images[k].Width() == jobs[k].camera_options.screen_width);
+        REQUIRE(CountMismatches(images[k], expected[k]) == 0);
+    }
+
+    auto directory =
+        std::filesystem::temp_directory_path() / ("raytracer_batch_" + std::to_string(getpid()));
+    auto paths = RenderBatchToDirectory(filename, jobs, directory, 2);
+    REQUIRE(paths.size() == jobs.size());
+    REQUIRE(std::filesystem::path(paths[3]).filename() == "frame_0003.png");
+    for (size_t k = 0; k < jobs.size(); ++k) {
+        REQUIRE(CountMismatches(Image(paths[k]), expected[k]) == 0);
+    }
+    std::filesystem::remove_all(directory);
+
+    // a failing consumer stops the batch
+    size_t consumed = 0;
+    REQUIRE_THROWS_AS(RenderBatch(filename, jobs,
+                                  [&](size_t index, Image&&) {
+                                      ++consumed;
+                                      if (index == 1) {
+                                          throw std::runtime_error("full disk");
+                                      }
+                                  }),
+                      std::runtime_error);
+    REQUIRE(consumed == 2);
+}
+
+TEST_CASE("Scene built in code", "[raytracer]") {
+    auto filename = kTestsDir / "classic_box/CornellBox-Original.obj";
+    Scene read = ReadScene(filename);
+    SceneBuilder builder;
+    for (const Material& material : read.GetMaterials()) {
+        builder.AddMaterial(material);
+    }
+    const Mesh& mesh = read.GetMesh();
+    for (size_t i = 1; i < mesh.positions.size(); ++i) {
+        builder.AddPosition(mesh.positions[i]);
+    }
+    for (size_t i = 1; i < mesh.texture_coords.size(); ++i) {
+        builder.AddTextureCoord(mesh.texture_coords[i]);
+    }
+    for (size_t i = 1; i < mesh.normals.size(); ++i) {
+        builder.AddNormal(mesh.normals[i]);
+    }
+    for (const MeshTriangle& triangle : mesh.triangles) {
+        builder.AddTriangle(triangle.positions, triangle.material, triangle.normals,
+                            triangle.texture_coords);
+    }
+    for (const SphereObject& object : read.GetSphereObjects()) {
+        builder.AddSphere(object.sphere.GetCenter(), object.sphere.GetRadius(), object.material);
+    }
+    for (const Light& light : read.GetLights()) {
+        builder.AddLight(light.position, light.intensity);
+    }
+    auto prepared = Prepare(builder.Build());
+
+    CameraOptions camera_opts(160, 120);
+    camera_opts.look_from = {-0.5, 1.5, 0.98};
+    camera_opts.look_to = {0.0, 1.0, 0.0};
+    RenderOptions render_opts{4};
+    for (auto mode : {RenderMode::kDepth, RenderMode::kNormal, RenderMode::kFull}) {
+        render_opts.mode = mode;
+        REQUIRE(CountMismatches(Render(prepared, camera_opts, render_opts),
+                                Render(filename, camera_opts, render_opts)) == 0);
+    }
+    auto progressive =
+        RenderProgressive(prepared, camera_opts, render_opts, [](const Image&, int) {
+            return true;
+        });
+    REQUIRE(CountMismatches(progressive, Render(filename, camera_opts, render_opts)) == 0);
+    auto images = RenderBatch(prepared, {{camera_opts, render_opts}});
+    REQUIRE(CountMismatches(images[0], progressive) == 0);
+
+    // primitives without a material are shaded with the default one
+    SceneBuilder bare;
+    bare.AddTriangle({-1, -1, -2}, {1, -1, -2}, {0, 1, -2}, kNoMaterial);
+    bare.AddSphere({0.5, 0.5, -1.5}, 0.25, kNoMaterial);
+    bare.AddLight({0, 0, 0}, {1, 1, 1});
+    auto bare_prepared = Prepare(bare.Build());
+    CameraOptions bare_camera(40, 40);
+    for (bool wavefront : {false, true}) {
+        render_opts.wavefront = wavefront;
+        for (auto mode : {RenderMode::kDepth, RenderMode::kNormal, RenderMode::kFull}) {
+            render_opts.mode = mode;
+            Render(bare_prepared, bare_camera, render_opts);
+        }
+        // lit grey
+        RGB pixel = Render(bare_prepared, bare_camera, render_opts).GetPixel(20, 20);
+        REQUIRE(pixel.r > 0);
+        REQUIRE((pixel.r == pixel.g && pixel.g == pixel.b));
+    }
+    render_opts.outputs = kOutputColor | kOutputAlbedo;
+    auto buffers = RenderOutputs(bare_prepared, bare_camera, render_opts);
+    REQUIRE(buffers.albedo[20][20][0] == GetDefaultMaterial()->diffuse_color[0]);
+}
+
+TEST_CASE("Render outputs", "[raytracer]") {
+    auto filename = kTestsDir / "classic_box/CornellBox-Original.obj";
+    CameraOptions camera_opts(160, 120);
+    camera_opts.look_from = {-0.5, 1.5, 0.98};
+    camera_opts.look_to = {0.0, 1.0, 0.0};
+    RenderOptions render_opts{4};
+    RenderStats stats;
+    auto color = Render(filename, camera_opts, render_opts, &stats);
+    render_opts.mode = RenderMode::kNormal;
+    auto normal = Render(filename, camera_opts, render_opts);
+
+    render_opts.outputs =
+        kOutputColor | kOutputDepth | kOutputNormal | kOutputAlbedo | kOutputPrimitive;
+    RenderStats output_stats;
+    auto buffers = RenderOutputs(filename, camera_opts, render_opts, &output_stats);
+    REQUIRE(buffers.color);
+    REQUIRE(CountMismatches(*buffers.color, color) == 0);
+    REQUIRE(output_stats.rays_per_depth == stats.rays_per_depth);
+
+    auto prepared = GetSceneRegistry().Get(filename);
+    const Scene& scene = prepared->scene;
+    ScreenRays screen(camera_opts);
+    Image normal_image(160, 120);
+    for (int i = 0; i < 160; ++i) {
+        for (int j = 0; j < 120; ++j) {
+            Ray ray(Vector(camera_opts.look_from), screen.GetPixelDirection(i, j));
+            auto hit = FindClosestHit(*prepared, ray);
+            REQUIRE(hit.has_value() == (buffers.primitive[i][j] != kNoPrimitive));
+            if (!hit) {
+                REQUIRE(std::isinf(buffers.depth[i][j]));
+                continue;
+            }
+            REQUIRE(buffers.primitive[i][j] == hit->primitive);
+            REQUIRE(buffers.depth[i][j] == static_cast<float>(hit->record.distance));
+            uint16_t material = buffers.material[i][j];
+            REQUIRE(material < scene.GetMaterials().size());
+            const Vector& albedo = scene.GetMaterials()[material].diffuse_color;
+            for (int k = 0; k < 3; ++k) {
+                REQUIRE(buffers.albedo[i][j][k] == albedo[k]);
+            }
+            Vector pixel = 255 * 0.5 * (buffers.normal[i][j] + Vector{1, 1, 1});
+            normal_image.SetPixel({int(pixel[0]), int(pixel[1]), int(pixel[2])}, j, i);
+        }
+    }
+    REQUIRE(CountMismatches(normal_image, normal) == 0);
+
+    // primary rays only
+    render_opts.outputs = kOutputDepth | kOutputNormal;
+    auto primary = RenderOutputs(prepared, camera_opts, render_opts);
+    REQUIRE(!primary.color);
+    REQUIRE(primary.albedo.empty());
+    REQUIRE(primary.primitive.empty());
+    REQUIRE(primary.depth == buffers.depth);
+    for (int i = 0; i < 160; ++i) {
+        for (int j = 0; j < 120; ++j) {
+            for (int k = 0; k < 3; ++k) {
+                REQUIRE(primary.normal[i][j][k] == buffers.normal[i][j][k]);
+            }
+        }
+    }
+
+    render_opts.outputs = kOutputColor | kOutputDepth;
+    render_opts.wavefront = true;
+    auto wavefront = RenderOutputs(prepared, camera_opts, render_opts);
+    REQUIRE(CountMismatches(*wavefront.color, color) == 0);
+    REQUIRE(wavefront.depth == buffers.depth);
+}
+
+TEST_CASE("Streaming to png", "[raytracer]") {
+    auto filename = kTestsDir / "classic_box/CornellBox-Original.obj";
+    CameraOptions camera_opts(160, 120);
+    camera_opts.look_from = {-0.5, 1.5, 0.98};
+    camera_opts.look_to = {0.0, 1.0, 0.0};
+    RenderOptions render_opts{4};
+    render_opts.max_samples = 16;
+    auto expected = Render(filename, camera_opts, render_opts);
+
+    // the exposure Render picks, from the radiance of the whole frame
+    auto prepared = GetPreparedScene(filename, render_opts);
+    ThreadPool pool(0);
+    ScreenRays screen(camera_opts);
+    std::vector<std::vector<Vector>> img(160, std::vector<Vector>(120));
+    std::vector<uint64_t> rays_per_depth(4);
+    std::vector<std::vector<int>> samples_per_pixel;
+    TracePixels(*prepared, camera_opts, render_opts, screen, &pool, &img, &rays_per_depth);
+    SamplePixels(*prepared, camera_opts, render_opts, screen, &pool, &img, &rays_per_depth,
+                 &samples_per_pixel);
+    render_opts.white_radiance = GetMaxValue(img, &pool);
+
+    auto output =
+        std::filesystem::temp_directory_path() / ("raytracer_stream_" + std::to_string(getpid()));
+    output += ".png";
+    RenderStats stats;
+    render_opts.band_height = 7;
+    RenderToPng(filename, camera_opts, render_opts, output, &stats);
+    Image streamed(output);
+    REQUIRE(streamed.Width() == 160);
+    REQUIRE(streamed.Height() == 120);
+    REQUIRE(CountMismatches(streamed, expected) == 0);
+    // the bands traced the rows around them again
+    REQUIRE(stats.rays_per_depth[0] > rays_per_depth[0]);
+    REQUIRE(stats.samples_per_pixel.empty());
+
+    render_opts.band_height = 1000;
+    render_opts.wavefront = true;
+    render_opts.threads = 3;
+    RenderToPng(prepared, camera_opts, render_opts, output);
+    REQUIRE(CountMismatches(Image(output), expected) == 0);
+
+    // exposure estimated from a smaller render of the view
+    render_opts.white_radiance = 0;
+    render_opts.max_samples = 1;
+    auto single = Render(filename, camera_opts, render_opts);
+    RenderToPng(prepared, camera_opts, render_opts, output);
+    INFO(GetDistance(Image(output), single));
+    REQUIRE(GetDistance(Image(output), single) < 160 * 120);
+    std::filesystem::remove(output);
+}
@@ -0,0 +1,173 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Fixed set of worker threads with one task deque per worker. A worker takes tasks from the back
+// of its own deque and, once it runs dry, steals from the front of the others.
+class ThreadPool {
+public:
+    // 0 threads means one per hardware thread, negative counts throw std::invalid_argument
+    explicit ThreadPool(int threads = 0) {
+        if (threads < 0) {
+            throw std::invalid_argument("negative thread count " + std::to_string(threads));
+        }
+        size_t count = threads;
+        if (count == 0) {
+            count = std::max(1u, std::thread::hardware_concurrency());
+        }
+        queues_ = std::vector<Queue>(count);
+        workers_.reserve(count);
+        for (size_t i = 0; i < count; ++i) {
+            workers_.emplace_back([this, i] { WorkerLoop(i); });
+        }
+    }
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    ~ThreadPool() {
+        {
+            std::lock_guard lock(mutex_);
+            stop_ = true;
+        }
+        wake_.notify_all();
+        for (auto& worker : workers_) {
+            worker.join();
+        }
+    }
+
+    size_t Size() const {
+        return workers_.size();
+    }
+
+    // Runs task(index, worker) for every index in [0, count) and waits until all of them finish.
+    // worker is in [0, Size()) and lets tasks keep per-thread state. The first exception thrown
+    // by a task is rethrown here. Must not be called from inside a task.
+    void ParallelFor(size_t count, const std::function<void(size_t, size_t)>& task) {
+        if (count == 0) {
+            return;
+        }
+        Batch batch{task, count};
+        {
+            std::lock_guard lock(mutex_);
+            // contiguous ranges keep neighbouring tasks on one worker until stealing kicks in
+            for (size_t worker = 0; worker < queues_.size(); ++worker) {
+                size_t begin = count * worker / queues_.size();
+                size_t end = count * (worker + 1) / queues_.size();
+                std::lock_guard queue_lock(queues_[worker].mutex);
+                for (size_t index = end; index-- > begin;) {
+                    queues_[worker].jobs.push_back({&batch, index});
+                }
+            }
+            pending_ += count;
+        }
+        wake_.notify_all();
+
+        std::unique_lock lock(batch.mutex);
+        batch.done.wait(lock, [&batch] { return batch.remaining == 0; });
+        if (batch.exception) {
+            std::rethrow_exception(batch.exception);
+        }
+    }
+
+private:
+    struct Batch {
+        Batch(const std::function<void(size_t, size_t)>& task, size_t remaining)
+            : task(task), remaining(remaining) {
+        }
+
+        const std::function<void(size_t, size_t)>& task;
+        size_t remaining;
+        std::mutex mutex;
+        std::condition_variable done;
+        std::exception_ptr exception;
+    };
+
+    struct Job {
+        Batch* batch;
+        size_t index;
+    };
+
+    struct Queue {
+        std::mutex mutex;
+        std::deque<Job> jobs;
+    };
+
+    bool Pop(size_t worker, Job* job) {
+        Queue& queue = queues_[worker];
+        std::lock_guard lock(queue.mutex);
+        if (queue.jobs.empty()) {
+            return false;
+        }
+        *job = queue.jobs.back();
+        queue.jobs.pop_back();
+        --pending_;
+        return true;
+    }
+
+    bool Steal(size_t worker, Job* job) {
+        for (size_t i = 1; i < queues_.size(); ++i) {
+            Queue& queue = queues_[(worker + i) % queues_.size()];
+            std::lock_guard lock(queue.mutex);
+            if (queue.jobs.empty()) {
+                continue;
+            }
+            *job = queue.jobs.front();
+            queue.jobs.pop_front();
+            --pending_;
+            return true;
+        }
+        return false;
+    }
+
+    static void Run(const Job& job, size_t worker) {
+        Batch& batch = *job.batch;
+        try {
+            batch.task(job.index, worker);
+        } catch (...) {
+            std::lock_guard lock(batch.mutex);
+            if (!batch.exception) {
+                batch.exception = std::current_exception();
+            }
+        }
+        std::lock_guard lock(batch.mutex);
+        if (--batch.remaining == 0) {
+            batch.done.notify_all();
+        }
+    }
+
+    void WorkerLoop(size_t worker) {
+        while (true) {
+            Job job;
+            if (Pop(worker, &job) || Steal(worker, &job)) {
+                Run(job, worker);
+                continue;
+            }
+            std::unique_lock lock(mutex_);
+            wake_.wait(lock, [this] { return stop_ || pending_ > 0; });
+            if (stop_ && pending_ == 0) {
+                return;
+            }
+        }
+    }
+
+    std::vector<Queue> queues_;
+    std::vector<std::thread> workers_;
+
+    // guards stop_ and increments of pending_, so sleeping workers never miss new jobs
+    std::mutex mutex_;
+    std::condition_variable wake_;
+    std::atomic<size_t> pending_ = 0;
+    bool stop_ = false;
+};